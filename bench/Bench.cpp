@@ -0,0 +1,102 @@
+#include "Bench.h"
+
+#include <qguiapplication.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+qint64 Bench::peakRss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return qint64(counters.PeakWorkingSetSize);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return qint64(usage.ru_maxrss);        // Bytes on macOS
+#else
+    return qint64(usage.ru_maxrss) * 1024; // KiB on Linux
+#endif
+#endif
+}
+
+// Nearest rank, samples have to be sorted
+static double percentileMs(const std::vector<qint64>& samples, double p)
+{
+    const size_t rank = size_t(std::ceil(p / 100.0 * samples.size()));
+    return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)] / 1e6;
+}
+
+void Bench::record(const QString& name, double units, const char* unit, std::vector<qint64>& samples)
+{
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+
+    qint64 total = 0;
+    for (qint64 sample : samples) total += sample;
+    const double totalMs    = total / 1e6;
+    const double meanMs     = totalMs / samples.size();
+    const double throughput = totalMs > 0 ? units * samples.size() * 1000.0 / totalMs : 0;
+
+    QJsonObject result;
+    result["name"]           = name;
+    result["iterations"]     = int(samples.size());
+    result["unit"]           = QString(unit);
+    result["throughput"]     = throughput; // units per second
+    result["mean_ms"]        = meanMs;
+    result["min_ms"]         = samples.front() / 1e6;
+    result["p50_ms"]         = percentileMs(samples, 50);
+    result["p90_ms"]         = percentileMs(samples, 90);
+    result["p99_ms"]         = percentileMs(samples, 99);
+    result["max_ms"]         = samples.back() / 1e6;
+    result["peak_rss_bytes"] = peakRss(); // So far, shows which benchmark pushed it up
+    results.append(result);
+
+    std::fprintf(stderr, "%-44s %9.3f ms p50 %9.3f ms p99 %12.1f %s/s\n",
+                 name.toUtf8().constData(), percentileMs(samples, 50), percentileMs(samples, 99), throughput, unit);
+}
+
+void Bench::skip(const QString& name, const QString& reason)
+{
+    if (!wants(name)) return;
+
+    QJsonObject result;
+    result["name"]    = name;
+    result["skipped"] = reason;
+    results.append(result);
+    std::fprintf(stderr, "%-44s skipped: %s\n", name.toUtf8().constData(), reason.toUtf8().constData());
+}
+
+void Bench::check(const QString& name, bool passed, const QString& detail)
+{
+    if (!wants(name)) return;
+    if (!passed) failures++;
+
+    QJsonObject result;
+    result["name"]   = name;
+    result["passed"] = passed;
+    if (!detail.isEmpty()) result["detail"] = detail;
+    results.append(result);
+    std::fprintf(stderr, "%-44s %s %s\n", name.toUtf8().constData(), passed ? "ok" : "FAILED", detail.toUtf8().constData());
+}
+
+QJsonDocument Bench::report() const
+{
+    QJsonObject root = info;
+    root["qt"]             = QString(qVersion());
+    root["platform"]       = QGuiApplication::platformName();
+    root["peak_rss_bytes"] = peakRss();
+    root["benchmarks"]     = results;
+    return QJsonDocument(root);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <qelapsedtimer.h>
+#include <qjsonarray.h>
+#include <qjsondocument.h>
+#include <qjsonobject.h>
+#include <qstring.h>
+#include <vector>
+
+// Runs benchmarks and collects one timing per iteration, so results come with percentiles and not just an average.
+// Progress goes to stderr as it runs, report() is the machine readable version.
+class Bench
+{
+public:
+    QString filter; // Only names containing this run
+    QJsonObject info; // Extra top level fields for the report, like which brush kernel got used
+
+    // Times func(i) once per iteration. units is how much work one iteration does, for the throughput figure.
+    template<typename Func>
+    void run(const QString& name, int iterations, double units, const char* unit, Func&& func)
+    {
+        runWithSetup(name, iterations, units, unit, [](int) { }, func);
+    }
+
+    // Same, with setup(i) run before each iteration and left out of the timing
+    template<typename Setup, typename Func>
+    void runWithSetup(const QString& name, int iterations, double units, const char* unit, Setup&& setup, Func&& func)
+    {
+        if (!wants(name)) return;
+
+        std::vector<qint64> samples;
+        samples.reserve(iterations);
+        QElapsedTimer timer;
+        for (int i = 0; i < iterations; i++)
+        {
+            setup(i);
+            timer.start();
+            func(i);
+            samples.push_back(timer.nsecsElapsed());
+        }
+        record(name, units, unit, samples);
+    }
+
+    bool inline wants(const QString& name) const { return filter.isEmpty() || name.contains(filter); }
+    void skip(const QString& name, const QString& reason);
+    void check(const QString& name, bool passed, const QString& detail = QString()); // Not timed, has to come out right
+    bool inline failed() const { return failures > 0; }
+    QJsonDocument report() const;
+
+    static qint64 peakRss(); // Bytes, 0 where the platform can't tell
+
+private:
+    QJsonArray results;
+    int failures = 0;
+
+    void record(const QString& name, double units, const char* unit, std::vector<qint64>& samples);
+};
+
+// Canvas level paths: save, load, export, resize and the tools, see CanvasBench.cpp
+void benchCanvas(Bench& bench);
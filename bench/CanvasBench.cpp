@@ -0,0 +1,383 @@
+// The real canvas and tools, driven without a window.
+// Needs a QApplication, main.cpp picks the offscreen platform when there's no display.
+
+#include "Bench.h"
+#include "Canvas.h"
+#include "ImageExport.h"
+#include "NotebookFile.h"
+#include "Tools.h"
+#include <qcoreapplication.h>
+#include <qeventloop.h>
+#include <qimagewriter.h>
+#include <qrandom.h>
+#include <qstandardpaths.h>
+#include <qtemporarydir.h>
+#include <qtextcursor.h>
+#include <qtextdocument.h>
+#include <memory>
+
+// Lets the bench start strokes anywhere without faking mouse events
+class BenchDrawTool : public DrawTool
+{
+public:
+    void moveTo(const QPointF& p) { lastPoint = p; }
+};
+
+static QString sizeLabel(int size) { return QString("%1k").arg(size / 1024); }
+
+// Random short strokes through the draw tool, about one per 128px of edge,
+// so the ink is spread over the whole canvas but a 16k one still only allocates a few hundred tiles
+static void fillCanvas(Canvas& canvas, int size, quint32 seed)
+{
+    canvas.resizeImage(QSize(size, size));
+    BenchDrawTool tool;
+    tool.canvas = &canvas;
+    QRandomGenerator rng(seed);
+
+    for (int stroke = 0; stroke < size / 128; stroke++)
+    {
+        tool.setPenColor(QColor::fromRgb(rng.generate() | 0xff000000));
+        tool.setPenWidth(rng.bounded(2, 24));
+        QPointF p(rng.bounded(size), rng.bounded(size));
+        tool.moveTo(p);
+
+        canvas.beginEdit();
+        for (int i = 0; i < 64; i++)
+        {
+            p += QPointF(rng.bounded(32.0) - 16.0, rng.bounded(32.0) - 16.0);
+            tool.drawLineTo(p);
+        }
+        canvas.endEdit();
+    }
+}
+
+// Saves finish on the save thread, this waits for the canvas to say so
+static bool saveAndWait(Canvas& canvas, const QString& path)
+{
+    QEventLoop loop;
+    bool ok = false;
+    QObject::connect(&canvas, &Canvas::saveFinished, &loop, [&](const QString&, bool result) { ok = result; loop.quit(); });
+    if (!canvas.save(path)) return false;
+    loop.exec();
+    return ok;
+}
+
+static void benchSaveLoad(Bench& bench, const QTemporaryDir& scratch, int size)
+{
+    const QString label = sizeLabel(size);
+    if (!bench.wants("save full " + label) && !bench.wants("save incremental " + label) && !bench.wants("load " + label) && !bench.wants("load+decode " + label)) return;
+
+    const QString path = scratch.filePath(QString("canvas_%1.nb").arg(size));
+    const double megapixels = double(size) * size / 1e6;
+    const int iterations = size >= 16384 ? 3 : size >= 4096 ? 5 : 10;
+
+    // Fresh canvas every time, a canvas that has saved before copies unchanged tiles instead of encoding them
+    std::unique_ptr<Canvas> canvas;
+    bench.runWithSetup("save full " + label, iterations, megapixels, "Mpx",
+        [&](int i) { canvas.reset(new Canvas()); fillCanvas(*canvas, size, 100 + i); },
+        [&](int)   { saveAndWait(*canvas, path); });
+
+    if (!canvas) { canvas.reset(new Canvas()); fillCanvas(*canvas, size, 100); saveAndWait(*canvas, path); }
+
+    // One more stroke, then the save only has to encode the tiles it touched
+    BenchDrawTool tool;
+    tool.canvas = canvas.get();
+    tool.setPenWidth(8);
+    QRandomGenerator rng(5);
+    bench.runWithSetup("save incremental " + label, iterations * 2, megapixels, "Mpx",
+        [&](int)
+        {
+            QPointF p(rng.bounded(size), rng.bounded(size));
+            tool.moveTo(p);
+            for (int i = 0; i < 16; i++) { p += QPointF(rng.bounded(32.0) - 16.0, rng.bounded(32.0) - 16.0); tool.drawLineTo(p); }
+        },
+        [&](int) { saveAndWait(*canvas, path); });
+    canvas.reset();
+
+    // Loading only reads the manifest and text, tiles decode as they scroll into view
+    Canvas loaded;
+    bench.run("load " + label, iterations * 2, megapixels, "Mpx", [&](int) { loaded.load(path); });
+
+    // Everything decoded and flattened, what an export or a zoomed out view would wait for
+    bench.run("load+decode " + label, iterations, megapixels, "Mpx", [&](int)
+        {
+            loaded.load(path);
+            loaded.layers.composite(QRect(QPoint(0, 0), loaded.layers.size()), true);
+        });
+}
+
+static void benchExport(Bench& bench, const QTemporaryDir& scratch)
+{
+    // Exports cover the whole image
+    Canvas canvas;
+    fillCanvas(canvas, 2048, 7);
+    const double megapixels = canvas.layers.size().width() * double(canvas.layers.size().height()) / 1e6;
+
+    for (const QByteArray& format : QImageWriter::supportedImageFormats())
+    {
+        const QString name = "export " + QString::fromLatin1(format);
+        if (!bench.wants(name)) continue;
+
+        const QString path = scratch.filePath("export." + QString::fromLatin1(format));
+        if (!canvas.exportImg(path, format.constData())) { bench.skip(name, "writer failed"); continue; }
+        bench.run(name, 5, megapixels, "Mpx", [&](int) { canvas.exportImg(path, format.constData()); });
+    }
+
+    // PNG streams out in bands, so this one shouldn't need memory for more than a few of them
+    if (bench.wants("export png 16k"))
+    {
+        Canvas big;
+        fillCanvas(big, 16384, 7);
+        const QString path = scratch.filePath("export16k.png");
+        bench.run("export png 16k", 1, 16384.0 * 16384.0 / 1e6, "Mpx", [&](int) { big.exportImg(path, "png"); });
+    }
+}
+
+static void benchResize(Bench& bench)
+{
+    Canvas canvas;
+    fillCanvas(canvas, 1024, 11);
+
+    // 1k up to 16k in 256px steps, ten times over
+    const int steps = (16384 - 1024) / 256;
+    bench.run("resizeImage grow", steps * 10, 1, "resizes", [&](int i)
+        {
+            const int size = 1024 + 256 * (i % steps + 1);
+            canvas.resizeImage(QSize(size, size));
+        });
+}
+
+static void benchDrawLine(Bench& bench, int penWidth)
+{
+    Canvas canvas;
+    canvas.resizeImage(QSize(4096, 4096));
+    BenchDrawTool tool;
+    tool.canvas = &canvas;
+    tool.setPenWidth(penWidth);
+    tool.setPenColor(QColor(20, 80, 200, 200));
+    QRandomGenerator rng(3);
+    QPointF p(2048, 2048);
+
+    // Segments come in strokes of 64 like they would from a mouse, each stroke is one undo step
+    const int iterations = qMax(64, 64000 / (penWidth + 10) / 64 * 64);
+    bench.runWithSetup(QString("drawLineTo w=%1").arg(penWidth), iterations, 1, "segments",
+        [&](int i)
+        {
+            if (i % 64 != 0) return;
+            if (i > 0) canvas.endEdit();
+            QCoreApplication::processEvents(); // Let queued repaints go, they'd pile up otherwise
+            p = QPointF(rng.bounded(4096), rng.bounded(4096));
+            tool.moveTo(p);
+            canvas.beginEdit();
+        },
+        [&](int)
+        {
+            p += QPointF(rng.bounded(24.0) - 12.0, rng.bounded(24.0) - 12.0);
+            tool.drawLineTo(p);
+        });
+    canvas.endEdit();
+}
+
+static void benchShape(Bench& bench, ShapeTool::Shape shape, const char* shapeName, int penWidth)
+{
+    Canvas canvas;
+    canvas.resizeImage(QSize(4096, 4096));
+    ShapeTool tool;
+    tool.canvas = &canvas;
+    tool.selectedShape = shape;
+    tool.pen.setWidth(penWidth);
+    QRandomGenerator rng(9);
+
+    const int iterations = penWidth > 8 ? 500 : 2000;
+    bench.run(QString("drawCurrentShape %1 w=%2").arg(shapeName).arg(penWidth), iterations, 1, "shapes", [&](int)
+        {
+            const QPoint p1(rng.bounded(3584), rng.bounded(3584));
+            tool.drawCurrentShape(p1, p1 + QPoint(rng.bounded(16, 512), rng.bounded(16, 512)));
+        });
+}
+
+// A 4k square drawn on the ink, filled from inside. Undoing each fill keeps the tiles from piling up.
+static void benchFill(Bench& bench, int tolerance)
+{
+    Canvas canvas;
+    canvas.resizeImage(QSize(4096, 4096));
+    ShapeTool border;
+    border.canvas = &canvas;
+    border.pen.setWidth(4);
+    border.drawCurrentShape(QPoint(8, 8), QPoint(4088, 4088));
+
+    BucketTool tool;
+    tool.canvas = &canvas;
+    tool.tolerance = tolerance;
+    const double megapixels = 4076.0 * 4076.0 / 1e6;
+    bench.runWithSetup(QString("bucket fill 4k tol=%1").arg(tolerance), 10, megapixels, "Mpx",
+        [&](int i) { if (i > 0) canvas.undoInk(); },
+        [&](int)   { tool.fillAt(QPoint(2048, 2048)); });
+}
+
+// Opening reads the page list and the page that's shown, so 500 pages should open about as fast as one.
+// Flipping between two pages that stay resident costs no decoding once both have been shown.
+static void benchPages(Bench& bench, const QTemporaryDir& scratch, int pageCount)
+{
+    const QString path = scratch.filePath(QString("pages%1.nb").arg(pageCount));
+    {
+        Canvas canvas;
+        fillCanvas(canvas, 1024, 11);
+        for (int i = 1; i < pageCount; i++)
+        {
+            canvas.addPage();
+            fillCanvas(canvas, 1024, 11 + i);
+        }
+        canvas.showPage(0);
+        if (!saveAndWait(canvas, path)) { bench.skip(QString("pages %1").arg(pageCount), "save failed"); return; }
+    }
+
+    Canvas loaded;
+    bench.run(QString("open %1 pages").arg(pageCount), 20, 1, "opens", [&](int) { loaded.load(path); });
+    if (pageCount < 2) return;
+    bench.run(QString("flip pages (%1)").arg(pageCount), 200, 1, "flips", [&](int i) { loaded.showPage(i % 2); });
+}
+
+static void benchThumbnails(Bench& bench, const QTemporaryDir& scratch)
+{
+    const QString path = scratch.filePath("thumbnail.nb");
+    {
+        Canvas canvas;
+        fillCanvas(canvas, 4096, 23);
+        if (!saveAndWait(canvas, path)) { bench.skip("thumbnails", "save failed"); return; }
+    }
+    std::shared_ptr<MappedArchive> archive = MappedArchive::open(path);
+    LoadedNotebook index;
+    LoadedPage page;
+    if (!archive || !NotebookFile::readIndex(*archive, index) || !NotebookFile::readPage(archive, index.pages[0].manifest, page))
+    {
+        bench.skip("thumbnails", "load failed");
+        return;
+    }
+
+    // What the gallery does for a notebook it hasn't cached, against drawing one from the tiles like for older files
+    bench.run("read thumbnail", 200, 1, "notebooks", [&](int) { NotebookFile::readThumbnail(archive, 128); });
+    bench.run("thumbnail from tiles 4k", 5, 1, "notebooks", [&](int) { NotebookFile::renderThumbnail(page.layers, page.scene, 128); });
+}
+
+// Everything the canvas shows, flattened
+static QImage flattened(const Canvas& canvas)
+{
+    ImageExport flat;
+    flat.layers = canvas.layers.all();
+    flat.scene  = canvas.scene;
+    flat.area   = QRect(QPoint(0, 0), canvas.layers.size());
+    return flat.renderBand(flat.area);
+}
+
+// Not a timing. Edits journaled after a save have to replay on top of it to the same picture, undo and redo included,
+// though the history they went back into isn't there on a freshly loaded notebook.
+static void checkJournalRoundTrip(Bench& bench, const QTemporaryDir& scratch)
+{
+    const QString name = "journal round trip";
+    if (!bench.wants(name)) return;
+
+    // Until the first save the journal goes in app data, and the session file always does
+    QStandardPaths::setTestModeEnabled(true);
+    auto line = [](qreal x, qreal y)
+        {
+            VectorItem item;
+            item.points << QPointF(x, y) << QPointF(x + 200, y + 100);
+            return item;
+        };
+
+    QImage expected;
+    std::vector<quint32> expectedIds;
+    QString journalPath;
+    {
+        Canvas canvas;
+        canvas.startJournal();
+        fillCanvas(canvas, 1024, 11);
+        const quint32 kept = canvas.addVector(line(100, 100));
+        canvas.addVector(line(300, 500));
+        if (!saveAndWait(canvas, scratch.filePath("journal.nb")))
+        {
+            QStandardPaths::setTestModeEnabled(false);
+            bench.skip(name, "save failed");
+            return;
+        }
+
+        // All of it goes back to before the save: an item made then, and the undo steps
+        canvas.extendVector(kept, QPolygonF() << QPointF(400, 300) << QPointF(500, 600));
+        canvas.undoInk(); // The second item
+        canvas.undoInk(); // The last stroke
+        canvas.redoInk();
+        expected    = flattened(canvas);
+        expectedIds = canvas.scene.ids();
+        journalPath = canvas.journal.fileName();
+    }
+
+    Canvas recovered;
+    QString failure;
+    if (!recovered.recoverJournal(journalPath))    failure = "recovery failed";
+    else if (recovered.scene.ids() != expectedIds) failure = "vector items differ";
+    else if (flattened(recovered) != expected)     failure = "pixels differ";
+    recovered.journal.close(true);
+    QStandardPaths::setTestModeEnabled(false);
+    bench.check(name, failure.isEmpty(), failure);
+}
+
+// Not a timing either. Text typed while a page's text is still streaming in from the file has to make it into the next save.
+static void checkTypingWhileLoading(Bench& bench, const QTemporaryDir& scratch)
+{
+    const QString name = "text typed while loading";
+    if (!bench.wants(name)) return;
+
+    const QString path = scratch.filePath("typing.nb");
+    const int lines = 5000;
+    {
+        Canvas canvas;
+        QStringList text;
+        for (int i = 0; i < lines; i++) text << QString("Line %1").arg(i);
+        canvas.document()->setPlainText(text.join('\n'));
+        if (!saveAndWait(canvas, path)) { bench.skip(name, "save failed"); return; }
+    }
+
+    // Only the first screen of it is in right after loading
+    Canvas loaded;
+    if (!loaded.load(path)) { bench.skip(name, "load failed"); return; }
+    if (loaded.document()->blockCount() >= lines) { bench.skip(name, "text loaded in one go"); return; }
+    QTextCursor(loaded.document()).insertText("Typed ");
+    if (!saveAndWait(loaded, path)) { bench.skip(name, "save failed"); return; }
+
+    Canvas reloaded;
+    QString failure;
+    if (!reloaded.load(path)) failure = "reload failed";
+    else
+    {
+        reloaded.finishText();
+        if (!reloaded.document()->toPlainText().startsWith("Typed Line 0")) failure = "typed text lost";
+        else if (reloaded.document()->blockCount() != lines) failure = "text cut short";
+    }
+    bench.check(name, failure.isEmpty(), failure);
+}
+
+void benchCanvas(Bench& bench)
+{
+    QTemporaryDir scratch;
+    if (!scratch.isValid()) { bench.skip("canvas", "no temp dir"); return; }
+
+    for (int width : { 1, 4, 16, 64, 256 }) benchDrawLine(bench, width);
+
+    for (int width : { 1, 16 })
+    {
+        benchShape(bench, ShapeTool::Shape::rect,    "rect",    width);
+        benchShape(bench, ShapeTool::Shape::ellipse, "ellipse", width);
+        benchShape(bench, ShapeTool::Shape::line,    "line",    width);
+    }
+
+    for (int tolerance : { 0, 32 }) benchFill(bench, tolerance);
+
+    benchResize(bench);
+    benchExport(bench, scratch);
+    for (int size : { 1024, 4096, 16384 }) benchSaveLoad(bench, scratch, size);
+    for (int pageCount : { 1, 500 }) benchPages(bench, scratch, pageCount);
+    benchThumbnails(bench, scratch);
+    checkJournalRoundTrip(bench, scratch);
+    checkTypingWhileLoading(bench, scratch);
+}
@@ -0,0 +1,185 @@
+// Microbenchmarks for the canvas pixel paths and the canvas itself
+// Run the Release build, Debug numbers are meaningless
+//
+// bench [--filter <text>] [--out <file.json>]
+// Runs without a display, the offscreen platform is used unless QT_QPA_PLATFORM says otherwise.
+// Results go to stdout as JSON (or to --out), progress to stderr. Exits with 1 if a check failed.
+
+#include <QtWidgets/QApplication>
+#include <qfile.h>
+#include <qimage.h>
+#include <qpainter.h>
+#include <qrandom.h>
+#include <cstdio>
+#include "Bench.h"
+#include "TiledImage.h"
+#include "BrushRasterizer.h"
+
+static const QSize viewportSize { 1920, 1080 };
+static const double viewportMpx = double(viewportSize.width()) * viewportSize.height() / 1e6;
+
+static QImage makeInk(QImage::Format fmt)
+{
+    QImage img(viewportSize, fmt);
+    img.fill(Qt::transparent);
+    QPainter painter(&img);
+    QRandomGenerator rng(1234);
+    for (int i = 0; i < 2000; i++)
+    {
+        painter.setPen(QPen(QColor::fromRgb(rng.generate()), rng.bounded(1, 20), Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
+        painter.drawLine(rng.bounded(viewportSize.width()), rng.bounded(viewportSize.height()),
+                         rng.bounded(viewportSize.width()), rng.bounded(viewportSize.height()));
+    }
+    return img;
+}
+
+// The window backing store is premultiplied, so that's what we blit into
+static void benchBlit(Bench& bench, const char* name, QImage::Format fmt)
+{
+    if (!bench.wants(name)) return;
+    const QImage ink = makeInk(fmt);
+    QImage target(viewportSize, QImage::Format_ARGB32_Premultiplied);
+    target.fill(Qt::white);
+
+    bench.run(name, 200, viewportMpx, "Mpx", [&](int)
+        {
+            QPainter painter(&target);
+            painter.drawImage(QPoint(0, 0), ink);
+        });
+}
+
+static void benchTiledBlit(Bench& bench)
+{
+    if (!bench.wants("blit TiledImage")) return;
+    TiledImage tiles;
+    tiles.setImage(makeInk(QImage::Format_ARGB32));
+    QImage target(viewportSize, QImage::Format_ARGB32_Premultiplied);
+    target.fill(Qt::white);
+
+    bench.run("blit TiledImage", 200, viewportMpx, "Mpx", [&](int)
+        {
+            QPainter painter(&target);
+            tiles.draw(painter, target.rect());
+        });
+}
+
+// Same strokes DrawTool makes: Source mode, round caps and joins
+static void benchStroke(Bench& bench, const char* name, QImage::Format fmt, int penWidth)
+{
+    QImage img(viewportSize, fmt);
+    img.fill(Qt::transparent);
+    QRandomGenerator rng(42);
+    const QPen pen(QColor(20, 80, 200, 200), penWidth, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
+
+    bench.run(QString("%1 w=%2").arg(name).arg(penWidth), 5000, 1, "strokes", [&](int)
+        {
+            QPainter painter(&img);
+            painter.setCompositionMode(QPainter::CompositionMode_Source);
+            painter.setPen(pen);
+            const QPoint p(rng.bounded(viewportSize.width()), rng.bounded(viewportSize.height()));
+            painter.drawLine(p, p + QPoint(rng.bounded(-30, 30), rng.bounded(-30, 30)));
+        });
+}
+
+// One frame worth of draw tool input: a short random walk
+static QPolygonF makeStroke(QRandomGenerator& rng, const QSize& area)
+{
+    QPolygonF stroke;
+    QPointF p(rng.bounded(area.width()), rng.bounded(area.height()));
+    for (int i = 0; i < 8; i++)
+    {
+        stroke << p;
+        p += QPointF(rng.bounded(-12.0) + 6.0, rng.bounded(-12.0) + 6.0);
+    }
+    return stroke;
+}
+
+static int brushIterations(int penWidth) { return qMax(20, 40000 / (penWidth + 10)); }
+
+// What DrawTool used to do: a QPainter line per segment, each with its own round caps
+static void benchPainterBrush(Bench& bench, int penWidth)
+{
+    TiledImage tiles;
+    tiles.resize(QSize(4096, 4096));
+    QRandomGenerator rng(7);
+    const QPen pen(QColor(20, 80, 200, 200), penWidth, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
+
+    bench.run(QString("brush QPainter w=%1").arg(penWidth), brushIterations(penWidth), 1, "strokes", [&](int)
+        {
+            const QPolygonF stroke = makeStroke(rng, tiles.size());
+            const int rad = penWidth / 2 + 2;
+            const QRect bounds = stroke.boundingRect().toAlignedRect().adjusted(-rad, -rad, rad, rad);
+            tiles.editTiles(bounds, [&](QImage& tile, const QRect& tileRect)
+                {
+                    QPainter painter(&tile);
+                    painter.translate(-tileRect.topLeft());
+                    painter.setCompositionMode(QPainter::CompositionMode_Source);
+                    painter.setPen(pen);
+                    for (int i = 1; i < stroke.size(); i++) painter.drawLine(stroke[i - 1], stroke[i]);
+                });
+        });
+}
+
+static void benchRasterBrush(Bench& bench, int penWidth, BrushRasterizer::Kernel kernel, bool erase)
+{
+    TiledImage tiles;
+    tiles.resize(QSize(4096, 4096));
+    QRandomGenerator rng(7);
+
+    const QString name = QString("brush %1%2 w=%3").arg(BrushRasterizer::kernelName(kernel)).arg(erase ? " erase" : "").arg(penWidth);
+    bench.run(name, brushIterations(penWidth), 1, "strokes", [&](int)
+        {
+            const BrushRasterizer brush(makeStroke(rng, tiles.size()), penWidth, QColor(20, 80, 200, 200), erase);
+            tiles.editTiles(brush.bounds(), [&](QImage& tile, const QRect& tileRect)
+                {
+                    brush.render(tile, tileRect.topLeft(), kernel);
+                });
+        });
+}
+
+int main(int argc, char* argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication app(argc, argv);
+
+    Bench bench;
+    QString outPath;
+    const QStringList args = app.arguments();
+    for (int i = 1; i + 1 < args.size(); i++)
+    {
+        if (args[i] == "--filter") bench.filter = args[++i];
+        else if (args[i] == "--out") outPath = args[++i];
+    }
+    bench.info["brushKernel"] = QString(BrushRasterizer::kernelName(BrushRasterizer::bestKernel()));
+
+    benchBlit(bench, "blit ARGB32 (before)", QImage::Format_ARGB32);
+    benchBlit(bench, "blit ARGB32_Premultiplied (after)", QImage::Format_ARGB32_Premultiplied);
+    benchTiledBlit(bench);
+
+    for (int width : { 1, 4, 16, 64 })
+    {
+        benchStroke(bench, "stroke ARGB32 (before)", QImage::Format_ARGB32, width);
+        benchStroke(bench, "stroke ARGB32_Premultiplied (after)", QImage::Format_ARGB32_Premultiplied, width);
+    }
+
+    // The spin box goes from 1 to 1000
+    for (int width : { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1000 })
+    {
+        benchPainterBrush(bench, width);
+        benchRasterBrush(bench, width, BrushRasterizer::Kernel::scalar, false);
+        benchRasterBrush(bench, width, BrushRasterizer::Kernel::sse2, false);
+        if (BrushRasterizer::bestKernel() == BrushRasterizer::Kernel::avx2)
+            benchRasterBrush(bench, width, BrushRasterizer::Kernel::avx2, false);
+        benchRasterBrush(bench, width, BrushRasterizer::bestKernel(), true);
+    }
+
+    benchCanvas(bench);
+
+    // A failed check fails the run, the report still goes out
+    const QByteArray json = bench.report().toJson();
+    if (outPath.isEmpty()) { std::fwrite(json.constData(), 1, size_t(json.size()), stdout); return bench.failed() ? 1 : 0; }
+
+    QFile out(outPath);
+    if (!out.open(QIODevice::WriteOnly) || out.write(json) != json.size()) return 1;
+    return bench.failed() ? 1 : 0;
+}
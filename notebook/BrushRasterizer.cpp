@@ -0,0 +1,316 @@
+#include "BrushRasterizer.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define BRUSH_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BRUSH_TARGET_AVX2
+#else
+#define BRUSH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Coverage of one segment for count pixels of a row, max'd into out.
+// Pixel centers are at x0 + i, y. Coverage falls off linearly over the pixel past radius.
+static void coverageScalar(const float* seg, float x0, float y, float reach, float* out, int count)
+{
+    const float ax = seg[0], ay = seg[1], dx = seg[2], dy = seg[3], inv = seg[4];
+    const float fy = y - ay;
+    for (int i = 0; i < count; i++)
+    {
+        const float fx = x0 + i - ax;
+        const float t  = std::min(1.0f, std::max(0.0f, (fx * dx + fy * dy) * inv));
+        const float qx = fx - t * dx, qy = fy - t * dy;
+        const float c  = reach - std::sqrt(qx * qx + qy * qy);
+        out[i] = std::max(out[i], std::min(1.0f, c));
+    }
+}
+
+// Same rounding as Qt's own blending, x * a / 255 per channel
+static inline quint32 byteMul(quint32 x, quint32 a)
+{
+    quint32 t = (x & 0xff00ff) * a;
+    t = ((t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8) & 0xff00ff;
+    x = ((x >> 8) & 0xff00ff) * a;
+    x = (x + ((x >> 8) & 0xff00ff) + 0x800080) & 0xff00ff00;
+    return x | t;
+}
+
+// (x * a + y * b) / 255 per channel, rounded once so it can't overflow a channel
+static inline quint32 interpolate255(quint32 x, quint32 a, quint32 y, quint32 b)
+{
+    quint32 t = (x & 0xff00ff) * a + (y & 0xff00ff) * b;
+    t = ((t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8) & 0xff00ff;
+    x = ((x >> 8) & 0xff00ff) * a + ((y >> 8) & 0xff00ff) * b;
+    x = (x + ((x >> 8) & 0xff00ff) + 0x800080) & 0xff00ff00;
+    return x | t;
+}
+
+// Source mode by coverage, one pixel. Erasing only has to scale dst down.
+static inline void blendPixel(quint32& dst, quint32 color, float coverage, bool erase)
+{
+    const int c = int(coverage * 255.0f + 0.5f);
+    if (c <= 0) return;
+    if (c >= 255) { dst = color; return; }
+    dst = erase ? byteMul(dst, 255 - c) : interpolate255(color, c, dst, 255 - c);
+}
+
+static void blendScalar(quint32* dst, const float* coverage, int count, quint32 color, bool erase)
+{
+    for (int i = 0; i < count; i++) blendPixel(dst[i], color, coverage[i], erase);
+}
+
+#ifdef BRUSH_X86
+static void coverageSse2(const float* seg, float x0, float y, float reach, float* out, int count)
+{
+    const __m128 ax = _mm_set1_ps(seg[0]), dx = _mm_set1_ps(seg[2]), dy = _mm_set1_ps(seg[3]), inv = _mm_set1_ps(seg[4]);
+    const __m128 fy = _mm_set1_ps(y - seg[1]);
+    const __m128 fyDy = _mm_mul_ps(fy, dy);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), r = _mm_set1_ps(reach);
+    __m128 x = _mm_add_ps(_mm_set1_ps(x0), _mm_setr_ps(0, 1, 2, 3));
+    const __m128 step = _mm_set1_ps(4.0f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4, x = _mm_add_ps(x, step))
+    {
+        const __m128 fx = _mm_sub_ps(x, ax);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(fx, dx), fyDy), inv);
+        t = _mm_min_ps(one, _mm_max_ps(zero, t));
+        const __m128 qx = _mm_sub_ps(fx, _mm_mul_ps(t, dx));
+        const __m128 qy = _mm_sub_ps(fy, _mm_mul_ps(t, dy));
+        const __m128 d  = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)));
+        const __m128 c  = _mm_min_ps(one, _mm_sub_ps(r, d));
+        _mm_storeu_ps(out + i, _mm_max_ps(_mm_loadu_ps(out + i), c));
+    }
+    coverageScalar(seg, x0 + i, y, reach, out + i, count - i);
+}
+
+// Fully covered and uncovered runs are most of a thick stroke, those go four at a time
+static void blendSse2(quint32* dst, const float* coverage, int count, quint32 color, bool erase)
+{
+    const __m128 full = _mm_set1_ps(254.5f / 255.0f), none = _mm_set1_ps(0.5f / 255.0f);
+    const __m128i fill = _mm_set1_epi32(int(color));
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 c = _mm_loadu_ps(coverage + i);
+        if (_mm_movemask_ps(_mm_cmpge_ps(c, none)) == 0) continue;
+        if (_mm_movemask_ps(_mm_cmpge_ps(c, full)) == 0xf)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), fill);
+            continue;
+        }
+        for (int j = i; j < i + 4; j++) blendPixel(dst[j], color, coverage[j], erase);
+    }
+    blendScalar(dst + i, coverage + i, count - i, color, erase);
+}
+
+BRUSH_TARGET_AVX2
+static void coverageAvx2(const float* seg, float x0, float y, float reach, float* out, int count)
+{
+    const __m256 ax = _mm256_set1_ps(seg[0]), dx = _mm256_set1_ps(seg[2]), dy = _mm256_set1_ps(seg[3]), inv = _mm256_set1_ps(seg[4]);
+    const __m256 fy = _mm256_set1_ps(y - seg[1]);
+    const __m256 fyDy = _mm256_mul_ps(fy, dy);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), r = _mm256_set1_ps(reach);
+    __m256 x = _mm256_add_ps(_mm256_set1_ps(x0), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256 step = _mm256_set1_ps(8.0f);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8, x = _mm256_add_ps(x, step))
+    {
+        const __m256 fx = _mm256_sub_ps(x, ax);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(fx, dx), fyDy), inv);
+        t = _mm256_min_ps(one, _mm256_max_ps(zero, t));
+        const __m256 qx = _mm256_sub_ps(fx, _mm256_mul_ps(t, dx));
+        const __m256 qy = _mm256_sub_ps(fy, _mm256_mul_ps(t, dy));
+        const __m256 d  = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(qx, qx), _mm256_mul_ps(qy, qy)));
+        const __m256 c  = _mm256_min_ps(one, _mm256_sub_ps(r, d));
+        _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_loadu_ps(out + i), c));
+    }
+    coverageScalar(seg, x0 + i, y, reach, out + i, count - i);
+}
+
+BRUSH_TARGET_AVX2
+static void blendAvx2(quint32* dst, const float* coverage, int count, quint32 color, bool erase)
+{
+    const __m256 full = _mm256_set1_ps(254.5f / 255.0f), none = _mm256_set1_ps(0.5f / 255.0f);
+    const __m256i fill = _mm256_set1_epi32(int(color));
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 c = _mm256_loadu_ps(coverage + i);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(c, none, _CMP_GE_OQ)) == 0) continue;
+        if (_mm256_movemask_ps(_mm256_cmp_ps(c, full, _CMP_GE_OQ)) == 0xff)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), fill);
+            continue;
+        }
+        for (int j = i; j < i + 8; j++) blendPixel(dst[j], color, coverage[j], erase);
+    }
+    blendScalar(dst + i, coverage + i, count - i, color, erase);
+}
+
+static bool cpuHasAvx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false; // The OS has to save the ymm registers
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+BrushRasterizer::Kernel BrushRasterizer::bestKernel()
+{
+#ifdef BRUSH_X86
+    static const Kernel best = cpuHasAvx2() ? Kernel::avx2 : Kernel::sse2;
+    return best;
+#else
+    return Kernel::scalar;
+#endif
+}
+
+const char* BrushRasterizer::kernelName(Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Kernel::sse2: return "sse2";
+    case Kernel::avx2: return "avx2";
+    default:           return "scalar";
+    }
+}
+
+BrushRasterizer::BrushRasterizer(const QPolygonF& points, qreal width, const QColor& brushColor, bool eraseMode)
+    : radius(float(std::max<qreal>(width, 1.0) / 2)), color(qPremultiply(brushColor.rgba())), erase(eraseMode)
+{
+    if (erase) color = 0;
+    if (points.isEmpty()) return;
+
+    // A single point is still a dot, same as a zero length line with round caps
+    const int count = std::max(1, points.size() - 1);
+    segments.reserve(count);
+    QRectF extent;
+    for (int i = 0; i < count; i++)
+    {
+        const QPointF a = points[i], b = points[std::min(i + 1, points.size() - 1)];
+
+        Segment s;
+        s.ax = float(a.x()); s.ay = float(a.y());
+        s.dx = float(b.x() - a.x()); s.dy = float(b.y() - a.y());
+        const float length2 = s.dx * s.dx + s.dy * s.dy;
+        s.invLength2 = length2 > 1e-6f ? 1.0f / length2 : 0.0f;
+        s.top    = std::min(s.ay, s.ay + s.dy) - radius - 1;
+        s.bottom = std::max(s.ay, s.ay + s.dy) + radius + 1;
+        segments.push_back(s);
+
+        extent |= QRectF(a, b).normalized();
+    }
+
+    const qreal pad = radius + 1;
+    box = extent.adjusted(-pad, -pad, pad, pad).toAlignedRect();
+}
+
+// Horizontal extent of the segment's capsule on row y, so the kernels only run where there's something to cover
+bool BrushRasterizer::rowSpan(const Segment& s, float y, float& left, float& right) const
+{
+    const float reach = radius + 1;
+    left = 1e30f; right = -1e30f;
+
+    // The two end caps
+    const float ends[2][2] = { { s.ax, s.ay }, { s.ax + s.dx, s.ay + s.dy } };
+    for (const auto& end : ends)
+    {
+        const float dy = y - end[1];
+        if (std::abs(dy) > reach) continue;
+        const float half = std::sqrt(reach * reach - dy * dy);
+        left  = std::min(left,  end[0] - half);
+        right = std::max(right, end[0] + half);
+    }
+
+    // The body, a rectangle along the segment, 2 * reach wide
+    if (s.invLength2 > 0)
+    {
+        const float scale = reach * std::sqrt(s.invLength2);
+        const float nx = -s.dy * scale, ny = s.dx * scale;
+        const float corners[4][2] = { { s.ax + nx, s.ay + ny }, { s.ax + s.dx + nx, s.ay + s.dy + ny },
+                                      { s.ax + s.dx - nx, s.ay + s.dy - ny }, { s.ax - nx, s.ay - ny } };
+        for (int i = 0; i < 4; i++)
+        {
+            const float* p = corners[i];
+            const float* q = corners[(i + 1) % 4];
+            if (y < std::min(p[1], q[1]) || y > std::max(p[1], q[1])) continue;
+            const float x = p[1] == q[1] ? p[0] : p[0] + (y - p[1]) / (q[1] - p[1]) * (q[0] - p[0]);
+            left  = std::min(left, x);
+            right = std::max(right, x);
+            if (p[1] == q[1]) { left = std::min(left, q[0]); right = std::max(right, q[0]); }
+        }
+    }
+    return left <= right;
+}
+
+void BrushRasterizer::render(QImage& target, const QPoint& origin, Kernel kernel) const
+{
+    Q_ASSERT(target.format() == QImage::Format_ARGB32_Premultiplied);
+
+    const QRect area = box.intersected(QRect(origin, target.size()));
+    if (area.isEmpty()) return;
+
+    using CoverageFunc = void (*)(const float*, float, float, float, float*, int);
+    using BlendFunc    = void (*)(quint32*, const float*, int, quint32, bool);
+    CoverageFunc coverageRow = coverageScalar;
+    BlendFunc    blendRow    = blendScalar;
+#ifdef BRUSH_X86
+    if (kernel == Kernel::sse2) { coverageRow = coverageSse2; blendRow = blendSse2; }
+    if (kernel == Kernel::avx2) { coverageRow = coverageAvx2; blendRow = blendAvx2; }
+#endif
+
+    // Only the segments that reach into this target
+    std::vector<const Segment*> local;
+    for (const Segment& s : segments)
+    {
+        if (s.bottom >= area.top() && s.top <= area.bottom() + 1) local.push_back(&s);
+    }
+
+    const float reach = radius + 0.5f;
+    std::vector<float> coverage(area.width());
+    for (int y = area.top(); y <= area.bottom(); y++)
+    {
+        const float py = y + 0.5f;
+        int first = area.right() + 1, last = area.left() - 1;
+
+        for (const Segment* s : local)
+        {
+            if (py < s->top || py > s->bottom) continue;
+
+            float left, right;
+            if (!rowSpan(*s, py, left, right)) continue;
+            const int x0 = std::max(area.left(),  int(std::floor(left)));
+            const int x1 = std::min(area.right(), int(std::ceil(right)));
+            if (x0 > x1) continue;
+
+            // Grow the touched range, clearing whatever part of it is new
+            if (first > last) { std::fill(coverage.begin() + (x0 - area.left()), coverage.begin() + (x1 - area.left() + 1), 0.0f); first = x0; last = x1; }
+            if (x0 < first) { std::fill(coverage.begin() + (x0 - area.left()), coverage.begin() + (first - area.left()), 0.0f); first = x0; }
+            if (x1 > last)  { std::fill(coverage.begin() + (last + 1 - area.left()), coverage.begin() + (x1 - area.left() + 1), 0.0f); last = x1; }
+
+            coverageRow(&s->ax, x0 + 0.5f, py, reach, coverage.data() + (x0 - area.left()), x1 - x0 + 1);
+        }
+        if (first > last) continue;
+
+        quint32* row = reinterpret_cast<quint32*>(target.scanLine(y - origin.y())) + (first - origin.x());
+        blendRow(row, coverage.data() + (first - area.left()), last - first + 1, color, erase);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <qcolor.h>
+#include <qimage.h>
+#include <qpolygon.h>
+#include <qrect.h>
+#include <vector>
+
+// Antialiased round brush for the draw tool and eraser.
+// QPainter strokes every segment with its own round caps, so a thick polyline redraws the joints over and over.
+// This works out coverage per pixel as the distance to the nearest segment instead,
+// so each pixel of the stroke is blended exactly once no matter how many segments overlap it.
+// Blending is always Source mode like the draw tool: color replaces what's there by coverage,
+// erasing is the same with transparent and skips everything but scaling dst down.
+class BrushRasterizer
+{
+public:
+    enum class Kernel
+    {
+        scalar,
+        sse2,
+        avx2
+    };
+
+    static Kernel bestKernel(); // Checked once, the fastest this cpu can run
+    static const char* kernelName(Kernel kernel);
+
+    BrushRasterizer(const QPolygonF& points, qreal width, const QColor& color, bool erase = false);
+
+    // Every pixel the stroke can touch, in image coords
+    QRect inline bounds() const { return box; }
+
+    // target has to be premultiplied ARGB32, origin is where its top left sits in image coords
+    void render(QImage& target, const QPoint& origin) const { render(target, origin, bestKernel()); }
+    void render(QImage& target, const QPoint& origin, Kernel kernel) const;
+
+private:
+    // The kernels read the first five as a float array, keep them together and in this order
+    struct Segment
+    {
+        float ax, ay;     // Start
+        float dx, dy;     // End - start
+        float invLength2; // 0 for a dot
+        float top, bottom;
+    };
+
+    std::vector<Segment> segments;
+    float   radius;  // Coverage is 1 within radius, fading to 0 over the next pixel
+    quint32 color;   // Premultiplied
+    bool    erase;
+    QRect   box;
+
+    bool rowSpan(const Segment& s, float y, float& left, float& right) const;
+};
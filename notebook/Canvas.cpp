@@ -1,77 +1,527 @@
 #include "Canvas.h"
 #include "Tool.h"
+#include "NotebookFile.h"
+#include "ImageExport.h"
+#include "Trace.h"
+#include <qcoreapplication.h>
+#include <qfileinfo.h>
+#include <qsavefile.h>
+#include <qmath.h>
+#include <qgesture.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 
 Canvas::Canvas(QWidget* parent) : QTextEdit::QTextEdit(parent)
 {
-    
+    repaintScheduler = new RepaintScheduler(viewport(), this);
+    saveQueue.setMaxThreadCount(1);
+    exportQueue.setMaxThreadCount(1);
+    viewport()->grabGesture(Qt::PinchGesture);
+    textTimer.setInterval(0);
+    connect(&textTimer, &QTimer::timeout, this, [this]() { readText(8); });
+
+    pages.push_back(blankPage("Page 1", QString()));
+    activatePage(0, nullptr);
+}
+
+Canvas::~Canvas()
+{
+    // Don't let the app exit with a save half done, an export can just stop
+    cancelExport();
+    saveQueue.waitForDone();
+    exportQueue.waitForDone();
+    decodeQueue.waitForDone();
+
+    // Saves that are written get committed in their completion, it has to run before this goes.
+    // Nobody is left to tell about it.
+    blockSignals(true);
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+
+    // The pages own their documents, the editor can't be left pointing at one
+    setDocument(nullptr);
 }
 
 bool Canvas::save(const QString& filePath)
 {
-    using OpenFlags = QIODevice::OpenModeFlag;
-    QuaZip saveZip(filePath);
-    saveZip.open(QuaZip::mdCreate);
+    TRACE_SCOPE("Canvas::save");
+
+    // A text still loading has to be all in first or the rest of it would be lost
+    finishText();
+    SaveSnapshot snapshot;
+    snapshot.filePath   = filePath;
+    snapshot.activePage = activePage;
+    snapshot.generation = ++saveGeneration;
+    snapshot.source     = archive;
+    QHash<quint32, int> textRevisions; // Of the documents as they went into the snapshot, by page id
+    for (int i = 0; i < int(pages.size()); i++)
+    {
+        Page& page = pages[i];
+        PageSnapshot out;
+        out.id             = page.id;
+        out.title          = page.title;
+        out.section        = page.section;
+        out.resident       = page.resident;
+        out.sourceManifest = page.manifest;
+        if (page.resident)
+        {
+            const bool shown = i == activePage;
+            out.layers         = shown ? layers.all()         : page.layers;
+            out.activeLayer    = shown ? layers.activeIndex() : page.activeLayer;
+            out.scene          = shown ? scene                : page.scene;
+            out.sourceVersions = shown ? savedVersions        : page.savedVersions;
+
+            // Text that wasn't typed in since it came out of the archive gets copied over compressed, like unchanged tiles.
+            // Otherwise the save thread encodes and deflates a copy of the document, copying it is all that happens here.
+            const QTextDocument& text = *page.text;
+            out.textChanged = text.isModified() || page.manifest.isEmpty() || !archive;
+            if (out.textChanged)
+            {
+                out.text.reset(text.clone());
+                out.text->moveToThread(nullptr); // Read and let go of on the save thread
+            }
+            textRevisions.insert(page.id, text.revision());
+        }
+        page.modified = false;
+        snapshot.pages.push_back(std::move(out));
+    }
+
+    // Anything drawn while the save runs marks it dirty again, and stays in the journal after it
+    modified = false;
+    savesInFlight++;
+    const qint64 checkpoint = journal.position();
+
+    saveQueue.start(QRunnable::create([this, snapshot]()
+        {
+            TRACE_SCOPE("NotebookFile::write");
+            std::shared_ptr<QSaveFile> saveFile(new QSaveFile(snapshot.filePath));
+            const NotebookFile::Result result = NotebookFile::write(snapshot, saveGeneration, *saveFile);
+            QHash<quint32, QHash<quint32, QHash<quint64, quint64>>> versions; // By page id, then layer id
+            for (const PageSnapshot& page : snapshot.pages)
+            {
+                QHash<quint32, QHash<quint64, quint64>>& pageVersions = versions[page.id];
+                for (const Layer& layer : page.layers) pageVersions.insert(layer.id, layer.image.tileVersions());
+            }
+
+            QMetaObject::invokeMethod(this, [this, result, saveFile, path = snapshot.filePath, versions, textRevisions, checkpoint]()
+                {
+                    if (result == NotebookFile::Result::superseded) { savesInFlight--; return; }
+                    auto finish = [this, result, saveFile, path, versions, textRevisions, checkpoint]()
+                        {
+                            finishSave(saveFile, result == NotebookFile::Result::ok, path, versions, textRevisions, checkpoint);
+                        };
+
+                    // An export still decoding pending tiles out of the file this replaces has it open.
+                    // The commit waits for it, the save counts as in flight until then so no page gets let go of.
+                    if (result == NotebookFile::Result::ok && exportSource && exportSource->filePath() == QFileInfo(path).absoluteFilePath())
+                        afterExport.push_back(finish);
+                    else finish();
+                }, Qt::QueuedConnection);
+        }));
+    return true;
+}
+
+void Canvas::finishSave(const std::shared_ptr<QSaveFile>& saveFile, bool ok, const QString& path,
+                        const QHash<quint32, QHash<quint32, QHash<quint64, quint64>>>& versions,
+                        const QHash<quint32, int>& textRevisions, qint64 checkpoint)
+{
+    savesInFlight--;
 
-    // Write image
-    QImage visibleImage = image;
-    resizeImage(&visibleImage, size());
+    // Committed here rather than on the save thread, so the loaders get switched over in the same go.
+    // Over the open file the archive lets go of it for the rename, see MappedArchive::remap. Not while
+    // another save runs, that one may be copying raw entries out of it, and it supersedes this one anyway.
+    const bool overArchive = archive && archive->filePath() == QFileInfo(path).absoluteFilePath();
+    if (ok && overArchive && savesInFlight > 0) { saveFile->cancelWriting(); return; }
+    if (ok) ok = overArchive ? archive->remap([&saveFile]() { return saveFile->commit(); }) : saveFile->commit();
+    if (ok)
+    {
+        notebookPath = QFileInfo(path).absoluteFilePath();
+        if (journaling) journal.rebase(notebookPath, checkpoint);
+    }
 
-    QByteArray imgba;
-    QBuffer imgbuffer(&imgba);
-    imgbuffer.open(QIODevice::WriteOnly);
-    visibleImage.save(&imgbuffer, "png"); // writes image into ba in PNG format
+    // Switch over to the file just written, the next save only encodes what changed after this one.
+    // Not while another save is still going, it may be about to replace this very file.
+    // If it can't be opened the old one stays, it still has every page that isn't resident.
+    // Saved over the open file, the archive already maps the new one.
+    std::shared_ptr<MappedArchive> written;
+    if (ok && savesInFlight == 0) written = overArchive ? archive : MappedArchive::open(path);
+    if (written)
+    {
+        archive = written;
+        for (int i = 0; i < int(pages.size()); i++)
+        {
+            Page& page = pages[i];
+            auto it = versions.constFind(page.id);
+            if (it == versions.constEnd()) continue; // Added while saving, it isn't in there
 
-    QuaZipFile imgFile(&saveZip);
-    imgFile.open(OpenFlags::WriteOnly, QuaZipNewInfo("image.png"));
-    imgFile.write(imgba);
-    imgFile.close();
-    imgbuffer.close();
+            page.manifest = NotebookFile::pageManifest(page.id);
+            if (i == activePage) savedVersions = it.value();
+            else if (page.resident) page.savedVersions = it.value();
 
-    // Write text
-    QByteArray textba = toPlainText().toUtf8();
-    QuaZipFile textFile(&saveZip);
-    textFile.open(OpenFlags::WriteOnly, QuaZipNewInfo("text.txt"));
-    textFile.write(textba);
-    textFile.close();
+            // Only text nobody typed in while the save ran is what's in the file now
+            if (page.text && page.text->revision() == textRevisions.value(page.id, -1)) page.text->setModified(false);
+        }
+        useArchiveLoaders();
 
-    saveZip.close();
+        // Decodes already queued read through loaders made for the old file's layout
+        if (overArchive)
+        {
+            forgetPendingDecodes();
+            requestRepaint(QRect(QPoint(0, 0), layers.size()));
+        }
+    }
+    trimPages();
+    onSaveFinished(path, ok);
+}
 
-    if (saveZip.getZipError() == UNZ_OK)
+void Canvas::onSaveFinished(const QString& filePath, bool ok)
+{
+    if (!ok)
     {
-        modified = false;
-        return true;
+        // Nothing that was resident can be let go of until it's been written somewhere
+        modified = true;
+        for (Page& page : pages) page.modified = page.modified || page.resident;
     }
-    return false;
+    emit saveFinished(filePath, ok);
 }
 
 bool Canvas::load(const QString& filePath)
 {
-    using OpenFlags = QIODevice::OpenModeFlag;
-    QuaZip loadZip(filePath);
-    loadZip.open(QuaZip::mdUnzip);
+    TRACE_SCOPE("Canvas::load");
+    std::shared_ptr<MappedArchive> loadedArchive = MappedArchive::open(filePath);
+    if (!loadedArchive) return false;
+
+    LoadedNotebook loaded;
+    if (!NotebookFile::readIndex(*loadedArchive, loaded)) return false;
 
-    // Read img
-    loadZip.setCurrentFile("image.png");
-    QuaZipFile imgFile(&loadZip);
-    imgFile.open(OpenFlags::ReadOnly);
-    QImage img;
-    img.loadFromData(imgFile.readAll());
-    setImage(img);
-    imgFile.close();
+    // Only the page that gets shown is read, the others stay in the archive until they're visited.
+    // That's what makes a notebook with hundreds of pages open as fast as one with one.
+    std::vector<Page> newPages(loaded.pages.size());
+    nextPageId = 1;
+    for (size_t i = 0; i < loaded.pages.size(); i++)
+    {
+        newPages[i].id       = loaded.pages[i].id;
+        newPages[i].title    = loaded.pages[i].title;
+        newPages[i].section  = loaded.pages[i].section;
+        newPages[i].manifest = loaded.pages[i].manifest;
+        nextPageId = qMax(nextPageId, newPages[i].id + 1);
+    }
+    std::unique_ptr<RichTextReader> text;
+    if (!readPage(loadedArchive, newPages[loaded.activePage], text)) return false;
 
-    // Read text
-    loadZip.setCurrentFile("text.txt");
-    QuaZipFile textFile(&loadZip);
-    textFile.open(OpenFlags::ReadOnly);
-    setText(QString(textFile.readAll()));
-    textFile.close();
+    // v1 files have no tiles to copy from and are fully decoded by now, no need to keep them mapped
+    archive = (loaded.version >= 2) ? loadedArchive : nullptr;
 
-    loadZip.close();
+    // The old pages go once the editor is off their documents
+    pages.swap(newPages);
+    recentPages.clear();
+    history.clear();
+    activatePage(loaded.activePage, std::move(text));
 
     modified = false;
+    notebookPath = QFileInfo(filePath).absoluteFilePath();
+    restartJournal();
+    return true;
+}
+
+bool Canvas::recoverJournal(const QString& journalPath)
+{
+    TRACE_SCOPE("Canvas::recoverJournal");
+    Journal::Contents contents;
+    if (!Journal::read(journalPath, contents) || !contents.baseMatches()) return false;
+
+    // The records only make sense on top of exactly what they were made against
+    journaling = true;
+    if (!contents.basePath.isEmpty()) { if (!load(contents.basePath)) return false; }
+    else journal.start(QString());
+
+    Journal::replay(contents.records, *this);
+    modified = true;
+    return true;
+}
+
+void Canvas::readText(int budgetMs)
+{
+    TRACE_SCOPE("Canvas::readText");
+    readTextBlocks(INT_MAX, budgetMs);
+    if (!textReader->atEnd()) return;
+
+    textTimer.stop();
+    textReader.reset();
+    document()->setUndoRedoEnabled(true);
+    if (!typedWhileReading) document()->setModified(false); // Otherwise the next save has to write it out
+}
+
+void Canvas::readTextBlocks(int maxBlocks, int budgetMs)
+{
+    // What's read in from the file isn't an edit, typing in between still is
+    Journal::Mute mute(journal);
+    readingText = true;
+    textReader->readInto(document(), maxBlocks, budgetMs);
+    readingText = false;
+}
+
+void Canvas::useArchiveLoaders()
+{
+    // Pages that aren't shown can have pending tiles too
+    for (int i = 0; i < int(pages.size()); i++)
+    {
+        if (!pages[i].resident) continue;
+        const QHash<quint32, QString> dirs = NotebookFile::layerDirs(*archive, pages[i].manifest);
+        auto repoint = [&](Layer& layer)
+            {
+                auto it = dirs.constFind(layer.id);
+                if (it != dirs.constEnd()) layer.image.setLoader(NotebookFile::tileLoader(archive, it.value()));
+            };
+        if (i == activePage) { for (int l = 0; l < layers.count(); l++) repoint(layers.at(l)); }
+        else for (Layer& layer : pages[i].layers) repoint(layer);
+    }
+}
+
+int Canvas::pageIndex(quint32 id) const
+{
+    for (int i = 0; i < int(pages.size()); i++) if (pages[i].id == id) return i;
+    return -1;
+}
+
+std::unique_ptr<QTextDocument> Canvas::newDocument() const
+{
+    std::unique_ptr<QTextDocument> text(new QTextDocument());
+    text->setDefaultFont(font());
+    return text;
+}
+
+Page Canvas::blankPage(const QString& title, const QString& section)
+{
+    Page page;
+    page.id       = nextPageId++;
+    page.title    = title;
+    page.section  = section;
+    page.resident = true;
+    page.modified = true;
+    page.layers.emplace_back();
+    page.layers.back().name = "Ink";
+    page.text = newDocument();
+    return page;
+}
+
+bool Canvas::readPage(const std::shared_ptr<MappedArchive>& from, Page& page, std::unique_ptr<RichTextReader>& text)
+{
+    TRACE_SCOPE("Canvas::readPage");
+    LoadedPage loaded;
+    if (!from || !NotebookFile::readPage(from, page.manifest, loaded)) return false;
+
+    page.layers      = std::move(loaded.layers);
+    page.activeLayer = loaded.activeLayer;
+    page.scene       = std::move(loaded.scene);
+    page.history.clear();
+    page.savedVersions.clear();
+    for (const Layer& layer : page.layers) page.savedVersions.insert(layer.id, layer.image.tileVersions());
+
+    page.text = newDocument();
+    if (!loaded.richText)
+    {
+        if (Qt::mightBeRichText(loaded.text)) page.text->setHtml(loaded.text);
+        else page.text->setPlainText(loaded.text);
+        page.text->setModified(false);
+    }
+    text = std::move(loaded.richText);
+    page.resident = true;
+    page.modified = false;
     return true;
 }
 
+void Canvas::stashPage()
+{
+    finishText();
+    Page& page = pages[activePage];
+    page.layers        = layers.all();
+    page.activeLayer   = layers.activeIndex();
+    page.scene         = std::move(scene);
+    page.history       = std::move(history);
+    page.savedVersions = std::move(savedVersions);
+    page.modified      = page.modified || modified || page.text->isModified();
+}
+
+void Canvas::activatePage(int index, std::unique_ptr<RichTextReader> text)
+{
+    activePage = index;
+    Page& page = pages[index];
+
+    forgetPendingDecodes();
+    layers.reset(std::move(page.layers), page.activeLayer);
+    scene         = std::move(page.scene);
+    history       = std::move(page.history);
+    savedVersions = std::move(page.savedVersions);
+    page.layers.clear();
+    page.scene.clear();
+    page.history.clear();
+    page.savedVersions.clear();
+    setDocument(page.text.get());
+    disconnect(textEdits);
+    textEdits = connect(document(), &QTextDocument::contentsChange, this, [this](int position, int removed, int added)
+        {
+            if (textReader && !readingText) typedWhileReading = true;
+            journal.textEdit(document(), position, removed, added);
+        });
+    mips.clear();
+    growToView();
+
+    // Text shows up right away, tiles get decoded as they come into view
+    textTimer.stop();
+    textReader = std::move(text);
+    typedWhileReading = false;
+    if (textReader)
+    {
+        // Every block is at least a line, so this many fill the view
+        document()->setUndoRedoEnabled(false);
+        readTextBlocks(viewport()->height() / qMax(1, fontMetrics().lineSpacing()) + 1);
+        textTimer.start();
+    }
+
+    recentPages.erase(std::remove(recentPages.begin(), recentPages.end(), page.id), recentPages.end());
+    recentPages.insert(recentPages.begin(), page.id);
+    trimPages();
+
+    requestRepaint();
+    emit layersChanged();
+    emit pagesChanged();
+}
+
+void Canvas::trimPages()
+{
+    // A page let go of now would be read back from the file that's about to be replaced
+    if (savesInFlight > 0) return;
+
+    int kept = 0;
+    for (auto it = recentPages.begin(); it != recentPages.end();)
+    {
+        const int index = pageIndex(*it);
+        if (index < 0) { it = recentPages.erase(it); continue; }
+        if (index == activePage || kept++ < residentPageLimit || !pages[index].canEvict()) { ++it; continue; }
+
+        pages[index].evict();
+        it = recentPages.erase(it);
+    }
+}
+
+void Canvas::showPage(int index)
+{
+    if (editDepth > 0 || index < 0 || index >= int(pages.size()) || index == activePage) return;
+    TRACE_SCOPE("Canvas::showPage");
+
+    std::unique_ptr<RichTextReader> text;
+    if (!pages[index].resident && !readPage(archive, pages[index], text)) return;
+    journal.index(Journal::Op::showPage, index);
+    Journal::Mute mute(journal);
+    stashPage();
+    activatePage(index, std::move(text));
+}
+
+void Canvas::addPage()
+{
+    if (editDepth > 0) return;
+    journal.record(Journal::Op::addPage);
+    Journal::Mute mute(journal);
+    Page page = blankPage(QString("Page %1").arg(pages.size() + 1), pages[activePage].section);
+    stashPage();
+    pages.insert(pages.begin() + activePage + 1, std::move(page));
+    activatePage(activePage + 1, nullptr);
+    modified = true;
+}
+
+void Canvas::removePage(int index)
+{
+    if (editDepth > 0 || pages.size() <= 1 || index < 0 || index >= int(pages.size())) return;
+    journal.index(Journal::Op::removePage, index);
+    Journal::Mute mute(journal);
+    if (index == activePage) showPage(index > 0 ? index - 1 : 1);
+    if (index == activePage) return; // Couldn't move off it
+
+    const quint32 id = pages[index].id;
+    pages.erase(pages.begin() + index);
+    if (index < activePage) activePage--;
+    recentPages.erase(std::remove(recentPages.begin(), recentPages.end(), id), recentPages.end());
+    modified = true;
+    emit pagesChanged();
+}
+
+void Canvas::renamePage(int index, const QString& title)
+{
+    if (index < 0 || index >= int(pages.size())) return;
+    journal.indexText(Journal::Op::renamePage, index, title);
+    pages[index].title = title;
+    modified = true;
+    emit pagesChanged();
+}
+
+void Canvas::setPageSection(int index, const QString& section)
+{
+    if (index < 0 || index >= int(pages.size())) return;
+    journal.indexText(Journal::Op::setPageSection, index, section);
+    pages[index].section = section;
+    modified = true;
+    emit pagesChanged();
+}
+
+void Canvas::requestVisibleTiles(const QRect& rect)
+{
+    // Closest to the middle of the view goes first, whichever layer it's on
+    struct Wanted
+    {
+        int    distance;
+        int    layer;
+        QPoint coords;
+    };
+    std::vector<Wanted> wanted;
+    const QRect range = TiledImage::tileRange(rect.intersected(QRect(QPoint(0, 0), layers.size())));
+    const QPoint center = rect.center();
+    for (int i = 0; i < layers.count(); i++)
+    {
+        const Layer& layer = layers.at(i);
+        if (!layer.visible || layer.image.pendingTiles().isEmpty()) continue;
+
+        const QSet<quint64>& queued = decodesQueued[layer.id];
+        for (int ty = range.top(); ty <= range.bottom(); ty++)
+        {
+            for (int tx = range.left(); tx <= range.right(); tx++)
+            {
+                const quint64 key = TiledImage::key(tx, ty);
+                if (!layer.image.isPending(key) || queued.contains(key)) continue;
+                wanted.push_back({ (TiledImage::tileRect(tx, ty).center() - center).manhattanLength(), i, QPoint(tx, ty) });
+            }
+        }
+    }
+    std::sort(wanted.begin(), wanted.end(), [](const Wanted& a, const Wanted& b) { return a.distance < b.distance; });
+
+    const int generation = loadGeneration;
+    for (const Wanted& entry : wanted)
+    {
+        const int tx = entry.coords.x(), ty = entry.coords.y();
+        const quint32 id = layers.at(entry.layer).id;
+        const TiledImage::TileLoader loader = layers.at(entry.layer).image.tileLoader();
+        decodesQueued[id].insert(TiledImage::key(tx, ty));
+
+        decodeQueue.start(QRunnable::create([this, loader, generation, id, tx, ty]()
+            {
+                TRACE_SCOPE("decode tile");
+                const QImage decoded = loader(tx, ty).convertToFormat(TiledImage::format);
+                QMetaObject::invokeMethod(this, [this, generation, id, tx, ty, decoded]()
+                    {
+                        if (generation != loadGeneration) return;
+                        decodesQueued[id].remove(TiledImage::key(tx, ty));
+                        const int index = layers.indexOf(id);
+                        if (index < 0 || !layers.at(index).image.isPending(TiledImage::key(tx, ty))) return;
+
+                        layers.at(index).image.resolvePending(tx, ty, decoded);
+                        layers.changed(index, TiledImage::tileRect(tx, ty));
+                        mips.invalidate(TiledImage::tileRect(tx, ty));
+                        requestRepaint(TiledImage::tileRect(tx, ty));
+                    }, Qt::QueuedConnection);
+            }));
+    }
+}
+
 bool Canvas::setImageFromPath(const QString& path)
 {
     QImage loadedImage;
@@ -82,56 +532,413 @@ bool Canvas::setImageFromPath(const QString& path)
 
 void Canvas::setImage(const QImage& newImg)
 {
-    QSize newSize = newImg.size().expandedTo(size());
-    image = newImg;
-    resizeImage(&image, newSize);
+    journal.image(newImg);
+    Journal::Mute mute(journal);
+    forgetPendingDecodes();
+    history.clear();
+    scene.clear();
+
+    // The picture goes on a layer of its own so ink over it can be hidden or cleared without touching it
+    std::vector<Layer> newLayers(2);
+    newLayers[0].name = "Image";
+    newLayers[0].image.setImage(newImg);
+    newLayers[1].name = "Ink";
+    newLayers[1].image.resize(newImg.size());
+    layers.reset(std::move(newLayers), 1);
+
+    mips.clear();
+    growToView();
     modified = false;
-    update();
+    requestRepaint();
+    emit layersChanged();
+}
+
+std::shared_ptr<ImageExport> Canvas::exportSnapshot() const
+{
+    // Tiles are shared, not copied. Pending ones get decoded by the export and aren't kept.
+    auto job = std::make_shared<ImageExport>();
+    job->layers = layers.all();
+    job->scene  = scene;
+    job->area   = QRect(QPoint(0, 0), layers.size());
+    return job;
 }
 
 bool Canvas::exportImg(const QString& filePath, const char* fileFormat)
 {
-    QImage visibleImage = image;
-    resizeImage(&visibleImage, size());
+    TRACE_SCOPE("Canvas::exportImg");
+    return exportSnapshot()->write(filePath, fileFormat);
+}
+
+void Canvas::startExport(const QString& filePath, const QByteArray& fileFormat)
+{
+    cancelExport();
+    std::shared_ptr<ImageExport> job = exportSnapshot();
+    job->progress = [this](int done, int total)
+        {
+            QMetaObject::invokeMethod(this, [this, done, total]() { emit exportProgress(done, total); }, Qt::QueuedConnection);
+        };
+    exporting = job;
+    exportSource = archive;
 
-    if (visibleImage.save(filePath, fileFormat)) { return true; }
-    return false;
+    exportQueue.start(QRunnable::create([this, job, filePath, fileFormat]()
+        {
+            const bool ok = job->write(filePath, fileFormat);
+            QMetaObject::invokeMethod(this, [this, job, filePath, ok]()
+                {
+                    if (exporting == job)
+                    {
+                        exporting.reset();
+                        exportSource.reset();
+                        std::vector<std::function<void()>> commits;
+                        commits.swap(afterExport);
+                        for (const std::function<void()>& commit : commits) commit();
+                    }
+                    emit exportFinished(filePath, ok);
+                }, Qt::QueuedConnection);
+        }));
+}
+
+void Canvas::cancelExport()
+{
+    if (exporting) exporting->cancelled = true;
+}
+
+void Canvas::rememberTiles(const QRect& bounds)
+{
+    TiledImage& image = layers.activeLayer().image;
+    const QRect clipped = bounds.intersected(QRect(QPoint(0, 0), image.size()));
+    if (clipped.isEmpty()) return;
+
+    const QRect range = TiledImage::tileRange(clipped);
+    for (int ty = range.top(); ty <= range.bottom(); ty++)
+    {
+        for (int tx = range.left(); tx <= range.right(); tx++)
+        {
+            const quint64 key = TiledImage::key(tx, ty);
+            editTouched[key] |= clipped.intersected(TiledImage::tileRect(tx, ty));
+            if (editBefore.contains(key)) continue;
+
+            // Shallow copy, the tile only really gets copied once it's drawn on
+            image.loadPending(tx, ty);
+            const QImage* tile = image.tile(tx, ty);
+            editBefore.insert(key, tile ? *tile : QImage());
+        }
+    }
+}
+
+void Canvas::endEdit()
+{
+    if (editDepth == 0 || --editDepth > 0) return;
+
+    const TiledImage& image = layers.activeLayer().image;
+    InkHistory::Entry entry;
+    entry.layer = layers.activeLayer().id;
+    for (auto it = editTouched.constBegin(); it != editTouched.constEnd(); ++it)
+    {
+        const QImage& before = editBefore[it.key()];
+        const QPoint coords = TiledImage::keyToCoords(it.key());
+        if (before.isNull() && image.tile(coords.x(), coords.y()) == nullptr) continue; // Erased nothing
+
+        entry.tiles.push_back(InkHistory::capture(it.key(), it.value(), before));
+    }
+
+    // Added items are taken as they are now, strokes keep growing after they're added
+    for (VectorItem& removed : editRemoved) entry.vectors.push_back({ std::move(removed), true });
+    for (quint32 id : editAdded)
+    {
+        if (const VectorItem* item = scene.item(id)) entry.vectors.push_back({ *item, false });
+    }
+    history.push(std::move(entry));
+
+    editBefore.clear();
+    editTouched.clear();
+    editAdded.clear();
+    editRemoved.clear();
+}
+
+quint32 Canvas::addVector(const VectorItem& item)
+{
+    beginEdit();
+    const quint32 id = scene.add(item);
+    editAdded.insert(id);
+    endEdit();
+    journal.addVector(*scene.item(id));
+
+    modified = true;
+    requestRepaint(scene.item(id)->bounds.toAlignedRect());
+    return id;
+}
+
+void Canvas::extendVector(quint32 id, const QPolygonF& morePoints)
+{
+    const QRectF added = scene.extend(id, morePoints);
+    if (added.isEmpty()) return;
+    journal.extendVector(id, morePoints);
+    modified = true;
+    requestRepaint(added.toAlignedRect());
+}
+
+void Canvas::eraseVectors(const QPolygonF& path, qreal radius)
+{
+    if (scene.isEmpty() || path.isEmpty()) return;
+
+    auto eraseAt = [&](const QPointF& p)
+        {
+            for (quint32 id : scene.hitTest(p, radius))
+            {
+                VectorItem removed;
+                scene.remove(id, &removed);
+                requestRepaint(removed.bounds.toAlignedRect());
+                if (!editAdded.remove(id)) editRemoved.push_back(std::move(removed));
+            }
+        };
+
+    beginEdit();
+    eraseAt(path.first());
+    for (int i = 1; i < path.size(); i++)
+    {
+        // Steps no longer than the eraser so nothing slips between two points
+        const QPointF d = path[i] - path[i - 1];
+        const int steps = qMax(1, qCeil(qSqrt(QPointF::dotProduct(d, d)) / qMax<qreal>(radius, 1)));
+        for (int step = 1; step <= steps; step++) eraseAt(path[i - 1] + d * (qreal(step) / steps));
+    }
+    endEdit();
+    modified = true;
+}
+
+void Canvas::clearImage()
+{
+    // Clearing is one big edit over every tile the active layer has, the other layers stay
+    journal.record(Journal::Op::clear);
+    beginEdit();
+    TiledImage& image = layers.activeLayer().image;
+    const QHash<quint64, quint64> live = image.tileVersions();
+    QRegion cleared;
+    for (auto it = live.constBegin(); it != live.constEnd(); ++it)
+    {
+        const QPoint coords = TiledImage::keyToCoords(it.key());
+        rememberTiles(TiledImage::tileRect(coords.x(), coords.y()));
+        cleared += TiledImage::tileRect(coords.x(), coords.y());
+    }
+    for (quint32 id : scene.ids())
+    {
+        VectorItem removed;
+        scene.remove(id, &removed);
+        if (!editAdded.remove(id)) editRemoved.push_back(std::move(removed));
+    }
+    forgetPendingDecodes();
+    image.clear();
+    layers.changed(layers.activeIndex(), cleared);
+    mips.clear();
+    endEdit();
+
+    modified = true;
+    requestRepaint();
+}
+
+void Canvas::undoInk()
+{
+    QRegion changed;
+    InkHistory::Entry undone;
+    if (!history.undo(layers, scene, changed, &undone)) return;
+    journal.inkChange(Journal::Op::undo, layers.indexOf(undone.layer), undone);
+    mips.invalidate(changed);
+    modified = true;
+    requestRepaint(changed);
+}
+
+void Canvas::redoInk()
+{
+    QRegion changed;
+    InkHistory::Entry redone;
+    if (!history.redo(layers, scene, changed, &redone)) return;
+    journal.inkChange(Journal::Op::redo, layers.indexOf(redone.layer), redone);
+    mips.invalidate(changed);
+    modified = true;
+    requestRepaint(changed);
+}
+
+void Canvas::applyInk(Journal::Op op, const InkHistory::Entry& change)
+{
+    QRegion changed;
+    history.apply(change, layers, scene, changed);
+    journal.inkChange(op, layers.indexOf(change.layer), change);
+    mips.invalidate(changed);
+    modified = true;
+    requestRepaint(changed);
+}
+
+bool Canvas::stopRecording(const QString& tracePath)
+{
+    if (!recorder) return false;
+    const bool ok = recorder->trace.save(tracePath);
+    recorder.reset();
+    return ok;
 }
 
 void Canvas::mousePressEvent(QMouseEvent* event)
-{ if (currentTool != nullptr) currentTool->mousePressEvent(event); }
+{
+    if (recorder) recorder->record(event);
+
+    // Middle drag pans the ink whatever tool is out
+    if (event->button() == Qt::MiddleButton) { panning = true; panFrom = event->pos(); return; }
+    if (currentTool != nullptr) { TRACE_SCOPE("Tool::mousePressEvent"); currentTool->mousePressEvent(event); }
+}
 
 void Canvas::mouseMoveEvent(QMouseEvent* event)
-{ if (currentTool != nullptr) currentTool->mouseMoveEvent(event); }
+{
+    if (recorder) recorder->record(event);
+    if (panning)
+    {
+        setView(viewZoom, viewOrigin - QPointF(event->pos() - panFrom) / viewZoom);
+        panFrom = event->pos();
+        return;
+    }
+    if (currentTool != nullptr) { TRACE_SCOPE("Tool::mouseMoveEvent"); currentTool->mouseMoveEvent(event); }
+}
 
 void Canvas::mouseReleaseEvent(QMouseEvent* event)
-{ if (currentTool != nullptr) currentTool->mouseReleaseEvent(event); }
+{
+    if (recorder) recorder->record(event);
+    if (event->button() == Qt::MiddleButton && panning) { panning = false; return; }
+    if (currentTool != nullptr) { TRACE_SCOPE("Tool::mouseReleaseEvent"); currentTool->mouseReleaseEvent(event); }
+}
+
+void Canvas::wheelEvent(QWheelEvent* event)
+{
+    if (recorder) recorder->record(event);
+    if (!(event->modifiers() & Qt::ControlModifier)) { QTextEdit::wheelEvent(event); return; }
+
+    // One notch is 120, a notch zooms by a fifth of a doubling so trackpads stay smooth
+    zoomAt(event->position(), qPow(2.0, event->angleDelta().y() / 600.0));
+    event->accept();
+}
+
+bool Canvas::viewportEvent(QEvent* event)
+{
+    if (event->type() == QEvent::NativeGesture)
+    {
+        // Trackpad pinch on macOS
+        QNativeGestureEvent* gesture = static_cast<QNativeGestureEvent*>(event);
+        if (gesture->gestureType() == Qt::ZoomNativeGesture)
+        {
+            zoomAt(gesture->localPos(), 1 + gesture->value());
+            return true;
+        }
+    }
+    else if (event->type() == QEvent::Gesture)
+    {
+        // Touch screen pinch
+        QGestureEvent* gestures = static_cast<QGestureEvent*>(event);
+        if (QPinchGesture* pinch = static_cast<QPinchGesture*>(gestures->gesture(Qt::PinchGesture)))
+        {
+            if (pinch->changeFlags() & QPinchGesture::ScaleFactorChanged)
+                zoomAt(viewport()->mapFromGlobal(pinch->centerPoint().toPoint()), pinch->scaleFactor());
+            gestures->accept(pinch);
+            return true;
+        }
+    }
+    return QTextEdit::viewportEvent(event);
+}
+
+void Canvas::scrollContentsBy(int dx, int dy)
+{
+    // Qt moves what's already on the viewport and only repaints the strip that scrolled in.
+    // Repaints still waiting for the next frame have to move along with the pixels they're for.
+    repaintScheduler->scroll(dx, dy);
+    QTextEdit::scrollContentsBy(dx, dy);
+    growToView();
+}
+
+void Canvas::setView(qreal newZoom, const QPointF& newOrigin)
+{
+    newZoom = qBound(1.0 / 64, newZoom, 32.0);
+    QPointF clamped(qMax<qreal>(0, newOrigin.x()), qMax<qreal>(0, newOrigin.y()));
+
+    // Back at 1:1 the tiles should blit straight, not get resampled half a pixel off
+    if (qAbs(newZoom - 1) < 0.01) { newZoom = 1; clamped = clamped.toPoint(); }
+    if (newZoom == viewZoom && clamped == viewOrigin) return;
+
+    viewZoom   = newZoom;
+    viewOrigin = clamped;
+    growToView();
+    emit viewChanged();
+    requestRepaint();
+}
+
+void Canvas::zoomAt(const QPointF& viewPos, qreal factor)
+{
+    const QPointF anchor = mapToImage(viewPos);
+    const qreal newZoom = qBound(1.0 / 64, viewZoom * factor, 32.0);
+    setView(newZoom, anchor - viewPos / newZoom);
+}
+
+void Canvas::setOverlay(const QRegion& imageRegion)
+{
+    // Where the preview was and where it is now, nothing in between.
+    // Same region or not, what's drawn in it may have changed.
+    requestRepaint(overlay + imageRegion);
+    overlay = imageRegion;
+}
+
+void Canvas::requestRepaint(const QRegion& region)
+{
+    QRegion mapped;
+    for (const QRect& rect : region) mapped += mapToView(rect);
+    repaintScheduler->invalidate(mapped);
+}
 
 void Canvas::paintEvent(QPaintEvent* event)
 {
+    TRACE_SCOPE("Canvas::paintEvent");
+    const qint64 paintStart = repaintScheduler->now();
     QPainter painter(viewport());
-    QRect dirtyRect = event->rect();
-    painter.drawImage(dirtyRect, image, dirtyRect);
+
+    // Dirty rects one at a time, so a preview outline moving doesn't recomposite everything inside it.
+    // Past a handful the bounding rect is cheaper than going over the same tiles again and again.
+    const QRegion dirty = event->region();
+    std::vector<QRect> dirtyRects(dirty.begin(), dirty.end());
+    if (dirtyRects.size() > 16) dirtyRects.assign(1, dirty.boundingRect());
+
+    // Zoomed out draws from a smaller mip level instead of scaling every image pixel down.
+    // The mip tiles are built from the flattened layers, so those have to be current under all of them.
+    const int level = MipPyramid::levelFor(viewZoom);
+    painter.save();
+    painter.setTransform(viewTransform());
+    for (const QRect& dirtyRect : dirtyRects)
+    {
+        const QRect imageRect = mapToImage(dirtyRect).intersected(QRect(QPoint(0, 0), layers.size()));
+        if (imageRect.isEmpty()) continue;
+        requestVisibleTiles(imageRect);
+
+        const TiledImage& flattened = layers.composite(MipPyramid::coverage(imageRect, level));
+        mips.draw(painter, flattened, level, imageRect);
+        scene.paint(painter, imageRect);
+    }
+    painter.restore();
+
     QTextEdit::paintEvent(event);
-    if (currentTool != nullptr) currentTool->paintEvent(event);
-    viewport()->update();
+    if (currentTool != nullptr) { TRACE_SCOPE("Tool::paintEvent"); currentTool->paintEvent(event); }
+    repaintScheduler->notePaint(event->region(), repaintScheduler->now() - paintStart);
 }
 
 void Canvas::resizeEvent(QResizeEvent* event)
 {
     QTextEdit::resizeEvent(event);
-    if (width() > image.width() || height() > image.height())
-    {
-        int newWidth = qMax(width() + 128, image.width());
-        int newHeight = qMax(height() + 128, image.height());
-        resizeImage(&image, QSize(newWidth, newHeight));
-        update();
-    }
+    growToView();
+}
+
+void Canvas::growToView()
+{
+    // Only the logical extent grows, tiles get allocated when something is drawn on them
+    const QPoint viewEnd = mapToImage(viewport()->rect()).bottomRight();
+    resizeImage(layers.size().expandedTo(size()).expandedTo(QSize(viewEnd.x() + 1, viewEnd.y() + 1)));
 }
 
 void Canvas::keyPressEvent(QKeyEvent* event)
 {
-    currentTool->keyPressEvent(event);
+    if (recorder) recorder->record(event);
+    if (currentTool != nullptr) { TRACE_SCOPE("Tool::keyPressEvent"); currentTool->keyPressEvent(event); }
     if (event->modifiers() & Qt::ControlModifier)
     {
         // TODO: Setup hotkeys (move to tool selector ig)
@@ -140,14 +947,90 @@ void Canvas::keyPressEvent(QKeyEvent* event)
     }
 }
 
-void Canvas::resizeImage(QImage* image, const QSize& newSize)
+void Canvas::resizeImage(const QSize& newSize)
 {
-    if (image->size() == newSize)
-        return;
+    TRACE_SCOPE("Canvas::resizeImage");
+    if (newSize != layers.size()) journal.resize(newSize);
+    layers.resize(newSize);
+}
+
+void Canvas::layersEdited()
+{
+    mips.clear();
+    modified = true;
+    requestRepaint();
+    emit layersChanged();
+}
 
-    QImage newImage(newSize, QImage::Format_ARGB32);
-    newImage.fill(Qt::transparent);
-    QPainter painter(&newImage);
-    painter.drawImage(QPoint(0, 0),* image);
-    *image = newImage;
+void Canvas::addLayer()
+{
+    journal.record(Journal::Op::addLayer);
+    Journal::Mute mute(journal);
+    const int index = layers.add(QString("Layer %1").arg(layers.count() + 1), layers.activeIndex() + 1);
+    setActiveLayer(index);
+    layersEdited();
+}
+
+void Canvas::removeLayer(int index)
+{
+    if (editDepth > 0 || layers.count() <= 1 || index < 0 || index >= layers.count()) return;
+
+    // Undo steps can't point at a layer that's gone
+    journal.index(Journal::Op::removeLayer, index);
+    history.clear();
+    decodesQueued.remove(layers.at(index).id);
+    layers.remove(index);
+    layersEdited();
+}
+
+void Canvas::moveLayer(int from, int to)
+{
+    if (from < 0 || to < 0 || from >= layers.count() || to >= layers.count() || from == to) return;
+    journal.indexValue(Journal::Op::moveLayer, from, to);
+    layers.move(from, to);
+    layersEdited();
+}
+
+void Canvas::setActiveLayer(int index)
+{
+    // Not halfway through a stroke, its undo step belongs to one layer
+    if (editDepth > 0 || index < 0 || index >= layers.count()) return;
+    journal.index(Journal::Op::setActiveLayer, index);
+    layers.setActive(index);
+    emit layersChanged();
+}
+
+void Canvas::setLayerVisible(int index, bool visible)
+{
+    if (index < 0 || index >= layers.count()) return;
+    journal.indexValue(Journal::Op::setLayerVisible, index, visible);
+    layers.setVisible(index, visible);
+    layersEdited();
+}
+
+void Canvas::setLayerOpacity(int index, qreal opacity)
+{
+    if (index < 0 || index >= layers.count()) return;
+    qint64 bits = 0;
+    std::memcpy(&bits, &opacity, sizeof(bits));
+    journal.indexValue(Journal::Op::setLayerOpacity, index, bits);
+    layers.setOpacity(index, opacity);
+    layersEdited();
+}
+
+void Canvas::setLayerBlend(int index, QPainter::CompositionMode mode)
+{
+    if (index < 0 || index >= layers.count()) return;
+    journal.indexValue(Journal::Op::setLayerBlend, index, mode);
+    layers.setBlend(index, mode);
+    layersEdited();
+}
+
+void Canvas::renameLayer(int index, const QString& name)
+{
+    if (index < 0 || index >= layers.count()) return;
+    journal.indexText(Journal::Op::renameLayer, index, name);
+    layers.at(index).name = name;
+    modified = true;
+    emit layersChanged();
 }
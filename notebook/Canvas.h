@@ -3,14 +3,30 @@
 #include <qtextedit.h>
 #include <qpainter.h>
 #include <qevent.h>
+#include <qmath.h>
+#include <qtransform.h>
+#include <qscrollbar.h>
 #include <vector>
-
-// For saving
-#include <QuaZip-Qt5-1.1/quazip/quazip.h>
-#include <QuaZip-Qt5-1.1/quazip/quazipfile.h>
-#include <qbuffer.h>
+#include <functional>
+#include <atomic>
+#include <qthreadpool.h>
+#include <qtimer.h>
+#include <memory>
+#include "TiledImage.h"
+#include "LayerStack.h"
+#include "MappedArchive.h"
+#include "RepaintScheduler.h"
+#include "InkHistory.h"
+#include "VectorScene.h"
+#include "MipPyramid.h"
+#include "InputTrace.h"
+#include "RichText.h"
+#include "Page.h"
+#include "Journal.h"
 
 class Tool;
+class ImageExport;
+class QSaveFile;
 
 class Canvas : public QTextEdit
 {
@@ -19,14 +35,48 @@ class Canvas : public QTextEdit
 public:
     Tool* currentTool = nullptr;
     bool modified = false;
-    QImage image;
+    LayerStack layers;          // Raster ink, tools draw on the active one
+    RepaintScheduler* repaintScheduler;
+    InkHistory history;
+    VectorScene scene;          // Retained mode ink, painted over the tiles
+    bool retainVectors = false; // Draw and shape tools keep geometry instead of pixels
+    std::unique_ptr<InputRecorder> recorder; // Set while input is being recorded, see startRecording
+    Journal journal;            // Every edit since the last save, see startJournal
+    bool journaling = false;
+
+    // The notebook's pages, the canvas shows one at a time. Besides that one, the residentPageLimit
+    // visited last stay in memory, the rest only get read out of the archive when they're shown.
+    // Pages with changes that aren't saved anywhere yet stay in memory too.
+    std::vector<Page> pages;
+    int activePage = 0;
+    int residentPageLimit = 4;
 
     Canvas(QWidget* parent = nullptr);
-    bool save(const QString& filePath);
+    ~Canvas();
+    bool save(const QString& filePath); // Returns once the save is queued, see saveFinished
+    bool isSaving() const { return savesInFlight > 0; }
     bool load(const QString& filePath);
+    QString filePath() const { return notebookPath; } // Of the last load or successful save
     bool setImageFromPath(const QString& path);
     void setImage(const QImage& newImg);
+
+    // The whole image with vector ink on top, rendered and encoded a band at a time, see ImageExport.
+    // exportImg does it on the calling thread, startExport in the background with exportProgress and exportFinished.
     bool exportImg(const QString& filePath, const char* fileFormat);
+    void startExport(const QString& filePath, const QByteArray& fileFormat);
+    void cancelExport(); // exportFinished still comes, not ok
+    bool isExporting() const { return exporting != nullptr; }
+
+    // Every mouse, wheel and key event that reaches the canvas goes into a trace until stopped
+    void startRecording() { recorder.reset(new InputRecorder(viewport()->size())); }
+    bool stopRecording(const QString& tracePath);
+
+    // Edits go into a journal next to the notebook from here on, started over on every load and save.
+    // recoverJournal puts back what one left behind on top of the notebook it was made against.
+    void startJournal() { journaling = true; restartJournal(); }
+    bool recoverJournal(const QString& journalPath);
+
+    void finishText() { if (textReader) readText(-1); } // Reads in the rest of a text still loading
 
     void mousePressEvent(QMouseEvent* event)   override;
     void mouseMoveEvent(QMouseEvent* event)    override;
@@ -34,7 +84,100 @@ public:
     void paintEvent(QPaintEvent* event)        override;
     void resizeEvent(QResizeEvent* event)      override;
     void keyPressEvent(QKeyEvent* event)       override;
-    void resizeImage(QImage* image, const QSize& newSize);
+    void resizeImage(const QSize& newSize);
+
+    void wheelEvent(QWheelEvent* event)        override;
+    void scrollContentsBy(int dx, int dy)      override;
+    bool viewportEvent(QEvent* event)          override;
+
+    // Ink view: image coords are scaled by zoom with viewOrigin at the document's top left,
+    // then scrolled along with the text, so ink stays next to what it was written on.
+    // Tools get viewport positions in events and have to map them, everything on the canvas API is in image coords.
+    qreal   inline zoom()   const { return viewZoom; }
+    QPointF inline origin() const { return viewOrigin; }
+    QPoint  inline scrollOffset() const { return QPoint(horizontalScrollBar()->value(), verticalScrollBar()->value()); }
+    QTransform inline viewTransform() const
+    {
+        const QPoint scroll = scrollOffset();
+        return QTransform::fromTranslate(-scroll.x(), -scroll.y()).scale(viewZoom, viewZoom).translate(-viewOrigin.x(), -viewOrigin.y());
+    }
+    QPointF inline mapToImage(const QPointF& viewPos) const { return (viewPos + scrollOffset()) / viewZoom + viewOrigin; }
+    QPoint  inline mapToImage(const QPoint& viewPos)  const { const QPointF p = mapToImage(QPointF(viewPos)); return QPoint(qFloor(p.x()), qFloor(p.y())); }
+    QRect   inline mapToImage(const QRect& viewRect)  const { return QRectF(mapToImage(QPointF(viewRect.topLeft())), QSizeF(viewRect.size()) / viewZoom).toAlignedRect(); }
+    QRect   inline mapToView(const QRect& imageRect)  const { return viewTransform().mapRect(QRectF(imageRect)).toAlignedRect(); }
+    void setView(qreal newZoom, const QPointF& newOrigin);
+    void zoomAt(const QPointF& viewPos, qreal factor); // Keeps whatever is under viewPos where it is
+
+    // Viewport repaints go through the scheduler so they get coalesced per frame. Rects are in image coords.
+    void inline requestRepaint(const QRect& rect) { repaintScheduler->invalidate(mapToView(rect)); }
+    void requestRepaint(const QRegion& region);
+    void inline requestRepaint() { repaintScheduler->invalidateAll(); }
+
+    // Tool previews (rubber bands, text being placed) are painted by the tool's paintEvent over everything else,
+    // they never go into the layers. Tools call this with what the preview covers in image coords whenever it changes,
+    // that repaints only what it covered before and covers now.
+    void setOverlay(const QRegion& imageRegion);
+    void inline clearOverlay() { setOverlay(QRegion()); }
+
+    // Every tool edit goes through here so the canvas knows what changed
+    template<typename Func>
+    void drawOnImage(const QRect& bounds, Func&& func, bool allocate = true)
+    {
+        drawOnTiles(bounds, [&](QImage& tile, const QRect& tileRect)
+            {
+                QPainter painter(&tile);
+                painter.translate(-tileRect.topLeft());
+                func(painter);
+            }, allocate);
+    }
+
+    // Same as drawOnImage, for tools that write tile pixels themselves
+    template<typename Func>
+    void drawOnTiles(const QRect& bounds, Func&& func, bool allocate = true)
+    {
+        beginEdit();
+        rememberTiles(bounds);
+        layers.activeLayer().image.editTiles(bounds, func, allocate);
+        if (!allocate) layers.activeLayer().image.dropTransparent(bounds); // Erased bare, memory only follows the ink
+        layers.changed(layers.activeIndex(), bounds);
+        mips.invalidate(bounds);
+        endEdit();
+        modified = true;
+        requestRepaint(bounds);
+    }
+
+    // Same again for a list of tiles, clipped to bounds, with func running for several tiles at once.
+    // func must only touch the tile it's given.
+    template<typename Func>
+    void drawOnTilesParallel(const QVector<QPoint>& tileCoords, const QRect& bounds, Func&& func)
+    {
+        beginEdit();
+        QRegion region;
+        for (const QPoint& c : tileCoords)
+        {
+            const QRect rect = TiledImage::tileRect(c.x(), c.y()).intersected(bounds);
+            rememberTiles(rect);
+            region += rect;
+        }
+        layers.activeLayer().image.editTilesParallel(tileCoords, func);
+        layers.changed(layers.activeIndex(), region);
+        mips.invalidate(region);
+        endEdit();
+        modified = true;
+        requestRepaint(region);
+    }
+
+    // Retained mode edits, these go into the same undo steps as pixels
+    quint32 addVector(const VectorItem& item);
+    void extendVector(quint32 id, const QPolygonF& morePoints);
+    void eraseVectors(const QPolygonF& path, qreal radius); // Takes out every item the path comes within radius of
+    void applyInk(Journal::Op op, const InkHistory::Entry& change); // A journal's undo or redo, see InkHistory::apply
+
+    // Everything drawn between these becomes one undo step, like a whole stroke. They nest.
+    void beginEdit() { editDepth++; }
+    void endEdit();
+    void setHistoryMemoryLimit(qint64 bytes) { history.memoryLimit = bytes; }
+    qint64 inline mipMemoryUsage() const { return mips.memoryUsage(); }
 
     void inline baseMousePressEvent(QMouseEvent* event)   { QTextEdit::mousePressEvent(event); };
     void inline baseMouseMoveEvent(QMouseEvent* event)    { QTextEdit::mouseMoveEvent(event); };
@@ -43,10 +186,106 @@ public:
     bool inline isModified()  const { return modified; }
 
 public slots:
-    void clearImage()
-    {
-        image.fill(qRgba(255, 255, 255, 0));
-        modified = true;
-        update();
-    }
+    void showPage(int index);
+    void addPage(); // After the one shown, in the same section
+    void removePage(int index);
+    void renamePage(int index, const QString& title);
+    void setPageSection(int index, const QString& section);
+    void nextPage()     { showPage(activePage + 1); }
+    void previousPage() { showPage(activePage - 1); }
+
+    void clearImage();
+    void undoInk();
+    void redoInk();
+    void zoomIn()    { zoomAt(viewport()->rect().center(), 2); }
+    void zoomOut()   { zoomAt(viewport()->rect().center(), 0.5); }
+    void resetZoom() { setView(1, viewOrigin); }
+
+    // Layer panel edits. Indices are bottom first.
+    void addLayer();
+    void removeLayer(int index);
+    void moveLayer(int from, int to);
+    void setActiveLayer(int index);
+    void setLayerVisible(int index, bool visible);
+    void setLayerOpacity(int index, qreal opacity);
+    void setLayerBlend(int index, QPainter::CompositionMode mode);
+    void renameLayer(int index, const QString& name);
+
+signals:
+    void saveFinished(const QString& filePath, bool ok);
+    void exportProgress(int done, int total);
+    void exportFinished(const QString& filePath, bool ok);
+    void viewChanged();
+    void layersChanged();
+    void pagesChanged();
+
+private:
+    qreal   viewZoom = 1;
+    QPointF viewOrigin;
+    MipPyramid mips;       // For drawing zoomed out
+    bool    panning = false;
+    QRegion overlay;       // Image coords, see setOverlay
+    QPoint  panFrom;
+
+    QThreadPool saveQueue; // Single thread so saves land on disk in the order they were made
+    std::atomic<quint64> saveGeneration { 0 };
+    int savesInFlight = 0;
+
+    QThreadPool exportQueue; // Single thread, bands get spread over the global pool from there
+    std::shared_ptr<ImageExport> exporting;
+    std::shared_ptr<MappedArchive> exportSource;     // What the export decodes pending tiles from
+    std::vector<std::function<void()>> afterExport; // Save commits waiting for it to let go of that file
+    std::shared_ptr<ImageExport> exportSnapshot() const;
+
+    // Last file the tiles were written to or read from, and which tile versions it holds.
+    // Pending tiles get decoded out of it too.
+    std::shared_ptr<MappedArchive> archive;
+    QString notebookPath;
+    QHash<quint32, QHash<quint64, quint64>> savedVersions; // By layer id
+
+    // Pending tiles get decoded here once they scroll into view
+    QThreadPool decodeQueue;
+    QHash<quint32, QSet<quint64>> decodesQueued; // By layer id
+    int loadGeneration = 0;
+
+    // A loaded file's rich text goes in a slice at a time between events, the first screen of it right away.
+    // There's no text undo until it's all in.
+    std::unique_ptr<RichTextReader> textReader;
+    QTimer textTimer;
+    bool readingText = false;       // Inside readInto, what changes the document now isn't typing
+    bool typedWhileReading = false; // The text isn't just what's in the file any more once it's all in
+    void readText(int budgetMs); // -1 reads the rest
+    void readTextBlocks(int maxBlocks, int budgetMs = -1);
+
+    // Commits a written save and switches over to the new file, on the GUI thread
+    void finishSave(const std::shared_ptr<QSaveFile>& saveFile, bool ok, const QString& path,
+                    const QHash<quint32, QHash<quint32, QHash<quint64, quint64>>>& versions,
+                    const QHash<quint32, int>& textRevisions, qint64 checkpoint);
+    void onSaveFinished(const QString& filePath, bool ok);
+    void restartJournal() { if (journaling) journal.start(notebookPath); }
+    QMetaObject::Connection textEdits; // Of the shown page's document into the journal
+    void requestVisibleTiles(const QRect& rect);
+    void forgetPendingDecodes() { loadGeneration++; decodesQueued.clear(); }
+    void growToView();
+    void layersEdited(); // After anything but pixels changed in the stack
+    void useArchiveLoaders(); // Points pending tiles of every resident page at where they are in archive
+
+    quint32 nextPageId = 1;
+    std::vector<quint32> recentPages; // Ids of the resident pages, most recently shown first
+    int pageIndex(quint32 id) const;  // -1 if it's gone
+    std::unique_ptr<QTextDocument> newDocument() const;
+    Page blankPage(const QString& title, const QString& section);
+    bool readPage(const std::shared_ptr<MappedArchive>& from, Page& page, std::unique_ptr<RichTextReader>& text);
+    void stashPage();  // Takes the shown page's layers, scene and history off the canvas and back into it
+    void activatePage(int index, std::unique_ptr<RichTextReader> text); // Puts a resident page on the canvas
+    void trimPages();  // Lets go of the pages past residentPageLimit that are safe to read back
+
+    // What the tiles looked like before the open edit first touched them (null if they didn't exist),
+    // and how much of each it touched
+    int editDepth = 0;
+    QHash<quint64, QImage> editBefore;
+    QHash<quint64, QRect>  editTouched;
+    QSet<quint32>           editAdded;
+    std::vector<VectorItem> editRemoved;
+    void rememberTiles(const QRect& bounds);
 };
\ No newline at end of file
@@ -0,0 +1,334 @@
+#include "FloodFill.h"
+#include "Helpers.h"
+#include <qthreadpool.h>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define FILL_X86
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef FILL_X86
+static inline int lowestBit(quint32 bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return int(index);
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+#endif
+
+// First i in [from, to) where row[i] is (or with equal unset, isn't) value, to if there's none
+static int findByte(const quint8* row, int from, int to, quint8 value, bool equal)
+{
+#ifdef FILL_X86
+    const __m128i v = _mm_set1_epi8(char(value));
+    for (; from + 16 <= to; from += 16)
+    {
+        quint32 bits = quint32(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + from)), v)));
+        if (!equal) bits = ~bits & 0xffff;
+        if (bits != 0) return from + lowestBit(bits);
+    }
+#endif
+    for (; from < to; from++) { if ((row[from] == value) == equal) return from; }
+    return to;
+}
+
+static inline bool withinTolerance(quint32 a, quint32 b, int tolerance)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        if (qAbs(int((a >> shift) & 0xff) - int((b >> shift) & 0xff)) > tolerance) return false;
+    }
+    return true;
+}
+
+// One mask row: open where the pixel is within tolerance of color on every channel, blocked elsewhere
+static void maskRow(const quint32* pixels, quint8* out, int count, quint32 color, int tolerance)
+{
+    int i = 0;
+#ifdef FILL_X86
+    const __m128i target = _mm_set1_epi32(int(color));
+    const __m128i slack  = _mm_set1_epi8(char(tolerance));
+    const __m128i zero   = _mm_setzero_si128();
+    const __m128i one    = _mm_set1_epi8(1);
+
+    // All ones per pixel where no channel is further than tolerance from the target
+    auto matches = [&](const quint32* p)
+        {
+            const __m128i px   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const __m128i diff = _mm_or_si128(_mm_subs_epu8(px, target), _mm_subs_epu8(target, px));
+            return _mm_cmpeq_epi32(_mm_subs_epu8(diff, slack), zero);
+        };
+
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i low  = _mm_packs_epi32(matches(pixels + i),     matches(pixels + i + 4));
+        const __m128i high = _mm_packs_epi32(matches(pixels + i + 8), matches(pixels + i + 12));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_and_si128(_mm_packs_epi16(low, high), one));
+    }
+#endif
+    for (; i < count; i++) out[i] = withinTolerance(pixels[i], color, tolerance) ? 1 : 0;
+}
+
+FloodFill::FloodFill(const TileSource& tileSource, const QRect& fillLimit, const QPoint& fillSeed, int fillTolerance)
+    : source(tileSource), limit(fillLimit.intersected(QRect(0, 0, INT_MAX, INT_MAX))), seed(fillSeed)
+{
+    tolerance = qBound(0, fillTolerance, 255);
+    if (!limit.contains(seed)) return;
+
+    tiles = TiledImage::tileRange(limit);
+    grid.assign(size_t(tiles.width()) * tiles.height(), unmasked);
+
+    const QImage* seedTile = source(seed.x() / tileSize, seed.y() / tileSize);
+    seedColor = seedTile == nullptr ? 0
+        : reinterpret_cast<const quint32*>(seedTile->constScanLine(seed.y() % tileSize))[seed.x() % tileSize];
+    emptyValue = withinTolerance(0, seedColor, tolerance) ? open : blocked;
+}
+
+int FloodFill::maskIndex(int x, int y)
+{
+    const int cell = gridIndex(x, y);
+    if (grid[cell] == unmasked) maskBatch(x / tileSize, y / tileSize);
+    return grid[cell];
+}
+
+void FloodFill::maskBatch(int tx, int ty)
+{
+    // A thread's worth of tiles along the row, centered on the one the walk got into
+    const int batch = qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+    const int last  = qMin(tiles.right(), qMax(tiles.left(), tx - batch / 2) + batch - 1);
+    const int first = qMax(tiles.left(), last - batch + 1);
+
+    // Tiles come from the source one at a time on this thread, only the masking is spread out
+    std::vector<QImage> images;
+    std::vector<int> indices;
+    for (int x = first; x <= last; x++)
+    {
+        int& index = grid[(ty - tiles.top()) * tiles.width() + (x - tiles.left())];
+        if (index != unmasked) continue;
+
+        const QImage* tile = source(x, ty);
+        if (tile == nullptr || tile->isNull()) { index = uniform; continue; }
+        index = int(masks.size());
+        masks.emplace_back(size_t(tileSize * tileSize));
+        maskFilled.push_back(false);
+        images.push_back(*tile); // Shallow, the pointer is only good until the next call
+        indices.push_back(index);
+    }
+
+    Helpers::parallelFor(int(images.size()), [&](int i)
+        {
+            quint8* mask = masks[indices[i]].data();
+            for (int line = 0; line < tileSize; line++)
+                maskRow(reinterpret_cast<const quint32*>(images[i].constScanLine(line)), mask + line * tileSize, tileSize, seedColor, tolerance);
+        });
+}
+
+const quint8* FloodFill::row(int x, int y)
+{
+    const int index = maskIndex(x, y);
+    return index < 0 ? nullptr : masks[index].data() + (y % tileSize) * tileSize;
+}
+
+const quint8* FloodFill::maskedRow(int x, int y) const
+{
+    const int index = grid[gridIndex(x, y)];
+    return index < 0 ? nullptr : masks[index].data() + (y % tileSize) * tileSize;
+}
+
+quint8* FloodFill::writableRow(int x, int y)
+{
+    int& index = grid[gridIndex(x, y)];
+    if (maskIndex(x, y) < 0)
+    {
+        index = int(masks.size());
+        masks.emplace_back(size_t(tileSize * tileSize), emptyValue);
+        maskFilled.push_back(false);
+    }
+    maskFilled[index] = true;
+    return masks[index].data() + (y % tileSize) * tileSize;
+}
+
+int FloodFill::scanRight(int x, int end, int y)
+{
+    while (x < end)
+    {
+        const int tileX    = x / tileSize * tileSize;
+        const int tileEnd  = qMin(end, tileX + tileSize);
+        const quint8* cells = row(x, y);
+        if (cells == nullptr)
+        {
+            if (emptyValue != open) return x;
+            x = tileEnd;
+            continue;
+        }
+
+        const int found = findByte(cells, x - tileX, tileEnd - tileX, open, false) + tileX;
+        if (found < tileEnd) return found;
+        x = tileEnd;
+    }
+    return end;
+}
+
+int FloodFill::scanLeft(int x, int y)
+{
+    while (x > limit.left())
+    {
+        const int tileX = (x - 1) / tileSize * tileSize;
+        const int start = qMax(limit.left(), tileX);
+        const quint8* cells = row(x - 1, y);
+        if (cells == nullptr)
+        {
+            if (emptyValue != open) return x;
+            x = start;
+            continue;
+        }
+
+        int i = x - 1;
+        while (i >= start && cells[i - tileX] == open) i--;
+        if (i >= start) return i + 1;
+        x = start;
+    }
+    return x;
+}
+
+int FloodFill::findOpen(int x, int end, int y)
+{
+    while (x < end)
+    {
+        const int tileX   = x / tileSize * tileSize;
+        const int tileEnd = qMin(end, tileX + tileSize);
+        const quint8* cells = row(x, y);
+        if (cells == nullptr)
+        {
+            if (emptyValue == open) return x;
+            x = tileEnd;
+            continue;
+        }
+
+        const int found = findByte(cells, x - tileX, tileEnd - tileX, open, true) + tileX;
+        if (found < tileEnd) return found;
+        x = tileEnd;
+    }
+    return end;
+}
+
+void FloodFill::markFilled(int x1, int x2, int y)
+{
+    box |= QRect(x1, y, x2 - x1, 1);
+    while (x1 < x2)
+    {
+        const int tileX   = x1 / tileSize * tileSize;
+        const int tileEnd = qMin(x2, tileX + tileSize);
+        std::memset(writableRow(x1, y) + (x1 - tileX), filled, size_t(tileEnd - x1));
+        x1 = tileEnd;
+    }
+}
+
+bool FloodFill::fill()
+{
+    if (!limit.contains(seed)) return false;
+    const int end = limit.right() + 1;
+    if (scanRight(seed.x(), end, seed.y()) == seed.x()) return false;
+
+    // Spans still to look around: the row to look at and the x range of the span next to it
+    struct Span
+    {
+        int y, x1, x2;
+    };
+    std::vector<Span> stack;
+
+    const int left  = scanLeft(seed.x(), seed.y());
+    const int right = scanRight(seed.x(), end, seed.y());
+    markFilled(left, right, seed.y());
+    stack.push_back({ seed.y() - 1, left, right });
+    stack.push_back({ seed.y() + 1, left, right });
+
+    while (!stack.empty())
+    {
+        const Span span = stack.back();
+        stack.pop_back();
+        if (span.y < limit.top() || span.y > limit.bottom()) continue;
+
+        int x = span.x1;
+        while (x < span.x2)
+        {
+            x = findOpen(x, span.x2, span.y);
+            if (x >= span.x2) break;
+
+            // A run can reach out past the span it was found from, either way
+            const int start = x == span.x1 ? scanLeft(x, span.y) : x;
+            const int stop  = scanRight(x, end, span.y);
+            markFilled(start, stop, span.y);
+            stack.push_back({ span.y - 1, start, stop });
+            stack.push_back({ span.y + 1, start, stop });
+            x = stop;
+        }
+    }
+    return true;
+}
+
+bool FloodFill::changes(quint32 color)
+{
+    // The seed itself gets filled, and without a tolerance so does only its color
+    if (box.isEmpty() || seedColor != color) return !box.isEmpty();
+    if (tolerance == 0) return false;
+
+    for (int i = 0; i < int(grid.size()); i++)
+    {
+        if (grid[i] < 0 || !maskFilled[grid[i]]) continue;
+        const QImage* tile = source(tiles.left() + i % tiles.width(), tiles.top() + i / tiles.width());
+        const quint8* mask = masks[grid[i]].data();
+        for (int y = 0; y < tileSize; y++)
+        {
+            const quint32* pixels = tile && !tile->isNull() ? reinterpret_cast<const quint32*>(tile->constScanLine(y)) : nullptr;
+            for (int x = 0; x < tileSize; x++)
+            {
+                if (mask[y * tileSize + x] == filled && (pixels ? pixels[x] : 0) != color) return true;
+            }
+        }
+    }
+    return false;
+}
+
+QVector<QPoint> FloodFill::filledTiles() const
+{
+    QVector<QPoint> out;
+    for (int i = 0; i < int(grid.size()); i++)
+    {
+        if (grid[i] >= 0 && maskFilled[grid[i]]) out.append(QPoint(tiles.left() + i % tiles.width(), tiles.top() + i / tiles.width()));
+    }
+    return out;
+}
+
+void FloodFill::render(QImage& target, const QPoint& origin, quint32 color) const
+{
+    Q_ASSERT(target.format() == QImage::Format_ARGB32_Premultiplied);
+    const QRect area = box.intersected(QRect(origin, target.size()));
+    for (int y = area.top(); y <= area.bottom(); y++)
+    {
+        const quint8* cells = maskedRow(area.left(), y);
+        if (cells == nullptr) continue;
+
+        // Mask and target both start at the tile's left edge
+        quint32* pixels = reinterpret_cast<quint32*>(target.scanLine(y - origin.y()));
+        int x = area.left() - origin.x();
+        const int stop = area.right() + 1 - origin.x();
+        while (x < stop)
+        {
+            const int from = findByte(cells, x, stop, filled, true);
+            const int to   = findByte(cells, from, stop, filled, false);
+            std::fill(pixels + from, pixels + to, color);
+            x = to;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <qimage.h>
+#include <qrect.h>
+#include <qvector.h>
+#include <functional>
+#include <vector>
+#include "TiledImage.h"
+
+// Bucket fill over a tiled image.
+// The fill walks spans over byte masks of which pixels are close enough to the seed color, scanning 16 mask bytes
+// at a time for span edges, so no pixel gets compared twice. Masks are made when the walk first comes into a tile,
+// for a batch of tiles along its row at once, one per thread, with SSE2 comparing four pixels at a time. A small fill
+// on a huge canvas only ever looks at the tiles around it, a big one gets masked on every core.
+// Tiles that don't exist are transparent all over and don't need one.
+class FloodFill
+{
+public:
+    // The tile at tile coords tx, ty, nullptr where there's nothing. Asked when the fill first gets to a tile
+    // (and by changes), the pointer only has to stay good until the next call.
+    using TileSource = std::function<const QImage*(int tx, int ty)>;
+
+    // Pixels within tolerance of the seed's color on every channel (premultiplied, 0-255) are fillable.
+    // Nothing outside limit gets filled, it can't go into negative coords.
+    FloodFill(const TileSource& source, const QRect& limit, const QPoint& seed, int tolerance);
+
+    // Returns false if there was nothing to fill
+    bool fill();
+
+    // After fill, whether writing color (premultiplied) over the filled pixels would change any of them.
+    // Quick unless the seed is that color already and there's a tolerance, then every filled pixel gets looked at.
+    bool changes(quint32 color);
+
+    QRect inline bounds() const { return box; } // Every filled pixel, image coords
+    QVector<QPoint> filledTiles() const;      // Tile coords of every tile with something filled
+
+    // Writes color (premultiplied) over the filled pixels of a tile sitting at origin in image coords
+    void render(QImage& target, const QPoint& origin, quint32 color) const;
+
+private:
+    static constexpr int tileSize = TiledImage::tileSize;
+
+    enum : quint8
+    {
+        blocked = 0,
+        open    = 1,
+        filled  = 2
+    };
+
+    enum : int
+    {
+        uniform  = -1, // No tile there, emptyValue all over
+        unmasked = -2  // Not got to yet
+    };
+
+    TileSource source;
+    QRect   limit;
+    QPoint  seed;
+    quint32 seedColor = 0;
+    int     tolerance = 0;
+    quint8  emptyValue = blocked; // What a tile without a mask is all over
+    QRect   box;
+
+    // Every tile in limit, row by row, holds an index into masks, uniform or unmasked.
+    // A flat grid because the span walk looks tiles up a few times per span.
+    QRect tiles;
+    std::vector<int> grid;
+    std::vector<std::vector<quint8>> masks;
+    std::vector<bool> maskFilled; // Which masks have something filled
+
+    int inline gridIndex(int x, int y) const { return (y / tileSize - tiles.top()) * tiles.width() + (x / tileSize - tiles.left()); }
+    int maskIndex(int x, int y);  // Masks the tile first if the walk hasn't been in it yet
+    void maskBatch(int tx, int ty); // The tile at tile coords tx, ty and the unmasked ones next to it in its row
+    const quint8* row(int x, int y); // nullptr if that tile is uniform
+    const quint8* maskedRow(int x, int y) const; // Same without masking anything, nullptr for a tile that isn't yet
+    quint8* writableRow(int x, int y); // Gives a uniform tile a mask of its own first
+    int scanRight(int x, int end, int y); // First x from here that isn't open, end at most
+    int scanLeft(int x, int y);           // Where the open run ending at x starts
+    int findOpen(int x, int end, int y);  // First open x from here, end if none
+    void markFilled(int x1, int x2, int y);
+};
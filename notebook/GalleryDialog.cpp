@@ -0,0 +1,143 @@
+#include "GalleryDialog.h"
+
+#include "MappedArchive.h"
+#include "NotebookFile.h"
+#include "Helpers.h"
+#include "Trace.h"
+#include <qdir.h>
+#include <qdatetime.h>
+#include <qfileinfo.h>
+#include <qfiledialog.h>
+#include <qbuffer.h>
+#include <qthread.h>
+#include <vector>
+
+GalleryDialog::GalleryDialog(QWidget* parent) : QDialog(parent)
+{
+    setWindowTitle("Open From Gallery");
+    resize(720, 520);
+
+    setLayout(mainLayout);
+    mainLayout->addLayout(folderLayout);
+    mainLayout->addWidget(list);
+    mainLayout->addWidget(statusLabel);
+
+    folderLayout->addWidget(folderButton);
+    folderLayout->addWidget(folderLabel, 1);
+
+    list->setViewMode(QListView::IconMode);
+    list->setIconSize(QSize(iconSize, iconSize));
+    list->setGridSize(QSize(iconSize + 24, iconSize + 40));
+    list->setResizeMode(QListView::Adjust);
+    list->setMovement(QListView::Static);
+    list->setUniformItemSizes(true);
+    list->setWordWrap(true);
+
+    // Reading a notebook that isn't cached is mostly decoding PNGs, half the cores leaves the rest for the UI
+    readers.setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2));
+
+    connect(folderButton, &QPushButton::clicked, this, &GalleryDialog::chooseFolder);
+    connect(list, &QListWidget::itemActivated, this, [this](QListWidgetItem* item)
+        {
+            emit openNotebook(item->data(Qt::UserRole).toString());
+        });
+
+    setDirectory(QDir::currentPath());
+}
+
+GalleryDialog::~GalleryDialog()
+{
+    // Readers use the cache, and whatever they got in should make it to disk
+    readers.clear();
+    readers.waitForDone();
+    cache.save();
+}
+
+void GalleryDialog::setDirectory(const QString& dir)
+{
+    directory = QDir(dir).absolutePath();
+    folderLabel->setText(QDir::toNativeSeparators(directory));
+    refresh();
+}
+
+void GalleryDialog::refresh()
+{
+    TRACE_SCOPE("GalleryDialog::refresh");
+    generation++;
+    readers.clear(); // The ones that haven't started are for the old listing
+    pendingReads = 0;
+    list->clear();
+
+    const QFileInfoList infos = QDir(directory).entryInfoList(QStringList() << "*.nb", QDir::Files, QDir::Name | QDir::IgnoreCase);
+
+    // Cached thumbnails get decoded all at once across cores, a folder of them shows in one go
+    std::vector<QByteArray> pngs(infos.size());
+    for (int i = 0; i < infos.size(); i++) pngs[i] = cache.find(infos[i].absoluteFilePath(), infos[i].lastModified().toMSecsSinceEpoch(), infos[i].size());
+    std::vector<QImage> cached(infos.size());
+    Helpers::parallelFor(infos.size(), [&](int i) { if (!pngs[i].isNull()) cached[i] = QImage::fromData(pngs[i], "png"); });
+
+    QPixmap placeholder(iconSize, iconSize);
+    placeholder.fill(palette().color(QPalette::Midlight));
+    const QIcon placeholderIcon(placeholder);
+
+    list->setUpdatesEnabled(false);
+    for (int i = 0; i < infos.size(); i++)
+    {
+        const QFileInfo& info = infos[i];
+        const QString path = info.absoluteFilePath();
+        QListWidgetItem* item = new QListWidgetItem(placeholderIcon, info.completeBaseName());
+        item->setToolTip(QDir::toNativeSeparators(path));
+        item->setData(Qt::UserRole, path);
+        list->addItem(item);
+        if (!cached[i].isNull()) { setThumbnail(i, cached[i]); continue; }
+
+        // Not seen before or changed since, only the thumbnail entry gets read
+        pendingReads++;
+        const quint64 forGeneration = generation;
+        const qint64 modified = info.lastModified().toMSecsSinceEpoch();
+        const qint64 size     = info.size();
+        readers.start(QRunnable::create([this, forGeneration, i, path, modified, size]()
+            {
+                QImage thumbnail;
+                if (std::shared_ptr<MappedArchive> archive = MappedArchive::open(path)) thumbnail = NotebookFile::readThumbnail(archive, iconSize);
+                if (!thumbnail.isNull())
+                {
+                    QByteArray png;
+                    QBuffer buffer(&png);
+                    buffer.open(QIODevice::WriteOnly);
+                    thumbnail.save(&buffer, "png");
+                    cache.insert(path, modified, size, png);
+                }
+                QMetaObject::invokeMethod(this, [this, forGeneration, i, thumbnail]() { onRead(forGeneration, i, thumbnail); }, Qt::QueuedConnection);
+            }));
+    }
+    list->setUpdatesEnabled(true);
+
+    statusLabel->setText(QString("%1 notebooks").arg(infos.size()) + (pendingReads > 0 ? QString(", reading %1...").arg(pendingReads) : QString()));
+    if (pendingReads == 0) cache.save();
+}
+
+void GalleryDialog::setThumbnail(int row, const QImage& thumbnail)
+{
+    if (QListWidgetItem* item = list->item(row)) item->setIcon(QIcon(QPixmap::fromImage(thumbnail)));
+}
+
+void GalleryDialog::onRead(quint64 forGeneration, int row, const QImage& thumbnail)
+{
+    if (forGeneration != generation) return;
+    if (!thumbnail.isNull()) setThumbnail(row, thumbnail);
+
+    if (--pendingReads > 0)
+    {
+        statusLabel->setText(QString("%1 notebooks, reading %2...").arg(list->count()).arg(pendingReads));
+        return;
+    }
+    statusLabel->setText(QString("%1 notebooks").arg(list->count()));
+    cache.save();
+}
+
+void GalleryDialog::chooseFolder()
+{
+    const QString dir = QFileDialog::getExistingDirectory(this, "Gallery Folder", directory);
+    if (!dir.isEmpty()) setDirectory(dir);
+}
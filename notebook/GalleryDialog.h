@@ -0,0 +1,46 @@
+#pragma once
+
+#include <qdialog.h>
+#include <qlistwidget.h>
+#include <qpushbutton.h>
+#include <qlabel.h>
+#include <qlayout.h>
+#include <qthreadpool.h>
+#include "ThumbnailCache.h"
+
+// Thumbnails of every notebook in a folder, activating one asks for it to be opened.
+// Cached thumbnails show right away, the rest get read out of the notebooks in the background and fill in as they come.
+class GalleryDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    static constexpr int iconSize = 128;
+
+    QVBoxLayout* mainLayout   = new QVBoxLayout();
+    QHBoxLayout* folderLayout = new QHBoxLayout();
+    QPushButton* folderButton = new QPushButton("Folder...");
+    QLabel*      folderLabel  = new QLabel();
+    QListWidget* list         = new QListWidget();
+    QLabel*      statusLabel  = new QLabel();
+
+    GalleryDialog(QWidget* parent);
+    ~GalleryDialog();
+
+    void setDirectory(const QString& dir);
+    void refresh(); // Lists the folder again, notebooks that changed get new thumbnails
+
+signals:
+    void openNotebook(const QString& path);
+
+private:
+    QString directory;
+    ThumbnailCache cache;
+    QThreadPool readers;
+    quint64 generation = 0; // Thumbnails read for a listing that's been replaced get dropped
+    int pendingReads = 0;
+
+    void setThumbnail(int row, const QImage& thumbnail);
+    void onRead(quint64 forGeneration, int row, const QImage& thumbnail);
+    void chooseFolder();
+};
@@ -1,6 +1,10 @@
 #include "Helpers.h"
 #include <qlayout.h>
 #include <qwidget.h>
+#include <qsemaphore.h>
+#include <qthreadpool.h>
+#include <atomic>
+#include <memory>
 
 void Helpers::clearLayout(QLayout* layout, int from)
 {
@@ -10,3 +14,38 @@ void Helpers::clearLayout(QLayout* layout, int from)
         item->widget()->deleteLater();
     }
 }
+
+void Helpers::parallelFor(int count, const std::function<void(int)>& func)
+{
+    if (count <= 0) return;
+    if (count == 1) { func(0); return; }
+
+    // Helpers the pool gets to late find nothing left and just return, so this never waits on a busy pool.
+    // The state is shared so they can still look at it after we've gone.
+    struct State
+    {
+        std::atomic<int> next { 0 };
+        QSemaphore done;
+        std::function<void(int)> func;
+        int count = 0;
+
+        void work()
+        {
+            for (int i = next++; i < count; i = next++)
+            {
+                func(i);
+                done.release();
+            }
+        }
+    };
+    auto state = std::make_shared<State>();
+    state->func  = func;
+    state->count = count;
+
+    QThreadPool* pool = QThreadPool::globalInstance();
+    const int helpers = qMin(count, pool->maxThreadCount()) - 1;
+    for (int i = 0; i < helpers; i++) pool->start(QRunnable::create([state]() { state->work(); }));
+
+    state->work();
+    state->done.acquire(count);
+}
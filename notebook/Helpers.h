@@ -1,9 +1,14 @@
 #pragma once
 
+#include <functional>
+
 class QLayout;
 
 struct Helpers
 {
     static void clearLayout(QLayout* layout, int from = 0);
-};
 
+    // Runs func(0) .. func(count - 1) on the global thread pool and this thread, returns once they're all done.
+    // Items are handed out one at a time, so uneven ones still balance out.
+    static void parallelFor(int count, const std::function<void(int)>& func);
+};
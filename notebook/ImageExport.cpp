@@ -0,0 +1,282 @@
+#include "ImageExport.h"
+
+#include "Helpers.h"
+#include "Trace.h"
+#include <qimagewriter.h>
+#include <qpainter.h>
+#include <qsavefile.h>
+#include <qthreadpool.h>
+#include <zlib.h>
+#include <cstdlib>
+#include <cstring>
+
+static const int bandBytes = 4 << 20;
+
+bool ImageExport::write(const QString& filePath, const QByteArray& format)
+{
+    TRACE_SCOPE("ImageExport::write");
+    if (area.isEmpty()) return false;
+
+    QSaveFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    const bool ok = format.toLower() == "png" ? writePng(file) : writeWhole(file, format);
+    if (!ok || cancelled) { file.cancelWriting(); return false; }
+    return file.commit();
+}
+
+int ImageExport::bandHeight() const
+{
+    // Whole tile rows mean a pending tile only ever gets decoded for one band
+    const int rows = int(qBound<qint64>(1, bandBytes / (qint64(qMax(1, area.width())) * 4), qMax(1, area.height())));
+    return rows >= TiledImage::tileSize ? rows / TiledImage::tileSize * TiledImage::tileSize : rows;
+}
+
+QRect ImageExport::band(int index) const
+{
+    const int rows = bandHeight();
+    const int top = index * rows;
+    return QRect(area.left(), area.top() + top, area.width(), qMin(rows, area.height() - top));
+}
+
+QImage ImageExport::renderBand(const QRect& rect) const
+{
+    TRACE_SCOPE("ImageExport::renderBand");
+    QImage out(rect.size(), TiledImage::format);
+    out.fill(Qt::transparent);
+
+    QPainter painter(&out);
+    painter.translate(-rect.topLeft());
+    const QRect range = TiledImage::tileRange(rect);
+    for (const Layer& layer : layers)
+    {
+        if (!layer.visible || layer.opacity <= 0) continue;
+
+        // Same blend as the composite, a tile a layer doesn't have leaves what's under it alone
+        painter.setOpacity(layer.opacity);
+        painter.setCompositionMode(layer.blend);
+        for (int ty = range.top(); ty <= range.bottom(); ty++)
+        {
+            for (int tx = range.left(); tx <= range.right(); tx++)
+            {
+                const QImage* tile = layer.image.tile(tx, ty);
+                QImage decoded;
+                if (tile == nullptr && layer.image.isPending(TiledImage::key(tx, ty)) && layer.image.tileLoader())
+                {
+                    decoded = layer.image.tileLoader()(tx, ty).convertToFormat(TiledImage::format);
+                    tile = &decoded;
+                }
+                if (tile == nullptr || tile->isNull()) continue;
+                painter.drawImage(TiledImage::tileRect(tx, ty).topLeft(), *tile);
+            }
+        }
+    }
+
+    painter.setOpacity(1);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    scene.paint(painter, rect);
+    painter.end();
+    return out;
+}
+
+bool ImageExport::writePng(QIODevice& device)
+{
+    PngStream png(device);
+    if (!png.begin(area.size())) return false;
+
+    // A batch of bands at a time, one per thread, written out in order before the next batch starts.
+    // That's what bounds the memory: a batch of bands, never the whole picture.
+    const int rows  = bandHeight();
+    const int bands = (area.height() + rows - 1) / rows;
+    const int batch = qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+    std::vector<PngStream::Band> encoded;
+    for (int first = 0; first < bands; first += batch)
+    {
+        const int count = qMin(batch, bands - first);
+        encoded.assign(count, PngStream::Band());
+        Helpers::parallelFor(count, [&](int i)
+            {
+                if (cancelled) return;
+                const QImage rgba = renderBand(band(first + i)).convertToFormat(QImage::Format_RGBA8888);
+                encoded[i] = PngStream::encode(rgba, first + i == bands - 1);
+            });
+        if (cancelled) return false;
+
+        for (const PngStream::Band& out : encoded)
+        {
+            if (!png.append(out)) return false;
+        }
+        if (progress) progress(first + count, bands);
+    }
+    return png.finish();
+}
+
+bool ImageExport::writeWhole(QIODevice& device, const QByteArray& format)
+{
+    QImage image(area.size(), TiledImage::format);
+    if (image.isNull()) return false;
+
+    // Rendered straight into their rows of the one image, bands never overlap so threads don't either
+    uchar* bits = image.bits();
+    const int bytesPerLine = image.bytesPerLine();
+    const int rows  = bandHeight();
+    const int bands = (area.height() + rows - 1) / rows;
+    const int batch = qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+    for (int first = 0; first < bands; first += batch)
+    {
+        const int count = qMin(batch, bands - first);
+        Helpers::parallelFor(count, [&](int i)
+            {
+                if (cancelled) return;
+                const QRect rect = band(first + i);
+                const QImage rendered = renderBand(rect);
+                for (int y = 0; y < rendered.height(); y++)
+                {
+                    std::memcpy(bits + qint64(rect.top() - area.top() + y) * bytesPerLine, rendered.constScanLine(y), size_t(rendered.bytesPerLine()));
+                }
+            });
+        if (cancelled) return false;
+        if (progress) progress(first + count, bands);
+    }
+
+    // In place, the pixels stay the same size
+    image.convertTo(QImage::Format_ARGB32);
+    QImageWriter writer(&device, format);
+    return writer.write(image);
+}
+
+bool PngStream::chunk(const char* type, const char* data, qint64 length)
+{
+    auto bigEndian = [](quint32 value)
+        {
+            const char bytes[4] = { char(value >> 24), char(value >> 16), char(value >> 8), char(value) };
+            return QByteArray(bytes, 4);
+        };
+
+    uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    if (length > 0) crc = crc32(crc, reinterpret_cast<const Bytef*>(data), uInt(length));
+    return device.write(bigEndian(quint32(length))) == 4
+        && device.write(type, 4) == 4
+        && (length == 0 || device.write(data, length) == length)
+        && device.write(bigEndian(quint32(crc))) == 4;
+}
+
+bool PngStream::begin(const QSize& size)
+{
+    static const char signature[8] = { char(0x89), 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (device.write(signature, 8) != 8) return false;
+
+    const quint32 width = quint32(size.width()), height = quint32(size.height());
+    const char header[13] =
+    {
+        char(width >> 24),  char(width >> 16),  char(width >> 8),  char(width),
+        char(height >> 24), char(height >> 16), char(height >> 8), char(height),
+        8, // Bits per channel
+        6, // RGBA
+        0, 0, 0 // Deflate, adaptive filters, not interlaced
+    };
+    return chunk("IHDR", header, sizeof(header));
+}
+
+static inline int paeth(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Every filter tried on the row and the one with the smallest sum of absolute values kept, like libpng does.
+// out gets the filter byte and then the filtered row.
+static void filterRow(const uchar* row, const uchar* above, int length, uchar* scratch, uchar* out)
+{
+    const int bpp = 4;
+    uchar* filtered[5] = { const_cast<uchar*>(row), scratch, scratch + length, scratch + 2 * length, scratch + 3 * length };
+    for (int i = 0; i < length; i++)
+    {
+        const int a = i >= bpp ? row[i - bpp] : 0;
+        const int b = above ? above[i] : 0;
+        const int c = above && i >= bpp ? above[i - bpp] : 0;
+        filtered[1][i] = uchar(row[i] - a);
+        filtered[2][i] = uchar(row[i] - b);
+        filtered[3][i] = uchar(row[i] - ((a + b) >> 1));
+        filtered[4][i] = uchar(row[i] - paeth(a, b, c));
+    }
+
+    // Without the real row above only None and Sub decode the same
+    const int candidates = above ? 5 : 2;
+    int best = 0;
+    quint64 bestCost = ~quint64(0);
+    for (int f = 0; f < candidates; f++)
+    {
+        quint64 cost = 0;
+        for (int i = 0; i < length; i++) cost += quint64(std::abs(int(qint8(filtered[f][i]))));
+        if (cost < bestCost) { bestCost = cost; best = f; }
+    }
+    out[0] = uchar(best);
+    std::memcpy(out + 1, filtered[best], size_t(length));
+}
+
+PngStream::Band PngStream::encode(const QImage& rgba, bool last, int level)
+{
+    TRACE_SCOPE("PngStream::encode");
+    Band band;
+    const int length = rgba.width() * 4;
+    QByteArray filtered(int(qint64(length + 1) * rgba.height()), Qt::Uninitialized);
+    std::vector<uchar> scratch(size_t(length) * 4);
+    uchar* out = reinterpret_cast<uchar*>(filtered.data());
+    for (int y = 0; y < rgba.height(); y++)
+    {
+        filterRow(rgba.constScanLine(y), y > 0 ? rgba.constScanLine(y - 1) : nullptr, length, scratch.data(), out + qint64(y) * (length + 1));
+    }
+    band.length = filtered.size();
+    band.adler  = quint32(adler32(1, reinterpret_cast<const Bytef*>(filtered.constData()), uInt(filtered.size())));
+
+    // Raw deflate, the zlib header and adler go around all the bands together
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return band;
+    band.deflated.resize(int(deflateBound(&stream, uLong(filtered.size()))) + 16);
+    stream.next_in   = reinterpret_cast<Bytef*>(filtered.data());
+    stream.avail_in  = uInt(filtered.size());
+    stream.next_out  = reinterpret_cast<Bytef*>(band.deflated.data());
+    stream.avail_out = uInt(band.deflated.size());
+    for (;;)
+    {
+        const int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (status == Z_STREAM_ERROR) break;
+        if (last ? status == Z_STREAM_END : stream.avail_out > 0) { band.ok = true; break; }
+
+        // Out of room, the bound doesn't count the flush marker
+        const int used = band.deflated.size() - int(stream.avail_out);
+        band.deflated.resize(band.deflated.size() * 2);
+        stream.next_out  = reinterpret_cast<Bytef*>(band.deflated.data()) + used;
+        stream.avail_out = uInt(band.deflated.size() - used);
+    }
+    band.deflated.resize(band.deflated.size() - int(stream.avail_out));
+    deflateEnd(&stream);
+    return band;
+}
+
+bool PngStream::append(const Band& band)
+{
+    if (!band.ok) return false;
+    adler = quint32(adler32_combine(adler, band.adler, z_off_t(band.length)));
+
+    // The zlib header goes in front of the first band's data
+    if (!started)
+    {
+        started = true;
+        static const char zlibHeader[2] = { 0x78, char(0x9c) };
+        QByteArray first(zlibHeader, 2);
+        first.append(band.deflated);
+        return chunk("IDAT", first.constData(), first.size());
+    }
+    return chunk("IDAT", band.deflated.constData(), band.deflated.size());
+}
+
+bool PngStream::finish()
+{
+    if (!started) return false;
+    const char trailer[4] = { char(adler >> 24), char(adler >> 16), char(adler >> 8), char(adler) };
+    return chunk("IDAT", trailer, 4) && chunk("IEND", nullptr, 0);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <qbytearray.h>
+#include <qimage.h>
+#include <qiodevice.h>
+#include <qrect.h>
+#include <qstring.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "LayerStack.h"
+#include "VectorScene.h"
+
+// The canvas flattened into an image file a band of rows at a time, so a huge canvas never needs a full size
+// copy of itself on top of its tiles. Works on its own copy of the layers and vector ink, which is cheap since
+// tiles are shared, so it can run on any thread while drawing goes on. Pending tiles get decoded for the band
+// that needs them and dropped after.
+//
+// PNG gets encoded as it goes, a few bands at a time in parallel, see PngStream. Everything else only has a writer
+// that takes a whole image, those get one full size image rendered in bands, which is still one buffer less than before.
+class ImageExport
+{
+public:
+    std::vector<Layer> layers;
+    VectorScene scene;
+    QRect area; // Image coords
+    std::atomic<bool> cancelled { false };
+    std::function<void(int done, int total)> progress; // In bands, called between batches on the thread write runs on
+
+    // Nothing is left at filePath if it fails or gets cancelled
+    bool write(const QString& filePath, const QByteArray& format);
+
+    int bandHeight() const;                     // About 4MB of pixels, whole tile rows when that's at least one
+    QImage renderBand(const QRect& rect) const; // Premultiplied, over transparent. Safe for several bands at once.
+
+private:
+    QRect band(int index) const;
+    bool writePng(QIODevice& device);
+    bool writeWhole(QIODevice& device, const QByteArray& format);
+};
+
+// A 8 bit RGBA PNG written out as it's made.
+// Bands are filtered and deflated on their own, so several can be encoded at once, and their raw deflate streams
+// joined into the one zlib stream PNG wants: all but the last end on a sync flush, so they line up on a byte,
+// and the adler32s of the bands get combined. Costs a little compression against one stream over everything.
+class PngStream
+{
+public:
+    struct Band
+    {
+        QByteArray deflated;
+        quint32    adler = 1;  // Of the filtered bytes
+        qint64     length = 0; // Filtered bytes, for combining adlers
+        bool       ok = false;
+    };
+
+    PngStream(QIODevice& device) : device(device) { }
+
+    bool begin(const QSize& size); // Signature and header
+
+    // Rows of a Format_RGBA8888 band, last ends the zlib stream. The first row only gets the filters that don't
+    // look at the row above, so bands don't have to overlap.
+    static Band encode(const QImage& rgba, bool last, int level = 6); // zlib levels
+
+    bool append(const Band& band); // In order
+    bool finish();
+
+private:
+    QIODevice& device;
+    quint32 adler = 1;
+    bool started = false;
+
+    bool chunk(const char* type, const char* data, qint64 length);
+};
@@ -0,0 +1,124 @@
+#include "InkHistory.h"
+
+qint64 InkHistory::entrySize(const Entry& entry)
+{
+    qint64 size = 0;
+    for (const TileDelta& delta : entry.tiles) size += delta.pixels.size() + qint64(sizeof(TileDelta));
+    for (const VectorChange& change : entry.vectors) size += change.item.points.size() * qint64(sizeof(QPointF)) + qint64(sizeof(VectorChange));
+    return size;
+}
+
+void InkHistory::push(Entry&& entry)
+{
+    if (entry.empty()) return;
+
+    for (const Entry& e : redoStack) bytes -= entrySize(e);
+    redoStack.clear();
+
+    bytes += entrySize(entry);
+    undoStack.push_back(std::move(entry));
+    trim(undoStack);
+}
+
+void InkHistory::clear()
+{
+    undoStack.clear();
+    redoStack.clear();
+    bytes = 0;
+}
+
+void InkHistory::trim(const std::deque<Entry>& newest)
+{
+    // Oldest undo goes first, then whatever redo is furthest away.
+    // The entry just pushed stays even on its own over the limit, or the edit it's for couldn't be undone at all.
+    auto evictable = [&](const std::deque<Entry>& stack) { return stack.size() > (&stack == &newest ? 1u : 0u); };
+    while (bytes > memoryLimit && evictable(undoStack))
+    {
+        bytes -= entrySize(undoStack.front());
+        undoStack.pop_front();
+    }
+    while (bytes > memoryLimit && evictable(redoStack))
+    {
+        bytes -= entrySize(redoStack.front());
+        redoStack.pop_front();
+    }
+}
+
+InkHistory::TileDelta InkHistory::capture(quint64 key, const QRect& rect, const QImage& tile)
+{
+    TileDelta delta;
+    delta.key    = key;
+    delta.rect   = rect;
+    delta.absent = tile.isNull();
+    if (delta.absent) return delta;
+
+    const QPoint origin = TiledImage::keyToCoords(key) * TiledImage::tileSize;
+    const QImage crop = tile.copy(rect.translated(-origin));
+    delta.pixels = qCompress(crop.constBits(), int(crop.sizeInBytes()), 1);
+    return delta;
+}
+
+void InkHistory::restore(TiledImage& image, const TileDelta& delta)
+{
+    const QPoint coords = TiledImage::keyToCoords(delta.key);
+
+    // The edit only touched rect, so everything else in a tile that wasn't there is still empty
+    if (delta.absent) { image.removeTile(coords.x(), coords.y()); return; }
+
+    const QByteArray raw = qUncompress(delta.pixels);
+    const QImage pixels(reinterpret_cast<const uchar*>(raw.constData()), delta.rect.width(), delta.rect.height(),
+                        delta.rect.width() * 4, TiledImage::format);
+    image.writePixels(delta.rect, pixels);
+}
+
+InkHistory::Entry InkHistory::exchange(const Entry& entry, LayerStack& layers, VectorScene& scene, QRegion& changed)
+{
+    // Keep what's there now so it can be put back
+    Entry opposite;
+    opposite.layer = entry.layer;
+    opposite.tiles.reserve(entry.tiles.size());
+    const int index = layers.indexOf(entry.layer);
+    if (index >= 0)
+    {
+        TiledImage& image = layers.at(index).image;
+        QRegion restored;
+        for (const TileDelta& delta : entry.tiles)
+        {
+            const QPoint coords = TiledImage::keyToCoords(delta.key);
+            image.loadPending(coords.x(), coords.y());
+            const QImage* tile = image.tile(coords.x(), coords.y());
+            opposite.tiles.push_back(capture(delta.key, delta.rect, tile ? *tile : QImage()));
+
+            restore(image, delta);
+            restored += delta.rect;
+        }
+        layers.changed(index, restored);
+        changed += restored;
+    }
+
+    opposite.vectors.reserve(entry.vectors.size());
+    for (auto it = entry.vectors.rbegin(); it != entry.vectors.rend(); ++it)
+    {
+        if (it->present) scene.add(it->item);
+        else scene.remove(it->item.id);
+        changed += it->item.bounds.toAlignedRect();
+        opposite.vectors.push_back({ it->item, !it->present });
+    }
+    return opposite;
+}
+
+bool InkHistory::swap(std::deque<Entry>& from, std::deque<Entry>& to, LayerStack& layers, VectorScene& scene, QRegion& changed, Entry* applied)
+{
+    if (from.empty()) return false;
+
+    Entry entry = std::move(from.back());
+    from.pop_back();
+    bytes -= entrySize(entry);
+
+    Entry opposite = exchange(entry, layers, scene, changed);
+    bytes += entrySize(opposite);
+    to.push_back(std::move(opposite));
+    trim(to);
+    if (applied) *applied = std::move(entry);
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <qbytearray.h>
+#include <qregion.h>
+#include <deque>
+#include <vector>
+#include "LayerStack.h"
+#include "VectorScene.h"
+
+// Undo/redo for the ink layers.
+// Entries don't copy the image, they keep the pixels an edit touched, per tile and compressed.
+// Undoing swaps those back in and keeps what was there for redo, so both cost the size of the edit.
+class InkHistory
+{
+public:
+    struct TileDelta
+    {
+        quint64    key = 0;
+        QRect      rect;           // Image coords, inside the tile
+        bool       absent = false; // The tile didn't exist, restoring drops it
+        QByteArray pixels;         // qCompress'd premultiplied rows of rect
+    };
+
+    // Retained mode strokes and shapes, kept whole since they're small
+    struct VectorChange
+    {
+        VectorItem item;
+        bool       present = false; // Restoring puts the item back if set, otherwise takes it out
+    };
+
+    struct Entry
+    {
+        quint32                   layer = 0; // Id of the layer the tiles are from
+        std::vector<TileDelta>    tiles;
+        std::vector<VectorChange> vectors;
+        bool empty() const { return tiles.empty() && vectors.empty(); }
+    };
+
+    qint64 memoryLimit = 64 * 1024 * 1024; // Oldest entries get dropped past this, the newest never is
+
+    void push(Entry&& entry);
+    void clear();
+
+    // applied gets the entry that was put back, for the journal
+    bool undo(LayerStack& layers, VectorScene& scene, QRegion& changed, Entry* applied = nullptr) { return swap(undoStack, redoStack, layers, scene, changed, applied); }
+    bool redo(LayerStack& layers, VectorScene& scene, QRegion& changed, Entry* applied = nullptr) { return swap(redoStack, undoStack, layers, scene, changed, applied); }
+
+    // Puts back an entry from neither stack, like an undo replayed on top of a save. What it replaces becomes an undo step.
+    void apply(const Entry& entry, LayerStack& layers, VectorScene& scene, QRegion& changed) { push(exchange(entry, layers, scene, changed)); }
+
+    bool   inline canUndo()     const { return !undoStack.empty(); }
+    bool   inline canRedo()     const { return !redoStack.empty(); }
+    qint64 inline memoryUsage() const { return bytes; }
+
+    static TileDelta capture(quint64 key, const QRect& rect, const QImage& tile);
+    static void restore(TiledImage& image, const TileDelta& delta);
+
+private:
+    std::deque<Entry> undoStack;
+    std::deque<Entry> redoStack;
+    qint64 bytes = 0;
+
+    static qint64 entrySize(const Entry& entry);
+    static Entry exchange(const Entry& entry, LayerStack& layers, VectorScene& scene, QRegion& changed); // Returns what it replaced
+    bool swap(std::deque<Entry>& from, std::deque<Entry>& to, LayerStack& layers, VectorScene& scene, QRegion& changed, Entry* applied);
+    void trim(const std::deque<Entry>& newest); // The stack that just got an entry pushed
+};
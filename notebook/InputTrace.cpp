@@ -0,0 +1,319 @@
+#include "InputTrace.h"
+#include "Canvas.h"
+#include "ToolSelector.h"
+#include "Varint.h"
+#include <qapplication.h>
+#include <qfile.h>
+#include <qjsonarray.h>
+#include <qthread.h>
+#include <algorithm>
+#include <cmath>
+
+static const char    traceMagic[4]   = { 'N', 'B', 'T', 'R' };
+static const quint8  traceVersion    = 1;
+static const int     positionScale   = 16;    // Stored positions are 1/16 px
+static const qint64  frameIntervalUs = 16667; // Replays step frames at 60 Hz of trace time
+
+static bool hasPosition(TraceEvent::Type type) { return type != TraceEvent::Type::keyPress && type != TraceEvent::Type::tool; }
+
+QByteArray InputTrace::serialize() const
+{
+    QByteArray out;
+    out.append(traceMagic, 4);
+    out.append(char(traceVersion));
+    Varint::write(out, quint64(qMax(0, viewportSize.width())));
+    Varint::write(out, quint64(qMax(0, viewportSize.height())));
+
+    qint64 lastTime = 0;
+    QPoint lastPos;
+    for (const TraceEvent& event : events)
+    {
+        out.append(char(event.type));
+        Varint::write(out, quint64(qMax<qint64>(0, event.time - lastTime)));
+        lastTime = qMax(lastTime, event.time);
+
+        if (hasPosition(event.type))
+        {
+            const QPoint pos(qRound(event.pos.x() * positionScale), qRound(event.pos.y() * positionScale));
+            Varint::writeSigned(out, pos.x() - lastPos.x());
+            Varint::writeSigned(out, pos.y() - lastPos.y());
+            lastPos = pos;
+        }
+
+        switch (event.type)
+        {
+        case TraceEvent::Type::mousePress:
+        case TraceEvent::Type::mouseMove:
+        case TraceEvent::Type::mouseRelease:
+            out.append(char(event.button));
+            out.append(char(event.buttons));
+            out.append(char(event.modifiers));
+            break;
+        case TraceEvent::Type::wheel:
+            Varint::writeSigned(out, event.angleDelta.x());
+            Varint::writeSigned(out, event.angleDelta.y());
+            out.append(char(event.buttons));
+            out.append(char(event.modifiers));
+            break;
+        case TraceEvent::Type::keyPress:
+        {
+            const QByteArray text = event.text.toUtf8();
+            Varint::write(out, quint64(quint32(event.key)));
+            out.append(char(event.modifiers));
+            Varint::write(out, quint64(text.size()));
+            out.append(text);
+            break;
+        }
+        case TraceEvent::Type::tool:
+            Varint::write(out, quint64(qMax(0, event.key)));
+            break;
+        }
+    }
+    return out;
+}
+
+bool InputTrace::deserialize(const QByteArray& bytes)
+{
+    events.clear();
+    if (bytes.size() < 5 || !bytes.startsWith(QByteArray(traceMagic, 4)) || quint8(bytes[4]) > traceVersion) return false;
+
+    VarintReader in { bytes.constData() + 5, bytes.constData() + bytes.size() };
+    const int width  = int(in.varint());
+    const int height = int(in.varint());
+    viewportSize = QSize(width, height);
+
+    qint64 time = 0;
+    QPoint pos;
+    while (in.ok && in.at < in.end)
+    {
+        TraceEvent event;
+        const quint8 type = in.byte();
+        if (type > quint8(TraceEvent::Type::tool)) return false;
+        event.type = TraceEvent::Type(type);
+        time += qint64(in.varint());
+        event.time = time;
+
+        if (hasPosition(event.type))
+        {
+            pos += QPoint(int(in.signedVarint()), int(in.signedVarint()));
+            event.pos = QPointF(pos) / positionScale;
+        }
+
+        switch (event.type)
+        {
+        case TraceEvent::Type::mousePress:
+        case TraceEvent::Type::mouseMove:
+        case TraceEvent::Type::mouseRelease:
+            event.button    = in.byte();
+            event.buttons   = in.byte();
+            event.modifiers = in.byte();
+            break;
+        case TraceEvent::Type::wheel:
+            event.angleDelta.setX(int(in.signedVarint()));
+            event.angleDelta.setY(int(in.signedVarint()));
+            event.buttons   = in.byte();
+            event.modifiers = in.byte();
+            break;
+        case TraceEvent::Type::keyPress:
+        {
+            event.key       = int(quint32(in.varint()));
+            event.modifiers = in.byte();
+            const quint64 length = in.varint();
+            if (length > quint64(in.end - in.at)) return false;
+            event.text = QString::fromUtf8(in.at, int(length));
+            in.at += length;
+            break;
+        }
+        case TraceEvent::Type::tool:
+            event.key = int(in.varint());
+            break;
+        }
+        if (in.ok) events.push_back(std::move(event));
+    }
+    return in.ok;
+}
+
+bool InputTrace::save(const QString& filePath) const
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    const QByteArray bytes = serialize();
+    return file.write(bytes) == bytes.size();
+}
+
+bool InputTrace::load(const QString& filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    return deserialize(file.readAll());
+}
+
+static quint8 packModifiers(Qt::KeyboardModifiers modifiers) { return quint8(quint32(modifiers) >> 25); }
+static Qt::KeyboardModifiers unpackModifiers(quint8 modifiers) { return Qt::KeyboardModifiers(quint32(modifiers) << 25); }
+
+TraceEvent& InputRecorder::add(TraceEvent::Type type)
+{
+    trace.events.emplace_back();
+    TraceEvent& event = trace.events.back();
+    event.type = type;
+    event.time = clock.nsecsElapsed() / 1000;
+    return event;
+}
+
+void InputRecorder::record(const QMouseEvent* event)
+{
+    TraceEvent::Type type = TraceEvent::Type::mouseMove;
+    if      (event->type() == QEvent::MouseButtonPress)   type = TraceEvent::Type::mousePress;
+    else if (event->type() == QEvent::MouseButtonRelease) type = TraceEvent::Type::mouseRelease;
+    else if (event->type() != QEvent::MouseMove) return;
+
+    TraceEvent& e = add(type);
+    e.pos       = event->localPos();
+    e.button    = quint8(event->button());
+    e.buttons   = quint8(event->buttons());
+    e.modifiers = packModifiers(event->modifiers());
+}
+
+void InputRecorder::record(const QWheelEvent* event)
+{
+    TraceEvent& e = add(TraceEvent::Type::wheel);
+    e.pos        = event->position();
+    e.angleDelta = event->angleDelta();
+    e.buttons    = quint8(event->buttons());
+    e.modifiers  = packModifiers(event->modifiers());
+}
+
+void InputRecorder::record(const QKeyEvent* event)
+{
+    TraceEvent& e = add(TraceEvent::Type::keyPress);
+    e.key       = event->key();
+    e.modifiers = packModifiers(event->modifiers());
+    e.text      = event->text();
+}
+
+void InputRecorder::recordTool(int index)
+{
+    add(TraceEvent::Type::tool).key = index;
+}
+
+void InputReplayer::frame()
+{
+    if (!canvas->repaintScheduler->framePending()) return;
+
+    QElapsedTimer timer;
+    timer.start();
+    canvas->repaintScheduler->flushNow();
+    frameNs.push_back(timer.nsecsElapsed());
+}
+
+void InputReplayer::dispatch(const TraceEvent& event)
+{
+    const Qt::KeyboardModifiers modifiers = unpackModifiers(event.modifiers);
+    const Qt::MouseButtons buttons = Qt::MouseButtons(event.buttons);
+
+    switch (event.type)
+    {
+    case TraceEvent::Type::mousePress:
+    case TraceEvent::Type::mouseMove:
+    case TraceEvent::Type::mouseRelease:
+    {
+        const QEvent::Type type = event.type == TraceEvent::Type::mousePress ? QEvent::MouseButtonPress
+                                : event.type == TraceEvent::Type::mouseRelease ? QEvent::MouseButtonRelease : QEvent::MouseMove;
+        QMouseEvent mouse(type, event.pos, Qt::MouseButton(event.button), buttons, modifiers);
+        QCoreApplication::sendEvent(canvas->viewport(), &mouse);
+        break;
+    }
+    case TraceEvent::Type::wheel:
+    {
+        QWheelEvent wheel(event.pos, canvas->viewport()->mapToGlobal(event.pos.toPoint()), QPoint(), event.angleDelta,
+                          buttons, modifiers, Qt::NoScrollPhase, false);
+        QCoreApplication::sendEvent(canvas->viewport(), &wheel);
+        break;
+    }
+    case TraceEvent::Type::keyPress:
+    {
+        QKeyEvent key(QEvent::KeyPress, event.key, modifiers, event.text);
+        QCoreApplication::sendEvent(canvas, &key);
+        break;
+    }
+    case TraceEvent::Type::tool:
+        tools->selectTool(event.key);
+        break;
+    }
+}
+
+void InputReplayer::run(const InputTrace& trace, bool realTime)
+{
+    // Same viewport as when it was recorded, or every position lands somewhere else
+    QWidget* window = canvas->window();
+    if (trace.viewportSize.isValid()) window->resize(window->size() + trace.viewportSize - canvas->viewport()->size());
+    QApplication::setActiveWindow(window); // Some tools ignore input while the window isn't active
+    QCoreApplication::processEvents();
+
+    canvas->repaintScheduler->setManualFrames(true);
+    eventNs.clear();
+    frameNs.clear();
+    eventNs.reserve(trace.events.size());
+
+    QElapsedTimer wall;
+    wall.start();
+    qint64 nextFrame = frameIntervalUs;
+    for (const TraceEvent& event : trace.events)
+    {
+        // Whatever piled up before this event gets drawn in the frame it would have been in
+        if (event.time >= nextFrame)
+        {
+            frame();
+            nextFrame = (event.time / frameIntervalUs + 1) * frameIntervalUs;
+        }
+
+        if (realTime)
+        {
+            const qint64 wait = event.time - wall.nsecsElapsed() / 1000;
+            if (wait > 0) QThread::usleep(quint64(wait));
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        dispatch(event);
+        eventNs.push_back(timer.nsecsElapsed());
+    }
+    frame();
+
+    wallNs  = wall.nsecsElapsed();
+    traceUs = trace.events.empty() ? 0 : trace.events.back().time;
+    canvas->repaintScheduler->setManualFrames(false);
+}
+
+static QJsonObject summarize(std::vector<qint64> samples)
+{
+    QJsonObject out;
+    out["count"] = int(samples.size());
+    if (samples.empty()) return out;
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p)
+        {
+            const size_t rank = size_t(std::ceil(p / 100.0 * samples.size()));
+            return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)] / 1e6;
+        };
+    qint64 total = 0;
+    for (qint64 sample : samples) total += sample;
+
+    out["mean_ms"] = total / 1e6 / samples.size();
+    out["p50_ms"]  = percentile(50);
+    out["p90_ms"]  = percentile(90);
+    out["p99_ms"]  = percentile(99);
+    out["max_ms"]  = samples.back() / 1e6;
+    return out;
+}
+
+QJsonObject InputReplayer::report() const
+{
+    QJsonObject out;
+    out["trace_ms"] = traceUs / 1e3;
+    out["wall_ms"]  = wallNs / 1e6;
+    out["events"]   = summarize(eventNs);
+    out["frames"]   = summarize(frameNs);
+    return out;
+}
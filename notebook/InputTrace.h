@@ -0,0 +1,94 @@
+#pragma once
+
+#include <qbytearray.h>
+#include <qelapsedtimer.h>
+#include <qevent.h>
+#include <qjsonobject.h>
+#include <qstring.h>
+#include <vector>
+
+class Canvas;
+class ToolSelector;
+
+// One input that reached the canvas, or a tool switch
+struct TraceEvent
+{
+    enum class Type : quint8
+    {
+        mousePress,
+        mouseMove,
+        mouseRelease,
+        wheel,
+        keyPress,
+        tool
+    };
+
+    Type    type = Type::mouseMove;
+    qint64  time = 0;     // Microseconds since recording started
+    QPointF pos;          // Viewport coords
+    quint8  button    = 0;
+    quint8  buttons   = 0;
+    quint8  modifiers = 0; // Qt::KeyboardModifiers >> 25, they all sit above that
+    QPoint  angleDelta;   // Wheel
+    int     key = 0;      // Key press, or the tool's index for a tool switch
+    QString text;
+};
+
+// Input recorded off a canvas, for replaying a session that was slow.
+//
+// File: "NBTR", version byte, viewport width and height, then the events.
+// Everything after the magic is varints: times are deltas from the previous event,
+// positions are deltas in 1/16 px, zigzag encoded. A mouse move is usually 5 or 6 bytes.
+struct InputTrace
+{
+    QSize viewportSize;
+    std::vector<TraceEvent> events;
+
+    QByteArray serialize() const;
+    bool deserialize(const QByteArray& bytes);
+    bool save(const QString& filePath) const;
+    bool load(const QString& filePath);
+};
+
+// Canvas has one of these while recording, it calls in from its event handlers
+class InputRecorder
+{
+public:
+    InputTrace trace;
+
+    InputRecorder(const QSize& viewportSize) { trace.viewportSize = viewportSize; clock.start(); }
+
+    void record(const QMouseEvent* event);
+    void record(const QWheelEvent* event);
+    void record(const QKeyEvent* event);
+    void recordTool(int index);
+
+private:
+    QElapsedTimer clock;
+
+    TraceEvent& add(TraceEvent::Type type);
+};
+
+// Feeds a trace back into a canvas without a display.
+// Frames are stepped by the trace clock, not the wall clock, so the same trace coalesces the same way every run
+// whether it plays as fast as possible or in real time.
+class InputReplayer
+{
+public:
+    InputReplayer(Canvas* canvas, ToolSelector* tools) : canvas(canvas), tools(tools) { }
+
+    void run(const InputTrace& trace, bool realTime);
+    QJsonObject report() const; // Per-event handling and per-frame times, as percentiles
+
+private:
+    Canvas*       canvas;
+    ToolSelector* tools;
+
+    std::vector<qint64> eventNs;
+    std::vector<qint64> frameNs;
+    qint64 traceUs = 0;
+    qint64 wallNs  = 0;
+
+    void dispatch(const TraceEvent& event);
+    void frame();
+};
@@ -0,0 +1,618 @@
+#include "Journal.h"
+
+#include "Canvas.h"
+#include "Tools.h"
+#include "Trace.h"
+#include "Varint.h"
+#include <qbuffer.h>
+#include <qdatetime.h>
+#include <qdir.h>
+#include <qfileinfo.h>
+#include <qstandardpaths.h>
+#include <qtextcursor.h>
+#include <qtextdocument.h>
+#include <zlib.h>
+#include <cstring>
+
+static const char   journalMagic[4] = { 'N', 'B', 'J', 'L' };
+static const quint8 journalVersion  = 2;
+static const int    positionScale   = 64; // Stored positions are 1/64 px
+
+static QString appDataDir()  { return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation); }
+static QString sessionFile() { return appDataDir() + "/journal-session"; }
+
+static QByteArray payload(Journal::Op op) { return QByteArray(1, char(op)); }
+
+static void writeText(QByteArray& out, const QString& text)
+{
+    const QByteArray utf8 = text.toUtf8();
+    Varint::write(out, quint64(utf8.size()));
+    out.append(utf8);
+}
+
+static void writePoint(QByteArray& out, const QPoint& p)  { Varint::writeSigned(out, p.x()); Varint::writeSigned(out, p.y()); }
+static void writeColor(QByteArray& out, const QColor& c) { Varint::write(out, c.rgba()); }
+
+// Deltas from the point before, the points of a stroke are close together
+static void writePoints(QByteArray& out, const QPolygonF& points)
+{
+    Varint::write(out, quint64(points.size()));
+    QPoint last;
+    for (const QPointF& p : points)
+    {
+        const QPoint scaled(qRound(p.x() * positionScale), qRound(p.y() * positionScale));
+        writePoint(out, scaled - last);
+        last = scaled;
+    }
+}
+
+static void writeItem(QByteArray& out, const VectorItem& item)
+{
+    Varint::write(out, item.id);
+    out.append(char(item.kind));
+    Varint::write(out, item.color);
+    quint32 width = 0;
+    std::memcpy(&width, &item.width, sizeof(width));
+    Varint::write(out, width);
+    writePoints(out, item.points);
+}
+
+static QString readText(VarintReader& in)
+{
+    const quint64 length = in.varint();
+    if (!in.ok || length > quint64(in.end - in.at)) { in.ok = false; return QString(); }
+    const QString text = QString::fromUtf8(in.at, int(length));
+    in.at += length;
+    return text;
+}
+
+static QPoint readPoint(VarintReader& in)
+{
+    const int x = int(in.signedVarint());
+    return QPoint(x, int(in.signedVarint()));
+}
+
+static QColor readColor(VarintReader& in) { return QColor::fromRgba(QRgb(in.varint())); }
+
+static QPolygonF readPoints(VarintReader& in)
+{
+    QPolygonF points;
+    const quint64 count = in.varint();
+    if (!in.ok || count > quint64(in.end - in.at)) { in.ok = false; return points; } // A point is two bytes at least
+    points.reserve(int(count));
+    QPoint last;
+    for (quint64 i = 0; i < count && in.ok; i++)
+    {
+        last += readPoint(in);
+        points << QPointF(last) / positionScale;
+    }
+    return points;
+}
+
+static VectorItem readItem(VarintReader& in)
+{
+    VectorItem item;
+    item.id    = quint32(in.varint());
+    item.kind  = VectorItem::Kind(in.byte());
+    item.color = QRgb(in.varint());
+    const quint32 width = quint32(in.varint());
+    std::memcpy(&item.width, &width, sizeof(width));
+    item.points = readPoints(in);
+    if (item.kind > VectorItem::Kind::line) in.ok = false;
+    item.updateBounds();
+    return item;
+}
+
+static quint32 payloadCrc(const char* data, quint64 length)
+{
+    return quint32(crc32(0, reinterpret_cast<const Bytef*>(data), uInt(length)));
+}
+
+static quint32 storedCrc(const char* at)
+{
+    const uchar* bytes = reinterpret_cast<const uchar*>(at);
+    return quint32(bytes[0]) | quint32(bytes[1]) << 8 | quint32(bytes[2]) << 16 | quint32(bytes[3]) << 24;
+}
+
+QString Journal::pathFor(const QString& notebookPath)
+{
+    if (notebookPath.isEmpty()) return appDataDir() + "/untitled.journal";
+    return QFileInfo(notebookPath).absoluteFilePath() + ".journal";
+}
+
+QString Journal::lastSession()
+{
+    QFile session(sessionFile());
+    if (!session.open(QIODevice::ReadOnly)) return QString();
+    const QString path = QString::fromUtf8(session.readAll());
+    return QFile::exists(path) ? path : QString();
+}
+
+bool Journal::Contents::baseMatches() const
+{
+    if (basePath.isEmpty()) return true;
+    const QFileInfo base(basePath);
+    return base.exists() && base.lastModified().toMSecsSinceEpoch() == baseModified && base.size() == baseSize;
+}
+
+bool Journal::read(const QString& journalPath, Contents& out)
+{
+    QFile in(journalPath);
+    if (!in.open(QIODevice::ReadOnly)) return false;
+    const QByteArray bytes = in.readAll();
+    if (bytes.size() < 5 || std::memcmp(bytes.constData(), journalMagic, 4) != 0 || quint8(bytes[4]) != journalVersion) return false;
+
+    VarintReader reader { bytes.constData() + 5, bytes.constData() + bytes.size() };
+    out.basePath     = readText(reader);
+    out.baseModified = qint64(reader.varint());
+    out.baseSize     = qint64(reader.varint());
+    if (!reader.ok) return false;
+
+    // Whole records only, the first one that's cut short or garbled ends it
+    const char* start = reader.at;
+    const char* whole = reader.at;
+    out.count = 0;
+    while (reader.at < reader.end)
+    {
+        const quint64 length = reader.varint();
+        if (!reader.ok || length + 4 > quint64(reader.end - reader.at)) break;
+        if (payloadCrc(reader.at, length) != storedCrc(reader.at + length)) break;
+        reader.at += length + 4;
+        whole = reader.at;
+        out.count++;
+    }
+    out.records = QByteArray(start, int(whole - start));
+    return true;
+}
+
+bool Journal::start(const QString& basePath)
+{
+    const QString path = pathFor(basePath);
+    if (file.isOpen())
+    {
+        // Whatever was in the old one is part of the state this starts from
+        const QString old = file.fileName();
+        file.close();
+        if (QFileInfo(old).absoluteFilePath() != QFileInfo(path).absoluteFilePath()) QFile::remove(old);
+    }
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    file.setFileName(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)) return false;
+
+    const QFileInfo base(basePath);
+    QByteArray header(journalMagic, 4);
+    header.append(char(journalVersion));
+    writeText(header, basePath.isEmpty() ? QString() : base.absoluteFilePath());
+    Varint::write(header, basePath.isEmpty() ? 0 : quint64(base.lastModified().toMSecsSinceEpoch()));
+    Varint::write(header, basePath.isEmpty() ? 0 : quint64(base.size()));
+    if (file.write(header) != header.size()) { file.close(); return false; }
+    headerSize = header.size();
+    written    = 0;
+    dropped    = 0;
+
+    // So it can be found again if the app doesn't get to close
+    QFile session(sessionFile());
+    if (session.open(QIODevice::WriteOnly | QIODevice::Truncate)) session.write(QFileInfo(path).absoluteFilePath().toUtf8());
+    return true;
+}
+
+bool Journal::rebase(const QString& basePath, qint64 checkpoint)
+{
+    if (!file.isOpen()) return false;
+    TRACE_SCOPE("Journal::rebase");
+
+    // What was recorded while the save ran isn't in the file, it goes on top of it
+    const qint64 skip = qBound<qint64>(0, checkpoint - dropped, written);
+    QByteArray tail;
+    QFile old(file.fileName());
+    if (old.open(QIODevice::ReadOnly) && old.seek(headerSize + skip)) tail = old.readAll();
+    old.close();
+
+    const qint64 droppedBefore = dropped;
+    if (!start(basePath)) return false;
+    dropped = droppedBefore + skip;
+    if (tail.isEmpty()) return true;
+    if (file.write(tail) != tail.size()) { file.close(); return false; }
+    written = tail.size();
+    return true;
+}
+
+void Journal::close(bool remove)
+{
+    if (!file.isOpen()) return;
+    file.close();
+    if (!remove) return;
+    file.remove();
+    QFile::remove(sessionFile());
+}
+
+void Journal::append(const QByteArray& payload)
+{
+    QByteArray record;
+    record.reserve(payload.size() + 14);
+    Varint::write(record, quint64(payload.size()));
+    record.append(payload);
+    const quint32 crc = payloadCrc(payload.constData(), quint64(payload.size()));
+    for (int i = 0; i < 4; i++) record.append(char(crc >> (8 * i)));
+
+    // Past a failed write the records would have a hole in them, better none at all from there
+    if (file.write(record) != record.size()) { file.close(); return; }
+    written += record.size();
+}
+
+void Journal::record(Op op)
+{
+    if (recording()) append(payload(op));
+}
+
+void Journal::index(Op op, int index)
+{
+    if (!recording()) return;
+    QByteArray out = payload(op);
+    Varint::writeSigned(out, index);
+    append(out);
+}
+
+void Journal::indexValue(Op op, int index, qint64 value)
+{
+    if (!recording()) return;
+    QByteArray out = payload(op);
+    Varint::writeSigned(out, index);
+    Varint::writeSigned(out, value);
+    append(out);
+}
+
+void Journal::indexText(Op op, int index, const QString& text)
+{
+    if (!recording()) return;
+    QByteArray out = payload(op);
+    Varint::writeSigned(out, index);
+    writeText(out, text);
+    append(out);
+}
+
+void Journal::brush(const QPolygonF& polyline, int width, const QColor& color, bool erase)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::brush);
+    Varint::write(out, quint64(qMax(0, width)));
+    writeColor(out, color);
+    out.append(char(erase));
+    writePoints(out, polyline);
+    append(out);
+}
+
+void Journal::shape(int shape, const QPoint& p1, const QPoint& p2, int width, const QColor& color)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::shape);
+    out.append(char(shape));
+    writePoint(out, p1);
+    writePoint(out, p2);
+    Varint::write(out, quint64(qMax(0, width)));
+    writeColor(out, color);
+    append(out);
+}
+
+void Journal::stamp(const QPoint& p1, const QPoint& p2, const QString& text, int fontSize, const QColor& color)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::stamp);
+    writePoint(out, p1);
+    writePoint(out, p2);
+    Varint::write(out, quint64(qMax(0, fontSize)));
+    writeColor(out, color);
+    writeText(out, text);
+    append(out);
+}
+
+void Journal::fill(const QPoint& pos, int tolerance, const QColor& color)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::fill);
+    writePoint(out, pos);
+    Varint::write(out, quint64(qMax(0, tolerance)));
+    writeColor(out, color);
+    append(out);
+}
+
+void Journal::addVector(const VectorItem& item)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::addVector);
+    writeItem(out, item);
+    append(out);
+}
+
+void Journal::extendVector(quint32 id, const QPolygonF& points)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::extendVector);
+    Varint::write(out, id);
+    writePoints(out, points);
+    append(out);
+}
+
+void Journal::inkChange(Op op, int layer, const InkHistory::Entry& change)
+{
+    if (!recording()) return;
+    QByteArray out = payload(op);
+    Varint::writeSigned(out, layer);
+    Varint::write(out, quint64(change.tiles.size()));
+    for (const InkHistory::TileDelta& delta : change.tiles)
+    {
+        Varint::write(out, delta.key);
+        writePoint(out, delta.rect.topLeft());
+        writePoint(out, QPoint(delta.rect.width(), delta.rect.height()));
+        out.append(char(delta.absent));
+        Varint::write(out, quint64(delta.pixels.size()));
+        out.append(delta.pixels);
+    }
+    Varint::write(out, quint64(change.vectors.size()));
+    for (const InkHistory::VectorChange& vector : change.vectors)
+    {
+        out.append(char(vector.present));
+        writeItem(out, vector.item);
+    }
+    append(out);
+}
+
+void Journal::resize(const QSize& size)
+{
+    if (!recording()) return;
+    QByteArray out = payload(Op::resize);
+    Varint::write(out, quint64(qMax(0, size.width())));
+    Varint::write(out, quint64(qMax(0, size.height())));
+    append(out);
+}
+
+void Journal::image(const QImage& image)
+{
+    if (!recording()) return;
+    QByteArray png;
+    QBuffer buffer(&png);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "png");
+
+    QByteArray out = payload(Op::image);
+    Varint::write(out, quint64(png.size()));
+    out.append(png);
+    append(out);
+}
+
+void Journal::textEdit(QTextDocument* document, int position, int removed, int added)
+{
+    if (!recording()) return;
+    QTextCursor cursor(document);
+    const int last = document->characterCount() - 1;
+    cursor.setPosition(qBound(0, position, last));
+    cursor.setPosition(qBound(0, position + added, last), QTextCursor::KeepAnchor);
+
+    QByteArray out = payload(Op::textEdit);
+    Varint::write(out, quint64(qMax(0, position)));
+    Varint::write(out, quint64(qMax(0, removed)));
+    writeText(out, cursor.selectedText()); // Blocks are split by U+2029 in here, inserting it splits them again
+    append(out);
+}
+
+int Journal::replay(const QByteArray& records, Canvas& canvas)
+{
+    TRACE_SCOPE("Journal::replay");
+
+    // Raster records were made by tools and go back through them, all a tool needs for that is the canvas
+    DrawTool   drawTool;
+    ShapeTool  shapeTool;
+    TextTool   textTool;
+    BucketTool bucketTool;
+    drawTool.canvas = shapeTool.canvas = textTool.canvas = bucketTool.canvas = &canvas;
+
+    VarintReader frames { records.constData(), records.constData() + records.size() };
+    int applied   = 0;
+    int openEdits = 0;
+    while (frames.at < frames.end)
+    {
+        const quint64 length = frames.varint();
+        if (!frames.ok || length + 4 > quint64(frames.end - frames.at)) break;
+        VarintReader in { frames.at, frames.at + length };
+        frames.at += length + 4; // The crc was checked by read
+
+        const Op op = Op(in.byte());
+        switch (op)
+        {
+        case Op::beginEdit:
+            canvas.journal.record(op);
+            canvas.beginEdit();
+            openEdits++;
+            break;
+        case Op::endEdit:
+            canvas.journal.record(op);
+            canvas.endEdit();
+            openEdits = qMax(0, openEdits - 1);
+            break;
+        case Op::brush:
+        {
+            const int width    = int(in.varint());
+            const QColor color = readColor(in);
+            const bool erase   = in.byte() != 0;
+            const QPolygonF points = readPoints(in);
+            if (in.ok) drawTool.drawBrush(points, width, color, erase);
+            break;
+        }
+        case Op::shape:
+        {
+            shapeTool.selectedShape = ShapeTool::Shape(in.byte());
+            const QPoint p1 = readPoint(in);
+            const QPoint p2 = readPoint(in);
+            shapeTool.pen.setWidth(int(in.varint()));
+            shapeTool.pen.setColor(readColor(in));
+            if (in.ok) shapeTool.rasterizeShape(p1, p2);
+            break;
+        }
+        case Op::stamp:
+        {
+            textTool.p1       = readPoint(in);
+            textTool.p2       = readPoint(in);
+            textTool.fontSize = int(in.varint());
+            textTool.pen.setColor(readColor(in));
+            textTool.tempText = readText(in);
+            if (in.ok) textTool.drawText(false);
+            textTool.tempText.clear();
+            break;
+        }
+        case Op::fill:
+        {
+            const QPoint pos      = readPoint(in);
+            bucketTool.tolerance  = int(in.varint());
+            bucketTool.color      = readColor(in);
+            if (in.ok) bucketTool.fillAt(pos);
+            break;
+        }
+        case Op::addVector:
+        {
+            // With the id it had, extendVector and undo records further on refer to it by that
+            const VectorItem item = readItem(in);
+            if (in.ok) canvas.addVector(item);
+            break;
+        }
+        case Op::extendVector:
+        {
+            const quint32 id = quint32(in.varint());
+            const QPolygonF points = readPoints(in);
+            if (in.ok) canvas.extendVector(id, points);
+            break;
+        }
+        case Op::clear: canvas.clearImage(); break;
+        case Op::undo:
+        case Op::redo:
+        {
+            // Put back as what they changed, not through the history, which doesn't go back past a save
+            const int layer = int(in.signedVarint());
+            InkHistory::Entry change;
+            const quint64 tiles = in.varint();
+            if (!in.ok || tiles > quint64(in.end - in.at)) { in.ok = false; break; }
+            change.tiles.resize(size_t(tiles));
+            for (InkHistory::TileDelta& delta : change.tiles)
+            {
+                delta.key = in.varint();
+                const QPoint topLeft = readPoint(in);
+                const QPoint size    = readPoint(in);
+                delta.rect   = QRect(topLeft, QSize(size.x(), size.y()));
+                delta.absent = in.byte() != 0;
+                const quint64 length = in.varint();
+                if (!in.ok || length > quint64(in.end - in.at)) { in.ok = false; break; }
+                delta.pixels = QByteArray(in.at, int(length));
+                in.at += length;
+
+                const QPoint coords = TiledImage::keyToCoords(delta.key);
+                if (!TiledImage::tileRect(coords.x(), coords.y()).contains(delta.rect)) { in.ok = false; break; }
+            }
+            const quint64 vectors = in.varint();
+            if (!in.ok || vectors > quint64(in.end - in.at)) { in.ok = false; break; }
+            change.vectors.resize(size_t(vectors));
+            for (InkHistory::VectorChange& vector : change.vectors)
+            {
+                vector.present = in.byte() != 0;
+                vector.item    = readItem(in);
+            }
+            if (!in.ok) break;
+
+            // Layer ids can come out different on replay, the order of the layers doesn't
+            change.layer = layer >= 0 && layer < canvas.layers.count() ? canvas.layers.at(layer).id : 0;
+            canvas.applyInk(op, change);
+            break;
+        }
+        case Op::resize:
+        {
+            // The view this runs in can be bigger than the one the records were made in, the image never shrinks for it
+            const int width  = int(in.varint());
+            const int height = int(in.varint());
+            if (in.ok) canvas.resizeImage(canvas.layers.size().expandedTo(QSize(width, height)));
+            break;
+        }
+        case Op::image:
+        {
+            const quint64 size = in.varint();
+            if (!in.ok || size > quint64(in.end - in.at)) { in.ok = false; break; }
+            const QImage image = QImage::fromData(QByteArray::fromRawData(in.at, int(size)), "png");
+            if (!image.isNull()) canvas.setImage(image);
+            break;
+        }
+        case Op::showPage:   { const int index = int(in.signedVarint()); if (in.ok) canvas.showPage(index);   break; }
+        case Op::addPage:    canvas.addPage(); break;
+        case Op::removePage: { const int index = int(in.signedVarint()); if (in.ok) canvas.removePage(index); break; }
+        case Op::renamePage:
+        {
+            const int index = int(in.signedVarint());
+            const QString title = readText(in);
+            if (in.ok) canvas.renamePage(index, title);
+            break;
+        }
+        case Op::setPageSection:
+        {
+            const int index = int(in.signedVarint());
+            const QString section = readText(in);
+            if (in.ok) canvas.setPageSection(index, section);
+            break;
+        }
+        case Op::addLayer:       canvas.addLayer(); break;
+        case Op::removeLayer:    { const int index = int(in.signedVarint()); if (in.ok) canvas.removeLayer(index);    break; }
+        case Op::setActiveLayer: { const int index = int(in.signedVarint()); if (in.ok) canvas.setActiveLayer(index); break; }
+        case Op::moveLayer:
+        case Op::setLayerVisible:
+        case Op::setLayerOpacity:
+        case Op::setLayerBlend:
+        {
+            const int index    = int(in.signedVarint());
+            const qint64 value = in.signedVarint();
+            if (!in.ok) break;
+            if (op == Op::moveLayer)       canvas.moveLayer(index, int(value));
+            if (op == Op::setLayerVisible) canvas.setLayerVisible(index, value != 0);
+            if (op == Op::setLayerBlend)   canvas.setLayerBlend(index, QPainter::CompositionMode(value));
+            if (op == Op::setLayerOpacity)
+            {
+                qreal opacity = 1;
+                std::memcpy(&opacity, &value, sizeof(opacity));
+                canvas.setLayerOpacity(index, opacity);
+            }
+            break;
+        }
+        case Op::renameLayer:
+        {
+            const int index = int(in.signedVarint());
+            const QString name = readText(in);
+            if (in.ok) canvas.renameLayer(index, name);
+            break;
+        }
+        case Op::textEdit:
+        {
+            const int position = int(in.varint());
+            const int removed  = int(in.varint());
+            const QString text = readText(in);
+            if (!in.ok) break;
+
+            // Text edits are positions in the whole document, it has to be all in first
+            canvas.finishText();
+            QTextCursor cursor(canvas.document());
+            const int last = canvas.document()->characterCount() - 1;
+            cursor.setPosition(qBound(0, position, last));
+            cursor.setPosition(qBound(0, position + removed, last), QTextCursor::KeepAnchor);
+            cursor.insertText(text);
+            break;
+        }
+        default:
+            in.ok = false; // From a newer version, nothing after it can be trusted to line up
+            break;
+        }
+        if (!in.ok) break;
+        applied++;
+    }
+
+    // A stroke the crash cut off still ends up as an undo step
+    for (; openEdits > 0; openEdits--)
+    {
+        canvas.journal.record(Op::endEdit);
+        canvas.endEdit();
+    }
+    return applied;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <qbytearray.h>
+#include <qcolor.h>
+#include <qfile.h>
+#include <qimage.h>
+#include <qpolygon.h>
+#include <qstring.h>
+#include "InkHistory.h"
+#include "VectorScene.h"
+
+class Canvas;
+class QTextDocument;
+
+// Every edit made on the canvas, appended to a file next to the notebook as it's made, so a crash loses nothing
+// since the last save. Replaying it on top of that save brings the work back. A save that made it to disk drops
+// the records it covers.
+//
+// Raster edits are kept as what made them (a brush polyline, a shape's corners, a fill's seed), not as pixels,
+// so a record costs about as much as the input that made it. Replay goes back through the same tool code.
+// Undo and redo are the exception, they're kept as the pixels and items they put back. Replay starts from a
+// freshly loaded notebook, the history they went back through isn't there.
+//
+// File: "NBJL", version byte, then the notebook it goes on top of (path, mtime, size, an empty path for one never saved),
+// then records: varint payload length, payload, crc32 of the payload. A payload is an op byte and varints like in
+// InputTrace, positions in 1/64 px. Each record goes out in one unbuffered write, one cut short by a crash fails
+// its crc and replay stops there.
+class Journal
+{
+public:
+    enum class Op : quint8
+    {
+        beginEdit,
+        endEdit,
+        brush,
+        shape,
+        stamp,  // Text tool
+        fill,
+        addVector,
+        extendVector,
+        clear,
+        undo,
+        redo,
+        resize,
+        image,
+        showPage,
+        addPage,
+        removePage,
+        renamePage,
+        setPageSection,
+        addLayer,
+        removeLayer,
+        moveLayer,
+        setActiveLayer,
+        setLayerVisible,
+        setLayerOpacity,
+        setLayerBlend,
+        renameLayer,
+        textEdit
+    };
+
+    // What a journal on disk holds, for recovering from it
+    struct Contents
+    {
+        QString    basePath;
+        qint64     baseModified = 0;
+        qint64     baseSize = 0;
+        QByteArray records; // Only the ones that made it whole
+        int        count = 0;
+
+        bool baseMatches() const; // The notebook is still the one the records go on top of
+    };
+
+    // A canvas call that's recorded keeps the canvas calls it makes itself out while one of these is around,
+    // replaying it makes them again
+    struct Mute
+    {
+        Journal& journal;
+        Mute(Journal& journal) : journal(journal) { journal.muted++; }
+        ~Mute() { journal.muted--; }
+    };
+
+    static QString pathFor(const QString& notebookPath); // Next to the notebook, in app data for one never saved
+    static QString lastSession();                        // The journal in use when the app last ran, if it didn't close
+    static bool read(const QString& journalPath, Contents& out);
+
+    // Applies records to canvas through the same calls that made them, which records them into its journal again.
+    // Returns how many were applied.
+    static int replay(const QByteArray& records, Canvas& canvas);
+
+    // Starts over on top of the notebook at basePath as it is on disk now
+    bool start(const QString& basePath);
+
+    // A save of everything up to checkpoint (a position()) made it to basePath, only what came after stays
+    bool rebase(const QString& basePath, qint64 checkpoint);
+
+    void close(bool remove); // Removes the file too on a clean exit, there's nothing left to recover
+    bool    inline isOpen()   const { return file.isOpen(); }
+    qint64  inline position() const { return dropped + written; } // Keeps counting up across rebases
+    QString inline fileName() const { return file.fileName(); }
+
+    // Records, none of them do anything while the journal is closed or muted
+    void record(Op op); // Ops without arguments
+    void index(Op op, int index);
+    void indexValue(Op op, int index, qint64 value);
+    void indexText(Op op, int index, const QString& text);
+    void brush(const QPolygonF& polyline, int width, const QColor& color, bool erase);
+    void shape(int shape, const QPoint& p1, const QPoint& p2, int width, const QColor& color);
+    void stamp(const QPoint& p1, const QPoint& p2, const QString& text, int fontSize, const QColor& color);
+    void fill(const QPoint& pos, int tolerance, const QColor& color);
+    void addVector(const VectorItem& item); // Once it has its id
+    void extendVector(quint32 id, const QPolygonF& points);
+    void inkChange(Op op, int layer, const InkHistory::Entry& change); // Undo or redo, change is what it put back on the layer at that index
+    void resize(const QSize& size);
+    void image(const QImage& image);
+    void textEdit(QTextDocument* document, int position, int removed, int added); // From contentsChange
+
+private:
+    QFile  file;
+    qint64 headerSize = 0;
+    qint64 written = 0; // Record bytes after the header
+    qint64 dropped = 0; // Record bytes rebases took out since the last start
+    int    muted = 0;
+
+    bool inline recording() const { return muted == 0 && file.isOpen(); }
+    void append(const QByteArray& payload);
+};
@@ -0,0 +1,99 @@
+#include "LayerPanel.h"
+
+#include "Canvas.h"
+#include <qlabel.h>
+
+LayerPanel::LayerPanel(QWidget* parent, Canvas* canvas) : QWidget(parent)
+{
+    this->canvas = canvas;
+
+    setLayout(mainLayout);
+    mainLayout->addWidget(list);
+
+    QHBoxLayout* opacityLayout = new QHBoxLayout();
+    opacityLayout->addWidget(new QLabel("Opacity"));
+    opacityLayout->addWidget(opacitySlider);
+    mainLayout->addLayout(opacityLayout);
+    mainLayout->addWidget(blendBox);
+    mainLayout->addLayout(buttonLayout);
+
+    buttonLayout->addWidget(addButton);
+    buttonLayout->addWidget(removeButton);
+    buttonLayout->addWidget(upButton);
+    buttonLayout->addWidget(downButton);
+
+    opacitySlider->setRange(0, 100);
+    for (QPainter::CompositionMode mode : Layer::blendModes())
+    {
+        const QString name = Layer::blendName(mode);
+        blendBox->addItem(name.left(1).toUpper() + name.mid(1), int(mode));
+    }
+
+    connect(list, &QListWidget::currentRowChanged, this, [this](int row)
+        { if (!refreshing && row >= 0) this->canvas->setActiveLayer(layerAt(row)); });
+    connect(list, &QListWidget::itemChanged, this, &LayerPanel::onItemChanged);
+    connect(opacitySlider, &QSlider::valueChanged, this, [this](int value)
+        { if (!refreshing) this->canvas->setLayerOpacity(this->canvas->layers.activeIndex(), value / 100.0); });
+    connect(blendBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, [this](int index)
+        {
+            if (refreshing || index < 0) return;
+            this->canvas->setLayerBlend(this->canvas->layers.activeIndex(), QPainter::CompositionMode(blendBox->itemData(index).toInt()));
+        });
+
+    connect(addButton,    &QPushButton::clicked, canvas, &Canvas::addLayer);
+    connect(removeButton, &QPushButton::clicked, this, [this]() { this->canvas->removeLayer(this->canvas->layers.activeIndex()); });
+    connect(upButton,     &QPushButton::clicked, this, [this]()
+        {
+            const int index = this->canvas->layers.activeIndex();
+            if (index + 1 < this->canvas->layers.count()) this->canvas->moveLayer(index, index + 1);
+        });
+    connect(downButton,   &QPushButton::clicked, this, [this]()
+        {
+            const int index = this->canvas->layers.activeIndex();
+            if (index > 0) this->canvas->moveLayer(index, index - 1);
+        });
+
+    // Queued, the list can't be rebuilt from inside one of its own item signals
+    connect(canvas, &Canvas::layersChanged, this, &LayerPanel::refresh, Qt::QueuedConnection);
+    refresh();
+}
+
+int LayerPanel::layerAt(int row) const { return canvas->layers.count() - 1 - row; }
+int LayerPanel::rowOf(int layer)  const { return canvas->layers.count() - 1 - layer; }
+
+void LayerPanel::refresh()
+{
+    refreshing = true;
+
+    const LayerStack& layers = canvas->layers;
+    list->clear();
+    for (int row = 0; row < layers.count(); row++)
+    {
+        const Layer& layer = layers.at(layerAt(row));
+        QListWidgetItem* item = new QListWidgetItem(layer.name);
+        item->setFlags(item->flags() | Qt::ItemIsUserCheckable | Qt::ItemIsEditable);
+        item->setCheckState(layer.visible ? Qt::Checked : Qt::Unchecked);
+        list->addItem(item);
+    }
+    list->setCurrentRow(rowOf(layers.activeIndex()));
+
+    const Layer& active = layers.at(layers.activeIndex());
+    opacitySlider->setValue(qRound(active.opacity * 100));
+    blendBox->setCurrentIndex(blendBox->findData(int(active.blend)));
+    removeButton->setEnabled(layers.count() > 1);
+    upButton->setEnabled(layers.activeIndex() + 1 < layers.count());
+    downButton->setEnabled(layers.activeIndex() > 0);
+
+    refreshing = false;
+}
+
+void LayerPanel::onItemChanged(QListWidgetItem* item)
+{
+    if (refreshing) return;
+
+    const int index = layerAt(list->row(item));
+    const Layer& layer = canvas->layers.at(index);
+    const bool visible = item->checkState() == Qt::Checked;
+    if (visible != layer.visible) canvas->setLayerVisible(index, visible);
+    else if (item->text() != layer.name) canvas->renameLayer(index, item->text());
+}
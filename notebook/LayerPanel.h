@@ -0,0 +1,40 @@
+#pragma once
+
+#include <qwidget.h>
+#include <qlistwidget.h>
+#include <qpushbutton.h>
+#include <qslider.h>
+#include <qcombobox.h>
+#include <qlayout.h>
+
+class Canvas;
+
+// List of the canvas layers, top layer first like every paint program shows them.
+// Checkbox is visibility, double click renames, the selected row is the one being drawn on.
+class LayerPanel : public QWidget
+{
+    Q_OBJECT
+
+public:
+    Canvas* canvas = nullptr;
+
+    QVBoxLayout* mainLayout    = new QVBoxLayout();
+    QHBoxLayout* buttonLayout  = new QHBoxLayout();
+    QListWidget* list          = new QListWidget();
+    QSlider*     opacitySlider = new QSlider(Qt::Horizontal);
+    QComboBox*   blendBox      = new QComboBox();
+    QPushButton* addButton     = new QPushButton("+");
+    QPushButton* removeButton  = new QPushButton("-");
+    QPushButton* upButton      = new QPushButton("Up");
+    QPushButton* downButton    = new QPushButton("Down");
+
+    LayerPanel(QWidget* parent, Canvas* canvas);
+    void refresh(); // Rebuilds the list from the canvas
+
+private:
+    bool refreshing = false; // Changes made by refresh aren't user edits
+
+    int layerAt(int row) const;
+    int rowOf(int layer) const;
+    void onItemChanged(QListWidgetItem* item);
+};
@@ -0,0 +1,333 @@
+#include "LayerStack.h"
+
+static const std::vector<std::pair<QPainter::CompositionMode, QString>>& blendTable()
+{
+    static const std::vector<std::pair<QPainter::CompositionMode, QString>> table =
+    {
+        { QPainter::CompositionMode_SourceOver, "normal"     },
+        { QPainter::CompositionMode_Multiply,   "multiply"   },
+        { QPainter::CompositionMode_Screen,     "screen"     },
+        { QPainter::CompositionMode_Overlay,    "overlay"    },
+        { QPainter::CompositionMode_Darken,     "darken"     },
+        { QPainter::CompositionMode_Lighten,    "lighten"    },
+        { QPainter::CompositionMode_Difference, "difference" },
+    };
+    return table;
+}
+
+QString Layer::blendName(QPainter::CompositionMode mode)
+{
+    for (const auto& entry : blendTable()) if (entry.first == mode) return entry.second;
+    return "normal";
+}
+
+QPainter::CompositionMode Layer::blendFromName(const QString& name)
+{
+    for (const auto& entry : blendTable()) if (entry.second == name) return entry.first;
+    return QPainter::CompositionMode_SourceOver;
+}
+
+const std::vector<QPainter::CompositionMode>& Layer::blendModes()
+{
+    static std::vector<QPainter::CompositionMode> modes;
+    if (modes.empty()) for (const auto& entry : blendTable()) modes.push_back(entry.first);
+    return modes;
+}
+
+// Blends src over out. A plain layer on nothing is just shared, no pixels get touched.
+static void blendTile(QImage& out, const QImage& src, qreal opacity, QPainter::CompositionMode mode)
+{
+    if (out.isNull())
+    {
+        if (opacity >= 1 && mode == QPainter::CompositionMode_SourceOver) { out = src; return; }
+        out = QImage(TiledImage::tileSize, TiledImage::tileSize, TiledImage::format);
+        out.fill(Qt::transparent);
+    }
+    QPainter painter(&out);
+    painter.setOpacity(opacity);
+    painter.setCompositionMode(mode);
+    painter.drawImage(0, 0, src);
+}
+
+static void setTile(TiledImage& image, int tx, int ty, const QImage& tile)
+{
+    if (tile.isNull()) image.removeTile(tx, ty);
+    else image.insertTile(tx, ty, tile);
+}
+
+LayerStack::LayerStack()
+{
+    Layer ink;
+    ink.name = "Ink";
+    std::vector<Layer> initial;
+    initial.push_back(ink);
+    reset(std::move(initial), 0);
+}
+
+int LayerStack::indexOf(quint32 id) const
+{
+    for (int i = 0; i < count(); i++) if (layers[i].id == id) return i;
+    return -1;
+}
+
+void LayerStack::resize(const QSize& newSize)
+{
+    extent = newSize;
+    for (Layer& layer : layers) layer.image.resize(newSize);
+    flattened.resize(newSize);
+    below.resize(newSize);
+    above.resize(newSize);
+}
+
+void LayerStack::reset(std::vector<Layer> newLayers, int newActive)
+{
+    if (newLayers.empty()) newLayers.emplace_back();
+
+    for (const Layer& layer : newLayers) nextId = qMax(nextId, layer.id + 1);
+    extent = QSize(0, 0);
+    for (Layer& layer : newLayers)
+    {
+        if (layer.id == 0) layer.id = nextId++;
+        extent = extent.expandedTo(layer.image.size());
+    }
+
+    layers = std::move(newLayers);
+    active = qBound(0, newActive, count() - 1);
+    flattened.clear();
+    below.clear();
+    above.clear();
+    resize(extent);
+    invalidateAll();
+}
+
+int LayerStack::add(const QString& name, int index)
+{
+    index = qBound(0, index, count());
+
+    Layer layer;
+    layer.id   = nextId++;
+    layer.name = name;
+    layer.image.resize(extent);
+    layers.insert(layers.begin() + index, std::move(layer));
+    if (index <= active && count() > 1) active++;
+
+    // An empty layer doesn't change the picture, only which group is under or over the active one
+    setActive(active);
+    return index;
+}
+
+void LayerStack::remove(int index)
+{
+    if (count() <= 1 || index < 0 || index >= count()) return;
+
+    setVisible(index, false); // Marks everything it covered
+    layers.erase(layers.begin() + index);
+    if (index < active || active >= count()) active = qMax(0, active - 1);
+    setActive(active);
+}
+
+void LayerStack::move(int from, int to)
+{
+    if (from == to || from < 0 || to < 0 || from >= count() || to >= count()) return;
+
+    const quint32 activeId = layers[active].id;
+    Layer layer = std::move(layers[from]);
+    layers.erase(layers.begin() + from);
+    layers.insert(layers.begin() + to, std::move(layer));
+    active = indexOf(activeId);
+
+    // Only tiles the moved layer has content in can come out different
+    markDirty(dirty, covered(to));
+    setActive(active);
+}
+
+void LayerStack::setActive(int index)
+{
+    active = qBound(0, index, count() - 1);
+
+    // Same picture, the groups around the active layer just split up differently
+    QSet<quint64> keys;
+    for (const Layer& layer : layers)
+    {
+        for (auto it = layer.image.tileVersions().constBegin(); it != layer.image.tileVersions().constEnd(); ++it) keys.insert(it.key());
+        for (quint64 key : layer.image.pendingTiles()) keys.insert(key);
+    }
+    below.clear();
+    above.clear();
+    below.resize(extent);
+    above.resize(extent);
+    belowDirty = keys;
+    aboveDirty = keys;
+}
+
+void LayerStack::setVisible(int index, bool visible)
+{
+    if (layers[index].visible == visible) return;
+    layers[index].visible = visible;
+    changed(index, covered(index));
+}
+
+void LayerStack::setOpacity(int index, qreal opacity)
+{
+    layers[index].opacity = qBound<qreal>(0, opacity, 1);
+    if (layers[index].visible) changed(index, covered(index));
+}
+
+void LayerStack::setBlend(int index, QPainter::CompositionMode mode)
+{
+    layers[index].blend = mode;
+    if (layers[index].visible) changed(index, covered(index));
+}
+
+void LayerStack::changed(int index, const QRegion& region)
+{
+    markDirty(dirty, region);
+    if (index < active) markDirty(belowDirty, region);
+    if (index > active) markDirty(aboveDirty, region);
+}
+
+void LayerStack::markDirty(QSet<quint64>& set, const QRegion& region)
+{
+    for (const QRect& rect : region)
+    {
+        const QRect range = TiledImage::tileRange(rect);
+        for (int ty = range.top(); ty <= range.bottom(); ty++)
+        {
+            for (int tx = range.left(); tx <= range.right(); tx++) set.insert(TiledImage::key(tx, ty));
+        }
+    }
+}
+
+void LayerStack::invalidateAll()
+{
+    dirty.clear();
+    for (const Layer& layer : layers)
+    {
+        for (auto it = layer.image.tileVersions().constBegin(); it != layer.image.tileVersions().constEnd(); ++it) dirty.insert(it.key());
+        for (quint64 key : layer.image.pendingTiles()) dirty.insert(key);
+    }
+    for (auto it = flattened.tileVersions().constBegin(); it != flattened.tileVersions().constEnd(); ++it) dirty.insert(it.key());
+    setActive(active);
+}
+
+qint64 LayerStack::layerMemoryUsage() const
+{
+    qint64 total = 0;
+    for (const Layer& layer : layers) total += layer.image.memoryUsage();
+    return total;
+}
+
+QRegion LayerStack::covered(int index) const
+{
+    const TiledImage& image = layers[index].image;
+    QRegion region;
+    for (auto it = image.tileVersions().constBegin(); it != image.tileVersions().constEnd(); ++it)
+    {
+        const QPoint coords = TiledImage::keyToCoords(it.key());
+        region += TiledImage::tileRect(coords.x(), coords.y());
+    }
+    return region;
+}
+
+bool LayerStack::aboveIsFlat() const
+{
+    // Blend modes other than normal depend on what's under them, so those layers can't be flattened on their own
+    for (int i = active + 1; i < count(); i++)
+    {
+        if (layers[i].visible && layers[i].blend != QPainter::CompositionMode_SourceOver) return false;
+    }
+    return true;
+}
+
+QImage LayerStack::flatten(int from, int to, int tx, int ty) const
+{
+    QImage out;
+    for (int i = from; i < to; i++)
+    {
+        const Layer& layer = layers[i];
+        if (!layer.visible || layer.opacity <= 0) continue;
+        const QImage* t = layer.image.tile(tx, ty);
+        if (t != nullptr) blendTile(out, *t, layer.opacity, layer.blend);
+    }
+    return out;
+}
+
+void LayerStack::recomposite(int tx, int ty)
+{
+    const quint64 key = TiledImage::key(tx, ty);
+    if (!aboveIsFlat()) { setTile(flattened, tx, ty, flatten(0, count(), tx, ty)); return; }
+
+    if (belowDirty.remove(key)) setTile(below, tx, ty, flatten(0, active, tx, ty));
+    if (aboveDirty.remove(key)) setTile(above, tx, ty, flatten(active + 1, count(), tx, ty));
+
+    QImage out;
+    if (const QImage* t = below.tile(tx, ty)) out = *t;
+    const Layer& current = layers[active];
+    if (current.visible && current.opacity > 0)
+    {
+        if (const QImage* t = current.image.tile(tx, ty)) blendTile(out, *t, current.opacity, current.blend);
+    }
+    if (const QImage* t = above.tile(tx, ty)) blendTile(out, *t, 1, QPainter::CompositionMode_SourceOver);
+    setTile(flattened, tx, ty, out);
+}
+
+const TiledImage& LayerStack::composite(const QRect& rect, bool decodePending)
+{
+    const QRect clipped = rect.intersected(QRect(QPoint(0, 0), extent));
+    if (clipped.isEmpty()) return flattened;
+    const QRect range = TiledImage::tileRange(clipped);
+
+    if (decodePending)
+    {
+        for (int i = 0; i < count(); i++)
+        {
+            const QSet<quint64> pending = layers[i].image.pendingTiles();
+            for (quint64 key : pending)
+            {
+                const QPoint coords = TiledImage::keyToCoords(key);
+                if (!range.contains(coords)) continue;
+                layers[i].image.loadPending(coords.x(), coords.y());
+                changed(i, TiledImage::tileRect(coords.x(), coords.y()));
+            }
+        }
+    }
+    if (dirty.isEmpty()) return flattened;
+
+    // Zoomed out views cover lots of tiles, walk whichever is smaller
+    std::vector<quint64> todo;
+    if (qint64(dirty.size()) < qint64(range.width()) * range.height())
+    {
+        for (quint64 key : dirty) if (range.contains(TiledImage::keyToCoords(key))) todo.push_back(key);
+    }
+    else
+    {
+        for (int ty = range.top(); ty <= range.bottom(); ty++)
+        {
+            for (int tx = range.left(); tx <= range.right(); tx++)
+            {
+                if (dirty.contains(TiledImage::key(tx, ty))) todo.push_back(TiledImage::key(tx, ty));
+            }
+        }
+    }
+
+    for (quint64 key : todo)
+    {
+        dirty.remove(key);
+        const QPoint coords = TiledImage::keyToCoords(key);
+        recomposite(coords.x(), coords.y());
+    }
+    return flattened;
+}
+
+const QImage* LayerStack::compositeTile(int tx, int ty)
+{
+    const quint64 key = TiledImage::key(tx, ty);
+    for (int i = 0; i < count(); i++)
+    {
+        if (!layers[i].image.isPending(key)) continue;
+        layers[i].image.loadPending(tx, ty);
+        changed(i, TiledImage::tileRect(tx, ty));
+    }
+    if (dirty.remove(key)) recomposite(tx, ty);
+    return flattened.tile(tx, ty);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <qpainter.h>
+#include <qregion.h>
+#include <qset.h>
+#include <qstring.h>
+#include <vector>
+#include "TiledImage.h"
+
+struct Layer
+{
+    quint32    id = 0; // Stable for the layer's lifetime, names its tiles in the file
+    QString    name;
+    TiledImage image;
+    bool       visible = true;
+    qreal      opacity = 1;
+    QPainter::CompositionMode blend = QPainter::CompositionMode_SourceOver;
+
+    static QString blendName(QPainter::CompositionMode mode);
+    static QPainter::CompositionMode blendFromName(const QString& name);
+    static const std::vector<QPainter::CompositionMode>& blendModes(); // The ones the UI and file format know about
+};
+
+// Raster layers, bottom first, with one of them being drawn on.
+// The flattened result is cached per tile and only recomposited where something changed.
+// The layers under and over the active one are kept flattened too, so redoing a tile
+// while drawing costs three blends no matter how many layers there are.
+class LayerStack
+{
+public:
+    LayerStack();
+
+    int    inline count()       const { return int(layers.size()); }
+    int    inline activeIndex() const { return active; }
+    Layer&       at(int index)       { return layers[index]; }
+    const Layer& at(int index) const { return layers[index]; }
+    Layer&       activeLayer()       { return layers[active]; }
+    const std::vector<Layer>& all() const { return layers; }
+    int indexOf(quint32 id) const; // -1 if it's gone
+
+    QSize inline size() const { return extent; }
+    void resize(const QSize& newSize);
+
+    // Replaces everything, like loading a file. Layers without ids get new ones.
+    void reset(std::vector<Layer> newLayers, int newActive);
+    int  add(const QString& name, int index); // Returns where it went
+    void remove(int index);
+    void move(int from, int to);
+    void setActive(int index);
+    void setVisible(int index, bool visible);
+    void setOpacity(int index, qreal opacity);
+    void setBlend(int index, QPainter::CompositionMode mode);
+
+    // Pixels of a layer changed in region, image coords
+    void changed(int index, const QRegion& region);
+
+    // The flattened layers, brought up to date inside rect first.
+    // Pending tiles are left out unless decodePending is set, then they're decoded on this thread.
+    const TiledImage& composite(const QRect& rect, bool decodePending = false);
+
+    // One tile of that, with whatever is pending under it decoded first. nullptr where nothing is.
+    // Good until the composite changes again.
+    const QImage* compositeTile(int tx, int ty);
+
+    // Bytes held by layer tiles, and by the cached groups and composite on top of that.
+    // Tiles shared between them (an untouched composite tile is the layer's) count once per holder.
+    qint64 layerMemoryUsage() const;
+    qint64 cacheMemoryUsage() const { return flattened.memoryUsage() + below.memoryUsage() + above.memoryUsage(); }
+
+private:
+    std::vector<Layer> layers;
+    int     active = 0;
+    quint32 nextId = 1;
+    QSize   extent;
+
+    TiledImage    flattened;
+    TiledImage    below;  // Visible layers under the active one
+    TiledImage    above;  // Visible layers over it, only usable while they all blend normally
+    QSet<quint64> dirty;
+    QSet<quint64> belowDirty;
+    QSet<quint64> aboveDirty;
+
+    bool aboveIsFlat() const;
+    QRegion covered(int index) const; // Every tile the layer has, pending or not
+    void markDirty(QSet<quint64>& set, const QRegion& region);
+    void invalidateAll();
+    QImage flatten(int from, int to, int tx, int ty) const; // Layers [from, to) for one tile
+    void recomposite(int tx, int ty);
+};
@@ -0,0 +1,159 @@
+#include "MappedArchive.h"
+#include <qfileinfo.h>
+#include <zlib.h>
+#include <climits>
+
+static inline quint16 read16(const uchar* p) { return quint16(p[0] | (p[1] << 8)); }
+static inline quint32 read32(const uchar* p) { return quint32(read16(p)) | (quint32(read16(p + 2)) << 16); }
+static inline quint64 read64(const uchar* p) { return quint64(read32(p)) | (quint64(read32(p + 4)) << 32); }
+
+std::shared_ptr<MappedArchive> MappedArchive::open(const QString& filePath)
+{
+    std::shared_ptr<MappedArchive> archive(new MappedArchive());
+    archive->path = QFileInfo(filePath).absoluteFilePath();
+    if (!archive->map()) return nullptr;
+    return archive;
+}
+
+bool MappedArchive::map()
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    length = file.size();
+    base   = file.map(0, length);
+    if (base != nullptr && parseCentralDirectory()) return true;
+    unmap();
+    return false;
+}
+
+void MappedArchive::unmap()
+{
+    if (base != nullptr) file.unmap(const_cast<uchar*>(base));
+    file.close();
+    base   = nullptr;
+    length = 0;
+    entries.clear();
+}
+
+bool MappedArchive::remap(const std::function<bool()>& replace)
+{
+    QWriteLocker locker(&lock);
+    unmap();
+    const bool replaced = replace();
+    return map() && replaced;
+}
+
+bool MappedArchive::parseCentralDirectory()
+{
+    // The end of central directory record sits at the very end, before an optional comment of up to 64k
+    const qint64 eocdSize = 22;
+    if (length < eocdSize) return false;
+
+    qint64 eocd = -1;
+    const qint64 searchEnd = qMax<qint64>(0, length - eocdSize - 0xFFFF);
+    for (qint64 pos = length - eocdSize; pos >= searchEnd; pos--)
+    {
+        if (read32(base + pos) == 0x06054b50) { eocd = pos; break; }
+    }
+    if (eocd < 0) return false;
+
+    quint64 count    = read16(base + eocd + 10);
+    quint64 cdOffset = read32(base + eocd + 16);
+
+    // Zip64 puts the real values in its own record, found through a locator right before the eocd
+    if ((count == 0xFFFF || cdOffset == 0xFFFFFFFF) && eocd >= 20 && read32(base + eocd - 20) == 0x07064b50)
+    {
+        const quint64 zip64Eocd = read64(base + eocd - 20 + 8);
+        if (zip64Eocd + 56 > quint64(length) || read32(base + zip64Eocd) != 0x06064b50) return false;
+        count    = read64(base + zip64Eocd + 32);
+        cdOffset = read64(base + zip64Eocd + 48);
+    }
+
+    quint64 pos = cdOffset;
+    for (quint64 i = 0; i < count; i++)
+    {
+        if (pos + 46 > quint64(length) || read32(base + pos) != 0x02014b50) return false;
+        const uchar* cd = base + pos;
+
+        const quint16 flags      = read16(cd + 8);
+        const quint16 nameLen    = read16(cd + 28);
+        const quint16 extraLen   = read16(cd + 30);
+        const quint16 commentLen = read16(cd + 32);
+        if (pos + 46 + nameLen + extraLen > quint64(length)) return false;
+
+        quint64 compressedSize = read32(cd + 20);
+        quint64 size           = read32(cd + 24);
+        quint64 localOffset    = read32(cd + 42);
+
+        // Zip64 extra field, only has the values that overflowed, in this order
+        const uchar* extra = cd + 46 + nameLen;
+        for (int e = 0; e + 4 <= extraLen; )
+        {
+            const quint16 id = read16(extra + e), len = read16(extra + e + 2);
+            if (id == 0x0001)
+            {
+                int field = e + 4;
+                if (size           == 0xFFFFFFFF && field + 8 <= e + 4 + len) { size           = read64(extra + field); field += 8; }
+                if (compressedSize == 0xFFFFFFFF && field + 8 <= e + 4 + len) { compressedSize = read64(extra + field); field += 8; }
+                if (localOffset    == 0xFFFFFFFF && field + 8 <= e + 4 + len) { localOffset    = read64(extra + field); field += 8; }
+            }
+            e += 4 + len;
+        }
+
+        const char* rawName = reinterpret_cast<const char*>(cd + 46);
+        const QString name = (flags & 0x0800) ? QString::fromUtf8(rawName, nameLen) : QString::fromLatin1(rawName, nameLen);
+        pos += 46 + nameLen + extraLen + commentLen;
+
+        // Encrypted entries aren't something we write, skip them
+        if (flags & 0x0001) continue;
+
+        if (localOffset + 30 > quint64(length) || read32(base + localOffset) != 0x04034b50) return false;
+        const quint64 dataOffset = localOffset + 30 + read16(base + localOffset + 26) + read16(base + localOffset + 28);
+        if (dataOffset + compressedSize > quint64(length)) return false;
+
+        Entry entry;
+        entry.dataOffset     = qint64(dataOffset);
+        entry.compressedSize = qint64(compressedSize);
+        entry.size           = qint64(size);
+        entry.crc            = read32(cd + 16);
+        entry.method         = read16(cd + 10);
+        entries.insert(name, entry);
+    }
+    return true;
+}
+
+QByteArray MappedArchive::readRaw(const QString& name, Entry* info) const
+{
+    QReadLocker locker(&lock);
+    auto it = entries.constFind(name);
+    if (it == entries.constEnd() || it->compressedSize > INT_MAX) return QByteArray();
+    if (info != nullptr) *info = it.value();
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(base + it->dataOffset), int(it->compressedSize));
+}
+
+QByteArray MappedArchive::read(const QString& name) const
+{
+    // Held for the copy or inflate, the view it reads from is only good until a remap
+    QReadLocker locker(&lock);
+    auto it = entries.constFind(name);
+    if (it == entries.constEnd() || it->compressedSize > INT_MAX || it->size > INT_MAX) return QByteArray();
+    const Entry entry = it.value();
+    const QByteArray raw = QByteArray::fromRawData(reinterpret_cast<const char*>(base + entry.dataOffset), int(entry.compressedSize));
+    if (entry.method == 0) return QByteArray(raw.constData(), raw.size());
+    if (entry.method != Z_DEFLATED) return QByteArray();
+
+    QByteArray out(int(entry.size), Qt::Uninitialized);
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) return QByteArray();
+
+    stream.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(raw.constData()));
+    stream.avail_in  = uInt(raw.size());
+    stream.next_out  = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = uInt(out.size());
+    const int result = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END) return QByteArray();
+    return out;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <qfile.h>
+#include <qhash.h>
+#include <qreadwritelock.h>
+#include <qstring.h>
+#include <functional>
+#include <memory>
+
+// Read only view of a zip file that's memory mapped instead of read in.
+// Only the central directory gets parsed on open, entries are looked at when asked for.
+// Any number of threads can read from it at once. remap swaps the file under them, reads just wait for it.
+class MappedArchive
+{
+public:
+    struct Entry
+    {
+        qint64  dataOffset     = 0;
+        qint64  compressedSize = 0;
+        qint64  size           = 0;
+        quint32 crc            = 0;
+        int     method         = 0; // 0 = stored, 8 = deflated
+    };
+
+    static std::shared_ptr<MappedArchive> open(const QString& filePath);
+
+    // Lets go of the file, runs replace (a commit over it, say) and maps whatever is at the path after.
+    // False if replace failed or the file can't be mapped again, entries are empty then.
+    bool remap(const std::function<bool()>& replace);
+
+    MappedArchive(const MappedArchive&) = delete;
+    MappedArchive& operator=(const MappedArchive&) = delete;
+
+    QString inline filePath() const { return path; }
+    bool    inline contains(const QString& name) const { QReadLocker locker(&lock); return entries.contains(name); }
+    QHash<QString, Entry> allEntries() const { QReadLocker locker(&lock); return entries; }
+
+    // Decompressed contents, a copy of its own even for stored entries, so a remap can't pull it out from under anyone
+    QByteArray read(const QString& name) const;
+
+    // Compressed bytes as they are in the file, for copying entries into another zip.
+    // This one does point into the mapping, it's only good until the next remap.
+    QByteArray readRaw(const QString& name, Entry* info = nullptr) const;
+
+private:
+    MappedArchive() = default;
+
+    QString     path;
+    QFile       file;
+    const uchar* base = nullptr;
+    qint64      length = 0;
+    QHash<QString, Entry> entries;
+    mutable QReadWriteLock lock; // Written only by remap
+
+    bool map();
+    void unmap();
+    bool parseCentralDirectory();
+};
@@ -0,0 +1,132 @@
+#include "MipPyramid.h"
+#include <qmath.h>
+
+static inline int floorDiv(int a, int b) { return (a >= 0) ? a / b : -((-a + b - 1) / b); }
+
+// 2x2 box filter of a whole tile into one quadrant of dst. Premultiplied, so a plain average is right.
+static void downsample(const QImage& src, QImage& dst, int dx, int dy)
+{
+    const quint32 mask = 0x00ff00ff;
+    const int half = TiledImage::tileSize / 2;
+    for (int y = 0; y < half; y++)
+    {
+        const quint32* r0 = reinterpret_cast<const quint32*>(src.constScanLine(2 * y));
+        const quint32* r1 = reinterpret_cast<const quint32*>(src.constScanLine(2 * y + 1));
+        quint32* out = reinterpret_cast<quint32*>(dst.scanLine(dy + y)) + dx;
+        for (int x = 0; x < half; x++)
+        {
+            const quint32 a = r0[2 * x], b = r0[2 * x + 1], c = r1[2 * x], d = r1[2 * x + 1];
+            const quint32 lo = (((a & mask) + (b & mask) + (c & mask) + (d & mask) + 0x00020002) >> 2) & mask;
+            const quint32 hi = ((((a >> 8) & mask) + ((b >> 8) & mask) + ((c >> 8) & mask) + ((d >> 8) & mask) + 0x00020002) >> 2) & mask;
+            out[x] = lo | (hi << 8);
+        }
+    }
+}
+
+int MipPyramid::levelFor(qreal zoom)
+{
+    if (zoom >= 1) return 0;
+    return qBound(0, qFloor(std::log2(1 / zoom)), maxLevel);
+}
+
+QRect MipPyramid::coverage(const QRect& rect, int level)
+{
+    if (level == 0 || rect.isEmpty()) return rect;
+    const int span = TiledImage::tileSize << level;
+    return QRect(QPoint(floorDiv(rect.left(), span) * span, floorDiv(rect.top(), span) * span),
+                 QPoint((floorDiv(rect.right(), span) + 1) * span - 1, (floorDiv(rect.bottom(), span) + 1) * span - 1));
+}
+
+QImage MipPyramid::tileAt(const TiledImage& image, int level, int tx, int ty, bool& complete)
+{
+    if (level == 0)
+    {
+        if (image.isPending(TiledImage::key(tx, ty))) { complete = false; return QImage(); }
+        const QImage* t = image.tile(tx, ty);
+        return t ? *t : QImage();
+    }
+
+    QHash<quint64, QImage>& cache = levels[level - 1];
+    auto it = cache.constFind(TiledImage::key(tx, ty));
+    if (it != cache.constEnd()) return it.value();
+
+    const int size = TiledImage::tileSize;
+    QImage built;
+    bool childrenComplete = true;
+    for (int cy = 0; cy < 2; cy++)
+    {
+        for (int cx = 0; cx < 2; cx++)
+        {
+            const QImage child = tileAt(image, level - 1, tx * 2 + cx, ty * 2 + cy, childrenComplete);
+            if (child.isNull()) continue;
+            if (built.isNull())
+            {
+                built = QImage(size, size, TiledImage::format);
+                built.fill(Qt::transparent);
+            }
+            downsample(child.size() == QSize(size, size) ? child : child.copy(0, 0, size, size), built, cx * size / 2, cy * size / 2);
+        }
+    }
+
+    // Tiles with children still being decoded get built again next time instead of being kept
+    if (childrenComplete) cache.insert(TiledImage::key(tx, ty), built);
+    else complete = false;
+    return built;
+}
+
+void MipPyramid::draw(QPainter& painter, const TiledImage& image, int level, const QRect& rect)
+{
+    if (level == 0) { image.draw(painter, rect); return; }
+    if (rect.isEmpty()) return;
+
+    const int span = TiledImage::tileSize << level;
+    const QRect range(QPoint(floorDiv(rect.left(), span), floorDiv(rect.top(), span)),
+                      QPoint(floorDiv(rect.right(), span), floorDiv(rect.bottom(), span)));
+
+    painter.save();
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    for (int ty = range.top(); ty <= range.bottom(); ty++)
+    {
+        for (int tx = range.left(); tx <= range.right(); tx++)
+        {
+            bool complete = true;
+            const QImage t = tileAt(image, level, tx, ty, complete);
+            if (!t.isNull()) painter.drawImage(QRect(tx * span, ty * span, span, span), t);
+        }
+    }
+    painter.restore();
+}
+
+void MipPyramid::invalidate(const QRect& rect)
+{
+    if (rect.isEmpty()) return;
+    for (int level = 1; level <= maxLevel; level++)
+    {
+        QHash<quint64, QImage>& cache = levels[level - 1];
+        if (cache.isEmpty()) continue;
+
+        const int span = TiledImage::tileSize << level;
+        for (int ty = floorDiv(rect.top(), span); ty <= floorDiv(rect.bottom(), span); ty++)
+        {
+            for (int tx = floorDiv(rect.left(), span); tx <= floorDiv(rect.right(), span); tx++)
+            {
+                cache.remove(TiledImage::key(tx, ty));
+            }
+        }
+    }
+}
+
+void MipPyramid::clear()
+{
+    for (QHash<quint64, QImage>& cache : levels) cache.clear();
+}
+
+qint64 MipPyramid::memoryUsage() const
+{
+    qint64 total = 0;
+    for (const QHash<quint64, QImage>& cache : levels)
+    {
+        for (const QImage& t : cache) total += t.sizeInBytes();
+    }
+    return total;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <qhash.h>
+#include <qimage.h>
+#include <qpainter.h>
+#include <qregion.h>
+#include <array>
+#include "TiledImage.h"
+
+// Half size copies of a TiledImage, for drawing it zoomed out without scaling every pixel each frame.
+// Level n has tiles of the usual size that each cover tileSize << n of the image.
+// They're built from level n - 1 the first time they're drawn, and dropped when anything under them changes,
+// so an edit only costs rebuilding the few tiles above it.
+class MipPyramid
+{
+public:
+    static constexpr int maxLevel = 6; // 1/64, zooming out further just scales this one down
+
+    static int levelFor(qreal zoom); // Smallest level that still has a pixel for every screen pixel
+    static QRect coverage(const QRect& rect, int level); // Image area the level's tiles over rect are built from
+
+    // rect is in image coords, painter too (any scale on top is fine)
+    void draw(QPainter& painter, const TiledImage& image, int level, const QRect& rect);
+
+    void invalidate(const QRect& rect);
+    void invalidate(const QRegion& region) { for (const QRect& rect : region) invalidate(rect); }
+    void clear();
+    qint64 memoryUsage() const;
+
+private:
+    // levels[n - 1] is level n. A null image means the tile is known to be empty.
+    std::array<QHash<quint64, QImage>, maxLevel> levels;
+
+    QImage tileAt(const TiledImage& image, int level, int tx, int ty, bool& complete);
+};
@@ -14,13 +14,27 @@ Notebook::Notebook(QWidget* parent)
     toolSelector->addTool(new DrawTool  (toolSelector));
     toolSelector->addTool(new ShapeTool (toolSelector));
     toolSelector->addTool(new TextTool  (toolSelector));
+    toolSelector->addTool(new BucketTool(toolSelector));
 
     setCentralWidget(root);
     root->setLayout(rootLayout);
     rootLayout->addWidget(toolSelector);
     rootLayout->addWidget(canvas);
 
+    layerDock  = new QDockWidget("Layers", this);
+    layerPanel = new LayerPanel(layerDock, canvas);
+    layerDock->setWidget(layerPanel);
+    addDockWidget(Qt::RightDockWidgetArea, layerDock);
+
+    pageDock  = new QDockWidget("Pages", this);
+    pagePanel = new PagePanel(pageDock, canvas);
+    pageDock->setWidget(pagePanel);
+    addDockWidget(Qt::LeftDockWidgetArea, pageDock);
+
+    perfOverlay = new PerfOverlay(canvas);
+
     buildActionMenu();
+    connect(canvas, &Canvas::saveFinished, this, &Notebook::onSaveFinished);
 
     show();
 }
@@ -38,6 +52,14 @@ void Notebook::buildActionMenu()
     openAct->setShortcuts(QKeySequence::Open);
     connect(openAct, &QAction::triggered, this, &Notebook::openFile);
 
+    galleryAct = new QAction("Open From &Gallery...", this);
+    galleryAct->setShortcut(QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_O));
+    connect(galleryAct, &QAction::triggered, this, &Notebook::showGallery);
+
+    searchAct = new QAction("&Search Notebooks...", this);
+    searchAct->setShortcut(QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_F));
+    connect(searchAct, &QAction::triggered, this, &Notebook::showSearch);
+
     const QList<QByteArray> imageFormats = QImageWriter::supportedImageFormats();
     for (const QByteArray &format : imageFormats) {
         QString text = tr("%1...").arg(QString::fromLatin1(format).toUpper());
@@ -56,6 +78,58 @@ void Notebook::buildActionMenu()
     clearScreenAct->setShortcut(tr("Ctrl+L"));
     connect(clearScreenAct, &QAction::triggered, canvas, &Canvas::clearImage);
 
+    // Ink only, the text box keeps its own undo while it has focus
+    undoAct = new QAction("&Undo", this);
+    undoAct->setShortcuts(QKeySequence::Undo);
+    connect(undoAct, &QAction::triggered, canvas, &Canvas::undoInk);
+
+    redoAct = new QAction("&Redo", this);
+    redoAct->setShortcuts({ QKeySequence(Qt::CTRL + Qt::Key_Y), QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_Z) });
+    connect(redoAct, &QAction::triggered, canvas, &Canvas::redoInk);
+
+    // Strokes and shapes stay editable geometry instead of being burned into the image
+    retainVectorsAct = new QAction("Keep Ink as &Vectors", this);
+    retainVectorsAct->setCheckable(true);
+    connect(retainVectorsAct, &QAction::toggled, [this](bool on) { canvas->retainVectors = on; });
+
+    newPageAct = new QAction("&New Page", this);
+    newPageAct->setShortcut(QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_N));
+    connect(newPageAct, &QAction::triggered, canvas, &Canvas::addPage);
+
+    nextPageAct = new QAction("Ne&xt Page", this);
+    nextPageAct->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_PageDown));
+    connect(nextPageAct, &QAction::triggered, canvas, &Canvas::nextPage);
+
+    previousPageAct = new QAction("&Previous Page", this);
+    previousPageAct->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_PageUp));
+    connect(previousPageAct, &QAction::triggered, canvas, &Canvas::previousPage);
+
+    // Ctrl+wheel and pinch zoom too, middle drag pans
+    zoomInAct = new QAction("Zoom &In", this);
+    zoomInAct->setShortcuts(QKeySequence::ZoomIn);
+    connect(zoomInAct, &QAction::triggered, canvas, &Canvas::zoomIn);
+
+    zoomOutAct = new QAction("Zoom &Out", this);
+    zoomOutAct->setShortcuts(QKeySequence::ZoomOut);
+    connect(zoomOutAct, &QAction::triggered, canvas, &Canvas::zoomOut);
+
+    resetZoomAct = new QAction("&Actual Size", this);
+    resetZoomAct->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_0));
+    connect(resetZoomAct, &QAction::triggered, canvas, &Canvas::resetZoom);
+
+    perfOverlayAct = new QAction("&Performance Overlay", this);
+    perfOverlayAct->setCheckable(true);
+    perfOverlayAct->setShortcut(QKeySequence(Qt::Key_F12));
+    connect(perfOverlayAct, &QAction::toggled, perfOverlay, &QWidget::setVisible);
+
+    // Trace points cost next to nothing until this is on, starting again drops the old trace
+    recordTraceAct = new QAction("&Record Trace", this);
+    recordTraceAct->setCheckable(true);
+    connect(recordTraceAct, &QAction::toggled, [](bool on) { if (on) Trace::clear(); Trace::setEnabled(on); });
+
+    saveTraceAct = new QAction("Save &Trace...", this);
+    connect(saveTraceAct, &QAction::triggered, this, &Notebook::saveTrace);
+
     aboutAct = new QAction("&About", this);
     connect(aboutAct, &QAction::triggered, this, &Notebook::about);
 
@@ -65,26 +139,56 @@ void Notebook::buildActionMenu()
     fileMenu = new QMenu("&File", this);
     fileMenu->addAction(saveAct);
     fileMenu->addAction(loadAct);
+    fileMenu->addAction(galleryAct);
     fileMenu->addAction(openAct);
     fileMenu->addMenu(exportAsMenu);
     fileMenu->addSeparator();
+    fileMenu->addAction(searchAct);
+    fileMenu->addSeparator();
     fileMenu->addAction(exitAct);
 
     optionMenu = new QMenu("&Edit", this);
+    optionMenu->addAction(undoAct);
+    optionMenu->addAction(redoAct);
+    optionMenu->addSeparator();
+    optionMenu->addAction(retainVectorsAct);
     optionMenu->addAction(clearScreenAct);
 
+    pageMenu = new QMenu("&Pages", this);
+    pageMenu->addAction(newPageAct);
+    pageMenu->addSeparator();
+    pageMenu->addAction(nextPageAct);
+    pageMenu->addAction(previousPageAct);
+
+    viewMenu = new QMenu("&View", this);
+    viewMenu->addAction(zoomInAct);
+    viewMenu->addAction(zoomOutAct);
+    viewMenu->addAction(resetZoomAct);
+    viewMenu->addSeparator();
+    viewMenu->addAction(layerDock->toggleViewAction());
+    viewMenu->addAction(pageDock->toggleViewAction());
+    viewMenu->addSeparator();
+    viewMenu->addAction(perfOverlayAct);
+    viewMenu->addAction(recordTraceAct);
+    viewMenu->addAction(saveTraceAct);
+
     helpMenu = new QMenu("&Help", this);
     helpMenu->addAction(aboutAct);
 
     menuBar()->addMenu(fileMenu);
     menuBar()->addMenu(optionMenu);
+    menuBar()->addMenu(pageMenu);
+    menuBar()->addMenu(viewMenu);
     menuBar()->addMenu(helpMenu);
 }
 
 void Notebook::closeEvent(QCloseEvent* event)
 {
-    if (trySave()) event->accept();
-    else event->ignore();
+    if (!trySave()) { event->ignore(); return; }
+
+    // Saved or thrown away on purpose, either way there's nothing to recover next time
+    canvas->journal.close(true);
+    event->accept();
 }
 
 bool Notebook::trySave()
@@ -121,17 +225,102 @@ bool Notebook::load()
     QString initialPath = QDir::currentPath();
     QString fileName = QFileDialog::getOpenFileName(this, "Load", initialPath, appName + " Files (*." + customSaveFileFormat + ");;All Files (*)");
     if (fileName.isEmpty()) return false;
-    canvas->load(fileName);
+    openNotebook(fileName);
     return true;
 }
 
+// Asks whether to put back what a journal holds, if it holds anything that still fits on top of its notebook
+static bool offerRecovery(QWidget* parent, const QString& appName, const QString& journalPath)
+{
+    Journal::Contents contents;
+    if (journalPath.isEmpty() || !Journal::read(journalPath, contents) || contents.count == 0 || !contents.baseMatches()) return false;
+
+    const QString name = contents.basePath.isEmpty() ? "an unsaved notebook" : QFileInfo(contents.basePath).fileName();
+    return QMessageBox::question(parent, appName,
+        "There are changes to " + name + " that weren't saved when " + appName + " last closed.\n"
+        "Do you want to recover them?",
+        QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes;
+}
+
+bool Notebook::openNotebook(const QString& filePath)
+{
+    const QString journalPath = Journal::pathFor(filePath);
+    if (offerRecovery(this, appName, journalPath) && canvas->recoverJournal(journalPath)) return true;
+    return canvas->load(filePath);
+}
+
+void Notebook::startAutosave()
+{
+    const QString journalPath = Journal::lastSession();
+    if (offerRecovery(this, appName, journalPath) && canvas->recoverJournal(journalPath)) return;
+    canvas->startJournal();
+}
+
 bool Notebook::save()
 {
     QString initialPath = QDir::currentPath() + "/untitled." + customSaveFileFormat;
     QString fileName = QFileDialog::getSaveFileName(this, "Save as", initialPath, appName + " Files (*." + customSaveFileFormat + ");;All Files (*)");
     if (fileName.isEmpty()) return false;
-    canvas->save(fileName);
-    return true;
+    statusBar()->showMessage("Saving " + QFileInfo(fileName).fileName() + "...");
+    return canvas->save(fileName);
+}
+
+void Notebook::onSaveFinished(const QString& filePath, bool ok)
+{
+    const QString fileName = QFileInfo(filePath).fileName();
+    if (ok) { statusBar()->showMessage("Saved " + fileName, 3000); return; }
+
+    statusBar()->clearMessage();
+    QMessageBox::warning(this, appName, "Couldn't save " + fileName + ".");
+}
+
+void Notebook::showGallery()
+{
+    if (!galleryDialog)
+    {
+        galleryDialog = new GalleryDialog(this);
+        connect(galleryDialog, &GalleryDialog::openNotebook, this, &Notebook::openFromGallery);
+    }
+    else galleryDialog->refresh();
+
+    galleryDialog->show();
+    galleryDialog->raise();
+    galleryDialog->activateWindow();
+}
+
+void Notebook::openFromGallery(const QString& filePath)
+{
+    if (QFileInfo(filePath).absoluteFilePath() != canvas->filePath() && (!trySave() || !openNotebook(filePath))) return;
+    galleryDialog->hide();
+}
+
+void Notebook::showSearch()
+{
+    if (!searchDialog)
+    {
+        searchDialog = new SearchDialog(this);
+        connect(searchDialog, &SearchDialog::openHit, this, &Notebook::openSearchHit);
+        connect(canvas, &Canvas::saveFinished, &searchDialog->index, &SearchIndex::refresh);
+    }
+    else searchDialog->index.refresh();
+
+    searchDialog->show();
+    searchDialog->raise();
+    searchDialog->activateWindow();
+    searchDialog->queryEdit->setFocus();
+}
+
+void Notebook::openSearchHit(const QString& filePath, quint32 pageId)
+{
+    // The notebook that's open already just flips to the page, reloading it would throw away unsaved changes
+    if (QFileInfo(filePath).absoluteFilePath() != canvas->filePath())
+    {
+        if (!trySave() || !openNotebook(filePath)) return;
+    }
+    for (int i = 0; i < int(canvas->pages.size()); i++)
+    {
+        if (canvas->pages[i].id == pageId) { canvas->showPage(i); break; }
+    }
 }
 
 void Notebook::exportAction()
@@ -146,6 +335,31 @@ bool Notebook::exportToImg(const QByteArray& fileFormat)
     QString initialPath = QDir::currentPath() + "/untitled." + fileFormat;
     QString fileName = QFileDialog::getSaveFileName(this, "Export As", initialPath, "%1 Files (*.%2);;All Files (*)");
     if (fileName.isEmpty()) return false;
-    canvas->exportImg(fileName, fileFormat.constData());
-    return true;
-}
\ No newline at end of file
+
+    // Runs in the background a band at a time, a huge canvas can take a while. The dialog keeps
+    // the window from being drawn on meanwhile, the export has its own copy anyway.
+    QProgressDialog progress("Exporting " + QFileInfo(fileName).fileName() + "...", "Cancel", 0, 0, this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(500);
+    bool ok = false;
+    bool cancelled = false;
+    QEventLoop loop;
+    connect(canvas, &Canvas::exportProgress, &progress, [&](int done, int total) { progress.setMaximum(total); progress.setValue(done); });
+    connect(canvas, &Canvas::exportFinished, &loop, [&](const QString&, bool result) { ok = result; loop.quit(); });
+    connect(&progress, &QProgressDialog::canceled, &loop, [&]() { cancelled = true; canvas->cancelExport(); });
+    canvas->startExport(fileName, fileFormat);
+    loop.exec();
+
+    if (!ok && !cancelled) QMessageBox::warning(this, appName, "Couldn't export " + fileName + ".");
+    return ok;
+}
+
+bool Notebook::saveTrace()
+{
+    QString fileName = QFileDialog::getSaveFileName(this, "Save Trace", QDir::currentPath() + "/trace.json", "Chrome Trace (*.json);;All Files (*)");
+    if (fileName.isEmpty()) return false;
+    if (Trace::save(fileName)) { statusBar()->showMessage("Saved trace " + fileName, 3000); return true; }
+
+    QMessageBox::warning(this, appName, "Couldn't write " + fileName);
+    return false;
+}
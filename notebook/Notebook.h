@@ -27,6 +27,7 @@
 
 #include <QtWidgets/QMainWindow>
 #include <qdir.h>
+#include <qfileinfo.h>
 #include <qfiledialog.h>
 #include <qinputdialog.h>
 #include <qmessagebox.h>
@@ -42,10 +43,20 @@
 #include <qpushbutton.h>
 #include <qboxlayout.h>
 #include <qiodevice.h>
+#include <qstatusbar.h>
+#include <qdockwidget.h>
+#include <qprogressdialog.h>
+#include <qeventloop.h>
 
 #include "ToolSelector.h"
 #include "Canvas.h"
 #include "Tools.h"
+#include "LayerPanel.h"
+#include "PagePanel.h"
+#include "PerfOverlay.h"
+#include "SearchDialog.h"
+#include "GalleryDialog.h"
+#include "Trace.h"
 
 class Notebook : public QMainWindow
 {
@@ -60,20 +71,43 @@ public:
 
     Canvas* canvas;
     ToolSelector* toolSelector;
+    LayerPanel*   layerPanel;
+    QDockWidget*  layerDock;
+    PagePanel*    pagePanel;
+    QDockWidget*  pageDock;
+    PerfOverlay*  perfOverlay;
+    SearchDialog* searchDialog = nullptr; // Made the first time it's opened
+    GalleryDialog* galleryDialog = nullptr; // Same
 
     QMenu* exportAsMenu;
     QMenu* fileMenu;
     QMenu* optionMenu;
+    QMenu* pageMenu;
+    QMenu* viewMenu;
     QMenu* helpMenu;
 
     QAction* saveAct;
     QAction* loadAct;
     QAction* openAct;
+    QAction* galleryAct;
+    QAction* searchAct;
     QList<QAction*> exportAsActs;
     QAction* exitAct;
     QAction* penColorAct;
     QAction* penWidthAct;
     QAction* clearScreenAct;
+    QAction* undoAct;
+    QAction* redoAct;
+    QAction* retainVectorsAct;
+    QAction* newPageAct;
+    QAction* nextPageAct;
+    QAction* previousPageAct;
+    QAction* zoomInAct;
+    QAction* zoomOutAct;
+    QAction* resetZoomAct;
+    QAction* perfOverlayAct;
+    QAction* recordTraceAct;
+    QAction* saveTraceAct;
     QAction* aboutAct;
 
     Notebook(QWidget* parent = Q_NULLPTR);
@@ -83,7 +117,15 @@ public:
     void about();
     void openFile();
     bool load();
+    bool openNotebook(const QString& filePath); // Offers to recover what a crash left in its journal first
+    void startAutosave();
     bool save();
+    void onSaveFinished(const QString& filePath, bool ok);
+    void showGallery();
+    void openFromGallery(const QString& filePath);
+    void showSearch();
+    void openSearchHit(const QString& filePath, quint32 pageId);
     void exportAction();
     bool exportToImg(const QByteArray& fileFormat);
+    bool saveTrace();
 };
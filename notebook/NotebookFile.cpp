@@ -0,0 +1,654 @@
+#include "NotebookFile.h"
+
+#include <qsavefile.h>
+#include <qbuffer.h>
+#include <qimagereader.h>
+#include <qset.h>
+#include <qjsondocument.h>
+#include <qjsonobject.h>
+#include <qjsonarray.h>
+#include <QuaZip-Qt5-1.1/quazip/quazip.h>
+#include <QuaZip-Qt5-1.1/quazip/quazipfile.h>
+#include <zlib.h>
+
+using OpenFlags = QIODevice::OpenModeFlag;
+
+static const QString manifestEntry = "manifest.json";
+static const QString textEntry     = "text.txt";
+static const QString richTextEntry = "text.jsonl";
+static const QString vectorsEntry  = "vectors.bin";
+static const QString thumbnailEntry = "thumbnail.png";
+static const QString v2TileDir     = "tiles/";
+
+QString NotebookFile::pageDir(quint32 pageId)
+{
+    return QString("pages/%1/").arg(pageId);
+}
+
+QString NotebookFile::pageManifest(quint32 pageId)
+{
+    return pageDir(pageId) + "page.json";
+}
+
+QString NotebookFile::layerDir(quint32 pageId, quint32 layerId)
+{
+    return pageDir(pageId) + QString("layers/%1/").arg(layerId);
+}
+
+QString NotebookFile::tileEntryName(const QString& dir, int tx, int ty)
+{
+    return dir + QString("%1_%2.png").arg(tx).arg(ty);
+}
+
+static QJsonObject readManifest(const MappedArchive& archive)
+{
+    return QJsonDocument::fromJson(archive.read(manifestEntry)).object();
+}
+
+// A page's own manifest, or for files from before pages the main one. version is what the page is laid out like.
+static QJsonObject readPageManifest(const MappedArchive& archive, const QString& name, int& version)
+{
+    if (!name.isEmpty())
+    {
+        version = NotebookFile::currentVersion;
+        return QJsonDocument::fromJson(archive.read(name)).object();
+    }
+    const QJsonObject manifest = readManifest(archive);
+    version = manifest.isEmpty() ? 1 : manifest.value("version").toInt();
+    return manifest;
+}
+
+static QHash<quint32, QString> dirsFromManifest(const QJsonObject& manifest, int version)
+{
+    QHash<quint32, QString> dirs;
+    if (version == 2) dirs.insert(1, v2TileDir); // The one layer v2 has loads with id 1
+    if (version < 3) return dirs;
+
+    for (const QJsonValue& value : manifest.value("layers").toArray())
+    {
+        const QJsonObject layer = value.toObject();
+        dirs.insert(quint32(layer.value("id").toInt()), layer.value("dir").toString());
+    }
+    return dirs;
+}
+
+QHash<quint32, QString> NotebookFile::layerDirs(const MappedArchive& archive, const QString& manifest)
+{
+    int version = 0;
+    const QJsonObject page = readPageManifest(archive, manifest, version);
+    return dirsFromManifest(page, version);
+}
+
+static bool writeEntry(QuaZip& zip, const QString& name, const QByteArray& bytes)
+{
+    QuaZipFile file(&zip);
+    if (!file.open(OpenFlags::WriteOnly, QuaZipNewInfo(name))) return false;
+    file.write(bytes);
+    file.close();
+    return file.getZipError() == UNZ_OK;
+}
+
+// Deflated entries are copied in raw, like tiles from the old file
+static bool writeEntry(QuaZip& zip, const QString& name, const DeflatedEntry& entry)
+{
+    QuaZipNewInfo info(name);
+    info.uncompressedSize = entry.size;
+
+    QuaZipFile file(&zip);
+    if (!file.open(OpenFlags::WriteOnly, info, nullptr, entry.crc, Z_DEFLATED, Z_DEFAULT_COMPRESSION, true)) return false;
+    file.write(entry.raw);
+    file.close();
+    return file.getZipError() == UNZ_OK;
+}
+
+static bool writeTile(QuaZip& zip, const QString& name, const QImage& tile)
+{
+    // PNG is already deflated, store it as is instead of compressing it twice
+    QuaZipFile tileFile(&zip);
+    if (!tileFile.open(OpenFlags::WriteOnly, QuaZipNewInfo(name), nullptr, 0, 0)) return false;
+    bool ok = tile.convertToFormat(QImage::Format_ARGB32).save(&tileFile, "png");
+    tileFile.close();
+    return ok && tileFile.getZipError() == UNZ_OK;
+}
+
+// Copies an entry over without decompressing it. A missing entry isn't an error, found says whether it was there.
+static bool copyEntry(QuaZip& to, const MappedArchive& source, const QString& from, const QString& name, bool* found = nullptr)
+{
+    MappedArchive::Entry entry;
+    const QByteArray raw = source.readRaw(from, &entry);
+    if (found) *found = !raw.isNull();
+    if (raw.isNull()) return true;
+
+    QuaZipNewInfo info(name);
+    info.uncompressedSize = entry.size;
+
+    QuaZipFile dst(&to);
+    if (!dst.open(OpenFlags::WriteOnly, info, nullptr, entry.crc, entry.method, Z_DEFAULT_COMPRESSION, true)) return false;
+    dst.write(raw);
+    dst.close();
+    return dst.getZipError() == UNZ_OK;
+}
+
+// Copies the tiles in wanted that are still in source, copied gets the ones that made it
+static bool copyTiles(QuaZip& to, const MappedArchive& source, const QString& fromDir, const QString& toDir,
+                      const QSet<quint64>& wanted, QSet<quint64>& copied)
+{
+    for (quint64 key : wanted)
+    {
+        const QPoint coords = TiledImage::keyToCoords(key);
+        bool found = false;
+        if (!copyEntry(to, source, NotebookFile::tileEntryName(fromDir, coords.x(), coords.y()),
+                       NotebookFile::tileEntryName(toDir, coords.x(), coords.y()), &found)) return false;
+        if (found) copied.insert(key);
+    }
+    return true;
+}
+
+// Tiles, vectors, text and the page manifest of a resident page, under its own dir
+static bool writePage(QuaZip& saveZip, const SaveSnapshot& snapshot, const PageSnapshot& page, const std::function<bool()>& superseded)
+{
+    // Where each layer's tiles sit in the source, if they can be copied from there at all
+    QHash<quint32, QString> sourceDirs;
+    QJsonObject sourceManifest;
+    if (snapshot.source)
+    {
+        int version = 0;
+        sourceManifest = readPageManifest(*snapshot.source, page.sourceManifest, version);
+        if (sourceManifest.value("tileSize").toInt() == TiledImage::tileSize) sourceDirs = dirsFromManifest(sourceManifest, version);
+    }
+
+    const QString dir = NotebookFile::pageDir(page.id);
+    bool ok = true;
+    QJsonArray layerList;
+    for (const Layer& layer : page.layers)
+    {
+        if (!ok || superseded()) return false;
+        const QString tileDir = NotebookFile::layerDir(page.id, layer.id);
+
+        // Only tiles drawn on since the source file was written get encoded again
+        const QHash<quint64, quint64>& versions = layer.image.tileVersions();
+        QSet<quint64> unchanged;
+        if (sourceDirs.contains(layer.id))
+        {
+            const QHash<quint64, quint64> sourceVersions = page.sourceVersions.value(layer.id);
+            for (auto it = versions.constBegin(); it != versions.constEnd(); ++it)
+            {
+                if (sourceVersions.value(it.key()) == it.value()) unchanged.insert(it.key());
+            }
+        }
+
+        // The new file only gets live tiles, so stale ones from older saves never pile up
+        QSet<quint64> copied;
+        ok = unchanged.isEmpty() || copyTiles(saveZip, *snapshot.source, sourceDirs.value(layer.id), tileDir, unchanged, copied);
+
+        QJsonArray tileList;
+        for (auto it = versions.constBegin(); it != versions.constEnd() && ok; ++it)
+        {
+            if (superseded()) return false;
+
+            const QPoint coords = TiledImage::keyToCoords(it.key());
+            if (!copied.contains(it.key()))
+            {
+                const QImage* tile = layer.image.tile(coords.x(), coords.y());
+                QImage decoded;
+                if (tile == nullptr && layer.image.tileLoader())
+                {
+                    decoded = layer.image.tileLoader()(coords.x(), coords.y());
+                    tile = &decoded;
+                }
+                if (tile == nullptr || tile->isNull()) continue;
+                ok = writeTile(saveZip, NotebookFile::tileEntryName(tileDir, coords.x(), coords.y()), *tile);
+            }
+            tileList.append(QJsonArray { coords.x(), coords.y() });
+        }
+
+        QJsonObject entry;
+        entry["id"]      = qint64(layer.id);
+        entry["name"]    = layer.name;
+        entry["visible"] = layer.visible;
+        entry["opacity"] = layer.opacity;
+        entry["blend"]   = Layer::blendName(layer.blend);
+        entry["dir"]     = tileDir;
+        entry["tiles"]   = tileList;
+        layerList.append(entry);
+    }
+    if (!ok) return false;
+
+    const QSize extent = page.layers.empty() ? QSize() : page.layers.front().image.size();
+
+    QJsonObject manifest;
+    manifest["width"]       = extent.width();
+    manifest["height"]      = extent.height();
+    manifest["tileSize"]    = TiledImage::tileSize;
+    manifest["text"]        = dir + textEntry;
+    manifest["layers"]      = layerList;
+    manifest["activeLayer"] = page.activeLayer;
+    if (!page.scene.isEmpty())
+    {
+        manifest["vectors"] = dir + vectorsEntry;
+        ok = writeEntry(saveZip, dir + vectorsEntry, page.scene.serialize());
+    }
+
+    if (page.textChanged)
+    {
+        manifest["richText"] = dir + richTextEntry;
+        // Encoded here rather than when the snapshot was taken, that's on the GUI thread
+        const QTextDocument& text = *page.text;
+        ok = ok && writeEntry(saveZip, dir + textEntry, DeflatedEntry::make([&text](QIODevice& device) { return RichText::writePlain(text, device); }))
+                && writeEntry(saveZip, dir + richTextEntry, DeflatedEntry::make([&text](QIODevice& device) { return RichText::write(text, device); }));
+    }
+    else if (snapshot.source)
+    {
+        // Copied as it is. A page from before rich text has none to copy, its text.txt is all it ever had.
+        bool found = false;
+        ok = ok && copyEntry(saveZip, *snapshot.source, sourceManifest.value("text").toString(textEntry), dir + textEntry, &found);
+        if (ok && !found) ok = writeEntry(saveZip, dir + textEntry, QByteArray());
+
+        const QString sourceRichText = sourceManifest.value("richText").toString();
+        if (ok && !sourceRichText.isEmpty())
+        {
+            ok = copyEntry(saveZip, *snapshot.source, sourceRichText, dir + richTextEntry, &found);
+            if (found) manifest["richText"] = dir + richTextEntry;
+        }
+    }
+    else ok = false; // Nothing to copy it from
+
+    return ok && writeEntry(saveZip, NotebookFile::pageManifest(page.id), QJsonDocument(manifest).toJson(QJsonDocument::Compact));
+}
+
+// The source's thumbnail entry if it's of page as it is now: same layers set up the same way, no tile drawn on since
+// and the same vector ink. Empty if it has to be drawn again.
+static QString unchangedThumbnail(const SaveSnapshot& snapshot, const PageSnapshot& page)
+{
+    if (!snapshot.source) return QString();
+    const QJsonObject source = readManifest(*snapshot.source);
+    const QString thumbnail = source.value("thumbnail").toString();
+    if (thumbnail.isEmpty() || source.value("thumbnailPage").toInt(-1) != qint64(page.id)) return QString();
+
+    int version = 0;
+    const QJsonObject pageManifest = readPageManifest(*snapshot.source, page.sourceManifest, version);
+    const QJsonArray sourceLayers = pageManifest.value("layers").toArray();
+    if (version < 3 || sourceLayers.size() != int(page.layers.size())) return QString();
+    for (int i = 0; i < int(page.layers.size()); i++)
+    {
+        const Layer& layer = page.layers[i];
+        const QJsonObject entry = sourceLayers[i].toObject();
+        if (quint32(entry.value("id").toInt()) != layer.id
+            || entry.value("visible").toBool() != layer.visible
+            || entry.value("opacity").toDouble() != layer.opacity
+            || entry.value("blend").toString() != Layer::blendName(layer.blend)
+            || layer.image.tileVersions() != page.sourceVersions.value(layer.id)) return QString();
+    }
+
+    // Vector ink is small, it's compared as it would be written
+    const QString vectors = pageManifest.value("vectors").toString();
+    if (page.scene.isEmpty() != vectors.isEmpty()) return QString();
+    if (!vectors.isEmpty() && snapshot.source->read(vectors) != page.scene.serialize()) return QString();
+    return thumbnail;
+}
+
+NotebookFile::Result NotebookFile::write(const SaveSnapshot& snapshot, const std::atomic<quint64>& latestGeneration, QSaveFile& saveFile)
+{
+    auto superseded = [&]() { return snapshot.generation != latestGeneration.load(); };
+    if (superseded()) return Result::superseded;
+
+    // Goes to a temp file next to the target and gets renamed over it on commit,
+    // so a failed or abandoned save never leaves a half written notebook behind
+    if (!saveFile.open(OpenFlags::WriteOnly)) return Result::failed;
+
+    QuaZip saveZip(&saveFile);
+    saveZip.setAutoClose(false);
+    if (!saveZip.open(QuaZip::mdCreate)) { saveFile.cancelWriting(); return Result::failed; }
+
+    // Everything the pages that weren't resident have in the source, by page dir.
+    // Gathered in one go, going through every entry for each page would add up with hundreds of them.
+    QHash<QString, QStringList> storedEntries;
+    for (const PageSnapshot& page : snapshot.pages)
+    {
+        if (page.resident || !snapshot.source) continue;
+        const QHash<QString, MappedArchive::Entry> sourceEntries = snapshot.source->allEntries();
+        for (auto it = sourceEntries.constBegin(); it != sourceEntries.constEnd(); ++it)
+        {
+            const int slash = it.key().startsWith("pages/") ? it.key().indexOf('/', 6) : -1;
+            if (slash > 0) storedEntries[it.key().left(slash + 1)].append(it.key());
+        }
+        break;
+    }
+
+    bool ok = true;
+    QJsonArray pageList;
+    for (const PageSnapshot& page : snapshot.pages)
+    {
+        if (!ok || superseded()) break;
+        if (page.resident) ok = writePage(saveZip, snapshot, page, superseded);
+        else
+        {
+            // Nothing to copy it from means it would be lost
+            ok = snapshot.source && snapshot.source->contains(pageManifest(page.id));
+            for (const QString& name : storedEntries.value(pageDir(page.id)))
+            {
+                if (!ok || superseded()) break;
+                ok = copyEntry(saveZip, *snapshot.source, name, name);
+            }
+        }
+
+        QJsonObject entry;
+        entry["id"]       = qint64(page.id);
+        entry["title"]    = page.title;
+        entry["section"]  = page.section;
+        entry["manifest"] = pageManifest(page.id);
+        pageList.append(entry);
+    }
+
+    // The page that was open, it's always resident
+    const bool hasThumbnail = snapshot.activePage >= 0 && snapshot.activePage < int(snapshot.pages.size());
+    if (ok && hasThumbnail && !superseded())
+    {
+        // Drawing it again decodes every tile of the page that's still pending, here on the save thread,
+        // so it's copied over when nothing on the page changed
+        const PageSnapshot& page = snapshot.pages[snapshot.activePage];
+        const QString unchanged = unchangedThumbnail(snapshot, page);
+        bool copied = false;
+        if (!unchanged.isEmpty()) ok = copyEntry(saveZip, *snapshot.source, unchanged, thumbnailEntry, &copied);
+        if (ok && !copied) ok = writeTile(saveZip, thumbnailEntry, renderThumbnail(page.layers, page.scene));
+    }
+
+    if (ok && !superseded())
+    {
+        QJsonObject manifest;
+        manifest["version"]    = currentVersion;
+        manifest["tileSize"]   = TiledImage::tileSize;
+        manifest["pages"]      = pageList;
+        manifest["activePage"] = snapshot.activePage;
+        if (hasThumbnail)
+        {
+            manifest["thumbnail"]     = thumbnailEntry;
+            manifest["thumbnailPage"] = qint64(snapshot.pages[snapshot.activePage].id);
+        }
+        ok = writeEntry(saveZip, manifestEntry, QJsonDocument(manifest).toJson(QJsonDocument::Compact));
+    }
+
+    saveZip.close();
+    ok = ok && saveZip.getZipError() == UNZ_OK;
+
+    if (superseded()) { saveFile.cancelWriting(); return Result::superseded; }
+    if (!ok)          { saveFile.cancelWriting(); return Result::failed; }
+    return Result::ok;
+}
+
+// Deflates whatever gets written to it onto the end of an entry's raw bytes
+class DeflateDevice : public QIODevice
+{
+public:
+    DeflateDevice(DeflatedEntry& entry) : entry(entry)
+    {
+        deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        open(WriteOnly | Unbuffered);
+    }
+    ~DeflateDevice() { deflateEnd(&stream); }
+
+    bool isSequential() const override { return true; }
+    bool finish() { return pump(nullptr, 0, Z_FINISH); }
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override { return -1; }
+    qint64 writeData(const char* data, qint64 length) override
+    {
+        entry.crc  = crc32(entry.crc, reinterpret_cast<const Bytef*>(data), uInt(length));
+        entry.size += length;
+        return pump(data, length, Z_NO_FLUSH) ? length : -1;
+    }
+
+private:
+    DeflatedEntry& entry;
+    z_stream stream {};
+
+    bool pump(const char* data, qint64 length, int flush)
+    {
+        stream.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        stream.avail_in = uInt(length);
+        char chunk[16384];
+        int status = Z_OK;
+        do
+        {
+            stream.next_out  = reinterpret_cast<Bytef*>(chunk);
+            stream.avail_out = sizeof(chunk);
+            status = deflate(&stream, flush);
+            if (status == Z_STREAM_ERROR) return false;
+            entry.raw.append(chunk, int(sizeof(chunk) - stream.avail_out));
+        } while (stream.avail_out == 0);
+        return flush != Z_FINISH || status == Z_STREAM_END;
+    }
+};
+
+DeflatedEntry DeflatedEntry::make(const std::function<bool(QIODevice&)>& write)
+{
+    DeflatedEntry entry;
+    DeflateDevice device(entry);
+    if (!write(device) || !device.finish()) return DeflatedEntry();
+    return entry;
+}
+
+TiledImage::TileLoader NotebookFile::tileLoader(const std::shared_ptr<MappedArchive>& archive, const QString& dir)
+{
+    return [archive, dir](int tx, int ty)
+        {
+            return QImage::fromData(archive->read(tileEntryName(dir, tx, ty)), "png");
+        };
+}
+
+static void readTiles(const std::shared_ptr<MappedArchive>& archive, int tileSize, const QString& dir, const QJsonArray& tiles, TiledImage& image)
+{
+    if (tileSize == TiledImage::tileSize) image.setLoader(NotebookFile::tileLoader(archive, dir));
+    for (const QJsonValue& value : tiles)
+    {
+        const QJsonArray coords = value.toArray();
+        const int tx = coords.at(0).toInt();
+        const int ty = coords.at(1).toInt();
+
+        if (tileSize == TiledImage::tileSize) { image.insertPending(tx, ty); continue; }
+
+        // Written with a different tile size, this one has to be decoded and painted back in at the right spot
+        const QImage tile = QImage::fromData(archive->read(NotebookFile::tileEntryName(dir, tx, ty)), "png");
+        const QRect rect(tx * tileSize, ty * tileSize, tileSize, tileSize);
+        image.editTiles(rect, [&](QImage& target, const QRect& targetRect)
+            {
+                QPainter painter(&target);
+                painter.setCompositionMode(QPainter::CompositionMode_Source);
+                painter.drawImage(rect.topLeft() - targetRect.topLeft(), tile);
+            });
+    }
+}
+
+bool NotebookFile::readIndex(const MappedArchive& archive, LoadedNotebook& out)
+{
+    const QJsonObject manifest = readManifest(archive);
+    out.version = manifest.isEmpty() ? 1 : manifest.value("version").toInt();
+    out.pages.clear();
+    out.activePage = 0;
+
+    if (out.version < 4)
+    {
+        // Everything is in the main manifest, that's the one page there is
+        PageEntry page;
+        page.id    = 1;
+        page.title = "Page 1";
+        out.pages.push_back(page);
+        return true;
+    }
+
+    for (const QJsonValue& value : manifest.value("pages").toArray())
+    {
+        const QJsonObject entry = value.toObject();
+        PageEntry page;
+        page.id       = quint32(entry.value("id").toInt());
+        page.title    = entry.value("title").toString();
+        page.section  = entry.value("section").toString();
+        page.manifest = entry.value("manifest").toString();
+        if (page.manifest.isEmpty()) return false;
+        out.pages.push_back(page);
+    }
+    if (out.pages.empty()) return false;
+    out.activePage = qBound(0, manifest.value("activePage").toInt(), int(out.pages.size()) - 1);
+    return true;
+}
+
+bool NotebookFile::readPage(const std::shared_ptr<MappedArchive>& archive, const QString& manifestName, LoadedPage& out)
+{
+    int version = 0;
+    const QJsonObject manifest = readPageManifest(*archive, manifestName, version);
+    if (!manifestName.isEmpty() && manifest.isEmpty()) return false;
+
+    if (version == 1)
+    {
+        Layer layer;
+        layer.id   = 1;
+        layer.name = "Ink";
+        QImage img;
+        img.loadFromData(archive->read("image.png"));
+        layer.image.setImage(img); // Converted to premultiplied once, in here
+        out.layers.push_back(std::move(layer));
+    }
+    else
+    {
+        const QSize extent(manifest.value("width").toInt(), manifest.value("height").toInt());
+        const int tileSize = manifest.value("tileSize").toInt(TiledImage::tileSize);
+
+        if (version == 2)
+        {
+            Layer layer;
+            layer.id   = 1;
+            layer.name = "Ink";
+            layer.image.resize(extent);
+            readTiles(archive, tileSize, v2TileDir, manifest.value("tiles").toArray(), layer.image);
+            out.layers.push_back(std::move(layer));
+        }
+        else
+        {
+            for (const QJsonValue& value : manifest.value("layers").toArray())
+            {
+                const QJsonObject entry = value.toObject();
+                Layer layer;
+                layer.id      = quint32(entry.value("id").toInt());
+                layer.name    = entry.value("name").toString();
+                layer.visible = entry.value("visible").toBool(true);
+                layer.opacity = entry.value("opacity").toDouble(1);
+                layer.blend   = Layer::blendFromName(entry.value("blend").toString());
+                layer.image.resize(extent);
+                readTiles(archive, tileSize, entry.value("dir").toString(), entry.value("tiles").toArray(), layer.image);
+                out.layers.push_back(std::move(layer));
+            }
+            if (out.layers.empty()) return false;
+            out.activeLayer = qBound(0, manifest.value("activeLayer").toInt(), int(out.layers.size()) - 1);
+        }
+
+        const QString vectors = manifest.value("vectors").toString();
+        if (!vectors.isEmpty() && !out.scene.deserialize(archive->read(vectors))) return false;
+    }
+
+    const QString richText = manifest.value("richText").toString();
+    if (!richText.isEmpty() && archive->contains(richText)) out.richText.reset(new RichTextReader(archive, richText));
+    else out.text = QString::fromUtf8(archive->read(manifest.value("text").toString(textEntry)));
+    return true;
+}
+
+QImage NotebookFile::renderThumbnail(const std::vector<Layer>& layers, const VectorScene& scene, int maxSize)
+{
+    // Only the part with anything on it, a few strokes in the corner of a big canvas would be a dot otherwise
+    QRect area;
+    for (const Layer& layer : layers)
+    {
+        if (layer.visible) area |= layer.image.boundingRect();
+    }
+    for (quint32 id : scene.ids()) area |= scene.item(id)->bounds.toAlignedRect();
+    if (!layers.empty() && !layers.front().image.size().isEmpty()) area &= QRect(QPoint(0, 0), layers.front().image.size());
+
+    if (area.isEmpty())
+    {
+        QImage blank(maxSize, maxSize * 3 / 4, QImage::Format_RGB32);
+        blank.fill(Qt::white);
+        return blank;
+    }
+
+    const qreal scale = qMin(qreal(1), qreal(maxSize) / qMax(area.width(), area.height()));
+    const QSize size = (QSizeF(area.size()) * scale).toSize().expandedTo(QSize(1, 1));
+    QImage thumbnail(size, TiledImage::format);
+    thumbnail.fill(Qt::white);
+    QImage layerImage(size, TiledImage::format);
+
+    QPainter painter(&thumbnail);
+    for (const Layer& layer : layers)
+    {
+        if (!layer.visible || layer.opacity <= 0) continue;
+
+        // Each layer scaled down on its own first, so opacity and blending apply to it as a whole like on the canvas
+        layerImage.fill(Qt::transparent);
+        QPainter layerPainter(&layerImage);
+        layerPainter.setRenderHint(QPainter::SmoothPixmapTransform);
+        layerPainter.scale(scale, scale);
+        layerPainter.translate(-area.topLeft());
+        for (auto it = layer.image.tileVersions().constBegin(); it != layer.image.tileVersions().constEnd(); ++it)
+        {
+            const QPoint coords = TiledImage::keyToCoords(it.key());
+            const QImage* tile = layer.image.tile(coords.x(), coords.y());
+            QImage decoded;
+            if (tile == nullptr && layer.image.tileLoader())
+            {
+                decoded = layer.image.tileLoader()(coords.x(), coords.y());
+                tile = &decoded;
+            }
+            if (tile == nullptr || tile->isNull()) continue;
+            layerPainter.drawImage(TiledImage::tileRect(coords.x(), coords.y()), *tile);
+        }
+        layerPainter.end();
+
+        painter.setOpacity(layer.opacity);
+        painter.setCompositionMode(layer.blend);
+        painter.drawImage(0, 0, layerImage);
+    }
+
+    painter.setOpacity(1);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.scale(scale, scale);
+    painter.translate(-area.topLeft());
+    scene.paint(painter, area);
+    painter.end();
+    return thumbnail.convertToFormat(QImage::Format_RGB32);
+}
+
+QImage NotebookFile::readThumbnail(const std::shared_ptr<MappedArchive>& archive, int maxSize)
+{
+    const QJsonObject manifest = readManifest(*archive);
+    const QString entry = manifest.value("thumbnail").toString();
+    QImage thumbnail;
+    if (!entry.isEmpty()) thumbnail = QImage::fromData(archive->read(entry), "png");
+    else if (manifest.isEmpty())
+    {
+        // v1 is one big PNG, the reader scales it down as it goes
+        QByteArray bytes = archive->read("image.png");
+        QBuffer buffer(&bytes);
+        QImageReader reader(&buffer, "png");
+        const QSize size = reader.size();
+        if (size.isValid() && qMax(size.width(), size.height()) > maxSize) reader.setScaledSize(size.scaled(maxSize, maxSize, Qt::KeepAspectRatio));
+        thumbnail = reader.read();
+    }
+    else
+    {
+        LoadedNotebook index;
+        LoadedPage page;
+        if (readIndex(*archive, index) && readPage(archive, index.pages[index.activePage].manifest, page))
+            thumbnail = renderThumbnail(page.layers, page.scene, maxSize);
+    }
+
+    if (!thumbnail.isNull() && qMax(thumbnail.width(), thumbnail.height()) > maxSize)
+        thumbnail = thumbnail.scaled(maxSize, maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    return thumbnail;
+}
+
+QString NotebookFile::readPageText(const MappedArchive& archive, const QString& manifestName)
+{
+    int version = 0;
+    const QJsonObject manifest = readPageManifest(archive, manifestName, version);
+    return QString::fromUtf8(archive.read(manifest.value("text").toString(textEntry)));
+}
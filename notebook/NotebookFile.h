@@ -0,0 +1,138 @@
+#pragma once
+
+#include <qstring.h>
+#include <qhash.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "LayerStack.h"
+#include "MappedArchive.h"
+#include "VectorScene.h"
+#include "RichText.h"
+
+class QSaveFile;
+
+// An entry deflated as it was written, so the save thread can copy it into the zip as is.
+// Lets the text go from the document to compressed bytes a block at a time, without all of it encoded in between.
+struct DeflatedEntry
+{
+    QByteArray raw;      // Raw deflate stream
+    quint32    crc  = 0;
+    qint64     size = 0; // Uncompressed
+
+    static DeflatedEntry make(const std::function<bool(QIODevice&)>& write);
+};
+
+// One page of a save. Pages that aren't resident only carry their place in the notebook,
+// everything they have in the source gets copied over compressed as it is.
+struct PageSnapshot
+{
+    quint32            id = 0;
+    QString            title;
+    QString            section;
+    bool               resident = true;
+    std::vector<Layer> layers;
+    int                activeLayer = 0;
+    bool               textChanged = true; // Otherwise text is null and the source's entries get copied
+    std::shared_ptr<QTextDocument> text;   // A copy of the page's, the save thread encodes it. Has no thread.
+    VectorScene        scene;    // Copied whole, retained mode items are small
+
+    // Where the page is in the source and the tile versions that are in it, per layer id.
+    // Tiles whose version still matches get copied over compressed instead of encoded again.
+    QString sourceManifest;
+    QHash<quint32, QHash<quint64, quint64>> sourceVersions;
+};
+
+// Everything a save needs, taken off the canvas on the GUI thread.
+// Tiles are implicitly shared, so this is cheap and drawing afterwards only detaches the tiles it touches.
+struct SaveSnapshot
+{
+    QString                   filePath;
+    std::vector<PageSnapshot> pages;
+    int                       activePage = 0;
+    quint64                   generation = 0;
+    std::shared_ptr<MappedArchive> source; // The last file this canvas was saved to or loaded from
+};
+
+// Where a page is in a file, enough to list it without reading any of it
+struct PageEntry
+{
+    quint32 id = 0;
+    QString title;
+    QString section;
+    QString manifest; // The page's own manifest, empty for files from before pages where it's the main one
+};
+
+struct LoadedNotebook
+{
+    std::vector<PageEntry> pages;
+    int activePage = 0;
+    int version    = 0;
+};
+
+struct LoadedPage
+{
+    std::vector<Layer> layers;
+    int                activeLayer = 0;
+    VectorScene        scene;
+    QString            text;     // Only when there's no rich text
+    std::unique_ptr<RichTextReader> richText;
+};
+
+// Reading and writing .nb files, safe to call off the GUI thread.
+//
+// v1: image.png + text.txt
+// v2: manifest.json + text.txt + one tiles/<x>_<y>.png per allocated canvas tile,
+//     plus vectors.bin when there's retained mode ink (see VectorScene::serialize)
+// v3: same, with a list of layers in the manifest, each with its own layers/<id>/<x>_<y>.png tiles.
+//     v1 and v2 files load as a single layer.
+//     text.jsonl has the text with its formatting when the manifest names it under richText, text.txt stays a plain copy.
+// v4: pages. manifest.json only lists them, each page has a v3 style page.json and everything else under pages/<id>/,
+//     so opening a notebook reads the list and one page no matter how many there are.
+//     Older files load as a single page.
+//     thumbnail.png, named under thumbnail in manifest.json, is a small picture of the page that was open when it was saved.
+//     thumbnailPage is that page's id.
+struct NotebookFile
+{
+    static constexpr int currentVersion = 4;
+    static constexpr int thumbnailSize  = 256; // Longest side of the thumbnail that goes in the file
+
+    enum class Result
+    {
+        ok,
+        failed,
+        superseded // A newer save came in, nothing was written
+    };
+
+    // Writes into file, opened here, and leaves the commit to the caller: saving over the file the source maps
+    // has to go through MappedArchive::remap. Anything but ok has already cancelled it.
+    static Result write(const SaveSnapshot& snapshot, const std::atomic<quint64>& latestGeneration, QSaveFile& saveFile);
+
+    // Only reads the page list
+    static bool readIndex(const MappedArchive& archive, LoadedNotebook& out);
+
+    // Reads the page with the given manifest (see PageEntry) and its text, tiles come back pending and get decoded
+    // from the archive on demand. Rich text comes back as a reader for the canvas to feed into its document a bit at a time.
+    // v1 has a single image.png, that one gets decoded right away.
+    static bool readPage(const std::shared_ptr<MappedArchive>& archive, const QString& manifest, LoadedPage& out);
+    static TiledImage::TileLoader tileLoader(const std::shared_ptr<MappedArchive>& archive, const QString& dir);
+
+    // Scaled down picture of everything that's drawn on a page, cropped to where there's anything.
+    // Pending tiles get decoded for it on this thread.
+    static QImage renderThumbnail(const std::vector<Layer>& layers, const VectorScene& scene, int maxSize = thumbnailSize);
+
+    // The file's thumbnail without reading the rest of it. Files from before thumbnails get one
+    // from image.png for v1, or drawn from the tiles of the page that was open otherwise.
+    static QImage readThumbnail(const std::shared_ptr<MappedArchive>& archive, int maxSize = thumbnailSize);
+
+    // Just the plain text of a page, for search
+    static QString readPageText(const MappedArchive& archive, const QString& manifest);
+
+    // Where each layer of a page has its tiles in an archive, by layer id
+    static QHash<quint32, QString> layerDirs(const MappedArchive& archive, const QString& manifest);
+    static QString pageDir(quint32 pageId);
+    static QString pageManifest(quint32 pageId);
+    static QString layerDir(quint32 pageId, quint32 layerId);
+    static QString tileEntryName(const QString& dir, int tx, int ty);
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <qstring.h>
+#include <qhash.h>
+#include <qtextdocument.h>
+#include <memory>
+#include <vector>
+#include "LayerStack.h"
+#include "VectorScene.h"
+#include "InkHistory.h"
+
+// A page of a notebook. The canvas keeps the one it shows and the few visited before it resident,
+// the rest are only their place in the file until they're shown again.
+// While a page is on the canvas its layers, scene and history live in the canvas, text stays here.
+struct Page
+{
+    quint32 id = 0; // Stable for the page's lifetime, names its dir in the file
+    QString title;
+    QString section; // Pages next to each other with the same section show under one heading
+    QString manifest; // Where it is in the canvas' archive, see PageEntry. Empty if it isn't in there on its own.
+
+    bool resident = false;
+    bool modified = false; // Has changes the archive doesn't, so it has to stay resident
+    std::vector<Layer> layers;
+    int activeLayer = 0;
+    VectorScene scene;
+    InkHistory  history;
+    std::unique_ptr<QTextDocument> text;
+    QHash<quint32, QHash<quint64, quint64>> savedVersions; // Tile versions in the archive, by layer id
+
+    bool inline canEvict() const { return resident && !modified && !manifest.isEmpty(); }
+
+    void evict()
+    {
+        resident = false;
+        layers.clear();
+        scene.clear();
+        history.clear();
+        text.reset();
+        savedVersions.clear();
+    }
+};
@@ -0,0 +1,84 @@
+#include "PagePanel.h"
+
+#include "Canvas.h"
+#include <qinputdialog.h>
+
+PagePanel::PagePanel(QWidget* parent, Canvas* canvas) : QWidget(parent)
+{
+    this->canvas = canvas;
+
+    setLayout(mainLayout);
+    mainLayout->addWidget(list);
+    mainLayout->addLayout(buttonLayout);
+
+    buttonLayout->addWidget(addButton);
+    buttonLayout->addWidget(removeButton);
+    buttonLayout->addWidget(sectionButton);
+
+    connect(list, &QListWidget::currentRowChanged, this, [this](int row)
+        {
+            if (refreshing || row < 0) return;
+            if (pageAt(row) >= 0) this->canvas->showPage(pageAt(row));
+            else refresh(); // Headings can't be picked, back to the page that's shown
+        });
+    connect(list, &QListWidget::itemChanged, this, &PagePanel::onItemChanged);
+
+    connect(addButton,     &QPushButton::clicked, canvas, &Canvas::addPage);
+    connect(removeButton,  &QPushButton::clicked, this, [this]() { this->canvas->removePage(this->canvas->activePage); });
+    connect(sectionButton, &QPushButton::clicked, this, &PagePanel::editSection);
+
+    // Queued, the list can't be rebuilt from inside one of its own item signals
+    connect(canvas, &Canvas::pagesChanged, this, &PagePanel::refresh, Qt::QueuedConnection);
+    refresh();
+}
+
+int PagePanel::pageAt(int row) const
+{
+    const QListWidgetItem* item = list->item(row);
+    return item ? item->data(Qt::UserRole).toInt() : -1;
+}
+
+void PagePanel::refresh()
+{
+    refreshing = true;
+
+    list->clear();
+    QFont headingFont = list->font();
+    headingFont.setBold(true);
+    for (int i = 0; i < int(canvas->pages.size()); i++)
+    {
+        const Page& page = canvas->pages[i];
+        if (!page.section.isEmpty() && (i == 0 || canvas->pages[i - 1].section != page.section))
+        {
+            QListWidgetItem* heading = new QListWidgetItem(page.section);
+            heading->setFont(headingFont);
+            heading->setFlags(Qt::ItemIsEnabled);
+            heading->setData(Qt::UserRole, -1);
+            list->addItem(heading);
+        }
+
+        QListWidgetItem* item = new QListWidgetItem(page.title);
+        item->setFlags(item->flags() | Qt::ItemIsEditable);
+        item->setData(Qt::UserRole, i);
+        list->addItem(item);
+        if (i == canvas->activePage) list->setCurrentItem(item);
+    }
+    removeButton->setEnabled(canvas->pages.size() > 1);
+
+    refreshing = false;
+}
+
+void PagePanel::onItemChanged(QListWidgetItem* item)
+{
+    if (refreshing) return;
+    const int index = item->data(Qt::UserRole).toInt();
+    if (index >= 0 && item->text() != canvas->pages[index].title) canvas->renamePage(index, item->text());
+}
+
+void PagePanel::editSection()
+{
+    bool ok = false;
+    const QString section = QInputDialog::getText(this, "Section", "Section of this page:", QLineEdit::Normal,
+                                                  canvas->pages[canvas->activePage].section, &ok);
+    if (ok) canvas->setPageSection(canvas->activePage, section.trimmed());
+}
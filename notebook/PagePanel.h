@@ -0,0 +1,35 @@
+#pragma once
+
+#include <qwidget.h>
+#include <qlistwidget.h>
+#include <qpushbutton.h>
+#include <qlayout.h>
+
+class Canvas;
+
+// The notebook's pages in order, with a heading wherever the section changes.
+// Clicking a page shows it, double click renames it.
+class PagePanel : public QWidget
+{
+    Q_OBJECT
+
+public:
+    Canvas* canvas = nullptr;
+
+    QVBoxLayout* mainLayout    = new QVBoxLayout();
+    QHBoxLayout* buttonLayout  = new QHBoxLayout();
+    QListWidget* list          = new QListWidget();
+    QPushButton* addButton     = new QPushButton("+");
+    QPushButton* removeButton  = new QPushButton("-");
+    QPushButton* sectionButton = new QPushButton("Section...");
+
+    PagePanel(QWidget* parent, Canvas* canvas);
+    void refresh(); // Rebuilds the list from the canvas
+
+private:
+    bool refreshing = false; // Changes made by refresh aren't user edits
+
+    int pageAt(int row) const; // -1 for section headings
+    void onItemChanged(QListWidgetItem* item);
+    void editSection();
+};
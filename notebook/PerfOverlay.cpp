@@ -0,0 +1,88 @@
+#include "PerfOverlay.h"
+
+#include "Canvas.h"
+#include "Trace.h"
+#include <qpainter.h>
+#include <qfontdatabase.h>
+
+static QString megabytes(qint64 bytes) { return QString::number(bytes / (1024.0 * 1024.0), 'f', 1) + " MB"; }
+
+PerfOverlay::PerfOverlay(Canvas* canvas) : QWidget(canvas), canvas(canvas)
+{
+    setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    setAutoFillBackground(true);
+    setAttribute(Qt::WA_TransparentForMouseEvents);
+
+    QPalette colors = palette();
+    colors.setColor(QPalette::Window, QColor(32, 32, 32));
+    colors.setColor(QPalette::WindowText, QColor(220, 220, 220));
+    setPalette(colors);
+
+    refreshTimer.setInterval(500);
+    connect(&refreshTimer, &QTimer::timeout, this, [this]() { place(); update(); });
+    canvas->installEventFilter(this);
+    hide();
+}
+
+QStringList PerfOverlay::lines() const
+{
+    const RepaintScheduler& scheduler = *canvas->repaintScheduler;
+    const QSize size = canvas->layers.size();
+    QStringList out;
+    out << QString("frame   %1 ms avg  %2 ms max  %3/s")
+               .arg(scheduler.paintTimeMs(), 0, 'f', 2).arg(scheduler.maxPaintTimeMs(), 0, 'f', 2).arg(scheduler.paintsPerSecond(), 0, 'f', 0);
+    out << QString("paint   %1 kpx/frame  %2 Mpx/s")
+               .arg(scheduler.pixelsPerPaint() / 1e3, 0, 'f', 1).arg(scheduler.pixelsPerSecond() / 1e6, 0, 'f', 1);
+    // From the event's timestamp where the window system's clock can be read, from the handler otherwise
+    out << QString("input   %1 ms avg  %2 ms max  %3 to paint")
+               .arg(scheduler.inputLatencyMs(), 0, 'f', 2).arg(scheduler.maxInputLatencyMs(), 0, 'f', 2)
+               .arg(scheduler.latencyFromEvents() ? "event" : "handler");
+    out << QString("image   %1x%2  %3 layers  %4")
+               .arg(size.width()).arg(size.height()).arg(canvas->layers.count()).arg(megabytes(canvas->layers.layerMemoryUsage()));
+    int resident = 0;
+    for (const Page& page : canvas->pages) resident += page.resident ? 1 : 0;
+    out << QString("pages   %1 of %2 resident").arg(resident).arg(int(canvas->pages.size()));
+    out << QString("caches  composite %1  mips %2  undo %3")
+               .arg(megabytes(canvas->layers.cacheMemoryUsage())).arg(megabytes(canvas->mipMemoryUsage())).arg(megabytes(canvas->history.memoryUsage()));
+    out << QString("trace   %1").arg(Trace::enabled() ? "recording" : "off");
+    return out;
+}
+
+void PerfOverlay::paintEvent(QPaintEvent* event)
+{
+    QPainter painter(this);
+    const QStringList text = lines();
+    const int lineHeight = fontMetrics().height();
+    for (int i = 0; i < text.size(); i++) painter.drawText(6, 4 + fontMetrics().ascent() + i * lineHeight, text[i]);
+}
+
+void PerfOverlay::place()
+{
+    // Sized for the widest the numbers get, so it doesn't jitter as they change
+    const QFontMetrics metrics = fontMetrics();
+    const QStringList text = lines();
+    QSize wanted(12, 8 + metrics.height() * text.size());
+    for (const QString& line : text) wanted.setWidth(qMax(wanted.width(), metrics.horizontalAdvance(line) + 12));
+    wanted.setWidth(qMax(wanted.width(), width()));
+
+    const QRect view = canvas->viewport()->geometry();
+    setGeometry(QRect(QPoint(view.right() - wanted.width(), view.top()), wanted));
+    raise();
+}
+
+void PerfOverlay::showEvent(QShowEvent* event)
+{
+    place();
+    refreshTimer.start();
+}
+
+void PerfOverlay::hideEvent(QHideEvent* event)
+{
+    refreshTimer.stop();
+}
+
+bool PerfOverlay::eventFilter(QObject* watched, QEvent* event)
+{
+    if (watched == canvas && event->type() == QEvent::Resize && isVisible()) place();
+    return false;
+}
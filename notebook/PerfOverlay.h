@@ -0,0 +1,28 @@
+#pragma once
+
+#include <qwidget.h>
+#include <qtimer.h>
+
+class Canvas;
+
+// Frame time, paint area and memory in the canvas corner, for when a user says it's slow.
+// It's opaque and refreshes itself twice a second, so showing it doesn't repaint the canvas under it.
+class PerfOverlay : public QWidget
+{
+public:
+    Canvas* canvas = nullptr;
+
+    PerfOverlay(Canvas* canvas);
+
+protected:
+    void paintEvent(QPaintEvent* event) override;
+    void showEvent(QShowEvent* event)   override;
+    void hideEvent(QHideEvent* event)   override;
+    bool eventFilter(QObject* watched, QEvent* event) override;
+
+private:
+    QTimer refreshTimer;
+
+    QStringList lines() const;
+    void place(); // Top right of the viewport, clear of the scroll bar
+};
@@ -0,0 +1,176 @@
+#include "RepaintScheduler.h"
+#include <qevent.h>
+#include <qguiapplication.h>
+#include <qscreen.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static const qint64 maxEventAgeMs = 10000; // Anything older is a clock that doesn't match after all
+
+// Now in ms on the clock the platform plugin stamps input events with, -1 if it isn't one we know.
+// Qt hands the window system's timestamps through: GetMessageTime on Windows, seconds since boot on macOS,
+// and the X server's or the compositor's time on Linux, which is CLOCK_MONOTONIC when they're local.
+static qint64 eventClockMs()
+{
+    const QString platform = QGuiApplication::platformName();
+#if defined(_WIN32)
+    if (platform == "windows") return qint64(GetTickCount());
+#elif defined(__APPLE__)
+    if (platform == "cocoa") return qint64(clock_gettime_nsec_np(CLOCK_UPTIME_RAW) / 1000000);
+#elif defined(__linux__)
+    if (platform == "xcb" || platform.startsWith("wayland"))
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return qint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    return -1;
+}
+
+RepaintScheduler::RepaintScheduler(QWidget* target, QObject* parent) : QObject(parent), target(target)
+{
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+    connect(&timer, &QTimer::timeout, this, &RepaintScheduler::flush);
+    sinceFlush.start();
+    statsWindow.start();
+    clock.start();
+    eventClock = eventClockMs() >= 0;
+}
+
+void RepaintScheduler::invalidate(const QRect& rect)
+{
+    invalidate(QRegion(rect));
+}
+
+void RepaintScheduler::invalidate(const QRegion& region)
+{
+    const QRegion visible = region.intersected(target->rect());
+    if (visible.isEmpty()) return;
+
+    pending += visible;
+    schedule();
+}
+
+void RepaintScheduler::schedule()
+{
+    // Whatever comes in while frame() is being handled goes out with this same flush
+    if (timer.isActive() || flushing) return;
+    if (manualFrames) { frameWanted = true; return; }
+
+    // Line the flush up with the next frame boundary instead of painting as soon as possible
+    const int wait = frameInterval() - int(sinceFlush.elapsed());
+    timer.start(qMax(0, wait));
+}
+
+void RepaintScheduler::scroll(int dx, int dy)
+{
+    if (pending.isEmpty()) return;
+    pending.translate(dx, dy);
+    pending &= target->rect();
+}
+
+qint64 RepaintScheduler::inputTime(const QInputEvent* event)
+{
+    const qint64 handled = now();
+    if (!eventClock || event->timestamp() == 0) return handled; // Made up events, like replayed ones, have none
+
+    // Some platforms only have 32 bits of ms, the difference still comes out right across a wrap.
+    // It can come out a little negative too, the two clocks round differently.
+    const qint32 ageMs = qint32(quint32(eventClockMs()) - quint32(event->timestamp()));
+    if (ageMs > maxEventAgeMs) { eventClock = false; return handled; } // A remote X server, say
+    return handled - qint64(qMax(0, ageMs)) * 1000000;
+}
+
+void RepaintScheduler::noteInputDrawn(qint64 receivedAt)
+{
+    if (inputWaiting < 0 || receivedAt < inputWaiting) inputWaiting = receivedAt;
+}
+
+void RepaintScheduler::notePaint(const QRegion& region, qint64 paintNs)
+{
+    qint64 pixels = 0;
+    for (const QRect& r : region) pixels += qint64(r.width()) * r.height();
+
+    paintCount++;
+    pixelCount += pixels;
+    windowPaints++;
+    windowPixels += pixels;
+    windowPaintNs += paintNs;
+    windowPaintMaxNs = qMax(windowPaintMaxNs, paintNs);
+
+    if (inputWaiting >= 0)
+    {
+        const qint64 latency = now() - inputWaiting;
+        windowLatencySum += latency;
+        windowLatencyMax = qMax(windowLatencyMax, latency);
+        windowLatencyCount++;
+        inputWaiting = -1;
+    }
+    rollStats();
+}
+
+void RepaintScheduler::rollStats() const
+{
+    // Also called from the getters, so an idle canvas reads as zero instead of the last busy second
+    const qint64 elapsed = statsWindow.elapsed();
+    if (elapsed >= 1000)
+    {
+        paintsPerSec = windowPaints * 1000.0 / elapsed;
+        pixelsPerSec = windowPixels * 1000.0 / elapsed;
+        latencyAvgMs = windowLatencyCount ? windowLatencySum / 1e6 / windowLatencyCount : 0;
+        latencyMaxMs = windowLatencyMax / 1e6;
+        paintAvgMs   = windowPaints ? windowPaintNs / 1e6 / windowPaints : 0;
+        paintMaxMs   = windowPaintMaxNs / 1e6;
+        windowPaints = 0;
+        windowPixels = 0;
+        windowLatencySum = 0;
+        windowLatencyMax = 0;
+        windowLatencyCount = 0;
+        windowPaintNs = 0;
+        windowPaintMaxNs = 0;
+        statsWindow.restart();
+    }
+}
+
+int RepaintScheduler::frameInterval() const
+{
+    const QScreen* screen = target->screen();
+    const qreal hz = (screen != nullptr && screen->refreshRate() > 1) ? screen->refreshRate() : 60.0;
+    return qRound(1000.0 / hz);
+}
+
+void RepaintScheduler::setManualFrames(bool on)
+{
+    manualFrames = on;
+    if (on && timer.isActive()) { timer.stop(); frameWanted = true; }
+    if (!on && frameWanted) { frameWanted = false; schedule(); }
+}
+
+void RepaintScheduler::flushNow()
+{
+    timer.stop();
+    frameWanted = false;
+    flush();
+}
+
+void RepaintScheduler::flush()
+{
+    flushing = true;
+    emit frame();
+    flushing = false;
+    sinceFlush.restart();
+    if (pending.isEmpty()) return;
+
+    // A replay times the frame, so it has to be painted by the time this returns
+    const QRegion region = pending;
+    pending = QRegion();
+    if (manualFrames) target->repaint(region);
+    else target->update(region);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <qobject.h>
+#include <qwidget.h>
+#include <qregion.h>
+#include <qtimer.h>
+#include <qelapsedtimer.h>
+
+class QInputEvent;
+
+// Collects dirty rects from tools and flushes them at most once per display frame.
+// If nothing gets invalidated nothing gets scheduled, so an idle canvas doesn't repaint at all.
+class RepaintScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    RepaintScheduler(QWidget* target, QObject* parent = nullptr);
+
+    void invalidate(const QRect& rect);
+    void invalidate(const QRegion& region);
+    void invalidateAll() { invalidate(target->rect()); }
+
+    // The target's contents got scrolled by (dx, dy), anything pending moves with them
+    void scroll(int dx, int dy);
+
+    // Asks for a frame signal without dirtying anything, for tools that buffer input until then
+    void requestFrame() { schedule(); }
+
+    // Replays step frames themselves, so they land between the same inputs every run.
+    // While this is on nothing is timed, flushNow does the frame and paints before it returns.
+    void setManualFrames(bool on);
+    bool inline framePending() const { return timer.isActive() || frameWanted; }
+    void flushNow();
+
+    // Input latency: a tool says when its oldest not yet drawn input came in,
+    // the next paint after that closes the sample. Times come from now().
+    // inputTime gives an event's time from its timestamp, so the time it spent queued before the handler counts too.
+    // That needs the clock the window system stamps events with, without it (or without a timestamp) it's the time
+    // the handler ran. latencyFromEvents says which of the two the numbers are.
+    qint64 inline now() const { return clock.nsecsElapsed(); }
+    qint64 inputTime(const QInputEvent* event);
+    bool inline latencyFromEvents() const { return eventClock; }
+    void noteInputDrawn(qint64 receivedAt);
+
+    // Call from the target's paintEvent so the counters see every paint, not just ours.
+    // paintNs is how long the paint took, from now() at its start.
+    void notePaint(const QRegion& region, qint64 paintNs);
+
+    double inline paintsPerSecond() const { rollStats(); return paintsPerSec; }
+    double inline pixelsPerSecond() const { rollStats(); return pixelsPerSec; }
+    quint64 inline totalPaints()    const { return paintCount; }
+    quint64 inline totalPixels()    const { return pixelCount; }
+    double inline inputLatencyMs()    const { rollStats(); return latencyAvgMs; }
+    double inline maxInputLatencyMs() const { rollStats(); return latencyMaxMs; }
+    double inline paintTimeMs()       const { rollStats(); return paintAvgMs; }
+    double inline maxPaintTimeMs()    const { rollStats(); return paintMaxMs; }
+    double inline pixelsPerPaint()    const { rollStats(); return paintsPerSec > 0 ? pixelsPerSec / paintsPerSec : 0; }
+
+signals:
+    // Emitted right before the pending region is handed to Qt, tools can batch their work on this
+    void frame();
+
+private:
+    QWidget* target;
+    QRegion  pending;
+    QTimer   timer;
+    QElapsedTimer sinceFlush;
+    QElapsedTimer clock;
+    bool     flushing = false;
+    bool     manualFrames = false;
+    bool     frameWanted  = false; // Manual frames only
+    qint64   inputWaiting = -1;
+    bool     eventClock = false; // Event timestamps are on a clock we can read too
+
+    // Counters, rolled over once a second
+    mutable QElapsedTimer statsWindow;
+    mutable int     windowPaints = 0;
+    mutable qint64  windowPixels = 0;
+    mutable double  paintsPerSec = 0;
+    mutable double  pixelsPerSec = 0;
+    mutable qint64  windowLatencySum = 0;
+    mutable qint64  windowLatencyMax = 0;
+    mutable int     windowLatencyCount = 0;
+    mutable double  latencyAvgMs = 0;
+    mutable double  latencyMaxMs = 0;
+    mutable qint64  windowPaintNs    = 0;
+    mutable qint64  windowPaintMaxNs = 0;
+    mutable double  paintAvgMs = 0;
+    mutable double  paintMaxMs = 0;
+    quint64 paintCount   = 0;
+    quint64 pixelCount   = 0;
+
+    int frameInterval() const;
+    void schedule();
+    void rollStats() const;
+    void flush();
+};
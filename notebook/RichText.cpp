@@ -0,0 +1,205 @@
+#include "RichText.h"
+
+#include <qtextobject.h>
+#include <qjsondocument.h>
+#include <qjsonarray.h>
+#include <qelapsedtimer.h>
+#include <qbrush.h>
+#include <qpen.h>
+#include <qset.h>
+
+static QJsonArray encodeProperties(const QTextFormat& format)
+{
+    QJsonArray out;
+    const QMap<int, QVariant> properties = format.properties();
+    for (auto it = properties.constBegin(); it != properties.constEnd(); ++it)
+    {
+        if (it.key() == QTextFormat::ObjectIndex) continue; // Lists get put back together from the blocks
+
+        const QVariant& value = it.value();
+        QString kind;
+        QJsonValue encoded;
+        switch (value.userType())
+        {
+        case QMetaType::Bool:        kind = "b";  encoded = value.toBool();   break;
+        case QMetaType::Int:         kind = "i";  encoded = value.toInt();    break;
+        case QMetaType::Double:      kind = "d";  encoded = value.toDouble(); break;
+        case QMetaType::QString:     kind = "s";  encoded = value.toString(); break;
+        case QMetaType::QStringList: kind = "sl"; encoded = QJsonArray::fromStringList(value.toStringList()); break;
+        case QMetaType::QColor:      kind = "c";  encoded = value.value<QColor>().name(QColor::HexArgb); break;
+        case QMetaType::QBrush:
+            {
+                const QBrush brush = value.value<QBrush>();
+                if (brush.style() > Qt::DiagCrossPattern) continue; // Gradients and textures don't fit in a line
+                kind = "br";
+                encoded = QJsonArray { int(brush.style()), brush.color().name(QColor::HexArgb) };
+                break;
+            }
+        case QMetaType::QPen:
+            {
+                const QPen pen = value.value<QPen>();
+                kind = "pen";
+                encoded = QJsonArray { pen.widthF(), int(pen.style()), pen.color().name(QColor::HexArgb) };
+                break;
+            }
+        default: continue; // Table column widths and such
+        }
+        out.append(QJsonArray { it.key(), kind, encoded });
+    }
+    return out;
+}
+
+static QVariant decodeProperty(const QString& kind, const QJsonValue& value)
+{
+    if (kind == "b")  return value.toBool();
+    if (kind == "i")  return value.toInt();
+    if (kind == "d")  return value.toDouble();
+    if (kind == "s")  return value.toString();
+    if (kind == "sl") return value.toVariant().toStringList();
+    if (kind == "c")  return QColor(value.toString());
+    if (kind == "br")
+    {
+        const QJsonArray parts = value.toArray();
+        return QBrush(QColor(parts.at(1).toString()), Qt::BrushStyle(parts.at(0).toInt()));
+    }
+    if (kind == "pen")
+    {
+        const QJsonArray parts = value.toArray();
+        return QPen(QBrush(QColor(parts.at(2).toString())), parts.at(0).toDouble(), Qt::PenStyle(parts.at(1).toInt()));
+    }
+    return QVariant();
+}
+
+static bool writeLine(QIODevice& out, const QJsonObject& line)
+{
+    return out.write(QJsonDocument(line).toJson(QJsonDocument::Compact)) >= 0 && out.write("\n", 1) == 1;
+}
+
+bool RichText::write(const QTextDocument& document, QIODevice& out)
+{
+    const QVector<QTextFormat> all = document.allFormats();
+    QSet<int> written;
+    auto writeFormat = [&](int index)
+        {
+            if (index < 0 || index >= all.size() || written.contains(index)) return true;
+            written.insert(index);
+
+            QJsonObject line;
+            line["f"] = index;
+            line["k"] = all[index].type();
+            line["p"] = encodeProperties(all[index]);
+            return writeLine(out, line);
+        };
+
+    for (QTextBlock block = document.begin(); block.isValid(); block = block.next())
+    {
+        if (!writeFormat(block.blockFormatIndex()) || !writeFormat(block.charFormatIndex())) return false;
+
+        QJsonArray runs;
+        for (QTextBlock::iterator it = block.begin(); !it.atEnd(); ++it)
+        {
+            const QTextFragment fragment = it.fragment();
+            if (!writeFormat(fragment.charFormatIndex())) return false;
+            runs.append(fragment.length());
+            runs.append(fragment.charFormatIndex());
+        }
+
+        QJsonObject line;
+        line["t"] = block.text();
+        line["b"] = block.blockFormatIndex();
+        line["c"] = block.charFormatIndex();
+        if (!runs.isEmpty()) line["r"] = runs;
+        if (const QTextList* list = block.textList())
+        {
+            if (!writeFormat(list->formatIndex())) return false;
+            line["l"] = QJsonArray { list->objectIndex(), list->formatIndex() };
+        }
+        if (!writeLine(out, line)) return false;
+    }
+    return true;
+}
+
+bool RichText::writePlain(const QTextDocument& document, QIODevice& out)
+{
+    for (QTextBlock block = document.begin(); block.isValid(); block = block.next())
+    {
+        if (block != document.begin() && out.write("\n", 1) != 1) return false;
+        if (out.write(block.text().toUtf8()) < 0) return false;
+    }
+    return true;
+}
+
+RichTextReader::RichTextReader(const std::shared_ptr<MappedArchive>& archive, const QString& entry)
+    : bytes(archive->read(entry))
+{
+}
+
+void RichTextReader::readInto(QTextDocument* document, int maxBlocks, int budgetMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // One edit block per call, so the layout catches up once instead of after every block
+    QTextCursor cursor(document);
+    cursor.movePosition(QTextCursor::End);
+    cursor.beginEditBlock();
+
+    int blocks = 0;
+    while (!atEnd() && blocks < maxBlocks && (budgetMs < 0 || timer.elapsed() < budgetMs))
+    {
+        int end = bytes.indexOf('\n', pos);
+        if (end < 0) end = bytes.size();
+        const QJsonObject line = QJsonDocument::fromJson(QByteArray::fromRawData(bytes.constData() + pos, end - pos)).object();
+        pos = end + 1;
+
+        if (line.contains("f"))
+        {
+            QTextFormat format(line.value("k").toInt());
+            for (const QJsonValue& value : line.value("p").toArray())
+            {
+                const QJsonArray property = value.toArray();
+                const QVariant decoded = decodeProperty(property.at(1).toString(), property.at(2));
+                if (decoded.isValid()) format.setProperty(property.at(0).toInt(), decoded);
+            }
+            formats.insert(line.value("f").toInt(), format);
+        }
+        else if (line.contains("t"))
+        {
+            readBlock(cursor, line);
+            blocks++;
+        }
+    }
+    cursor.endEditBlock();
+}
+
+void RichTextReader::readBlock(QTextCursor& cursor, const QJsonObject& line)
+{
+    const QTextCharFormat blockCharFormat = formats.value(line.value("c").toInt(-1), QTextCharFormat()).toCharFormat();
+    const QTextBlockFormat blockFormat    = formats.value(line.value("b").toInt(-1), QTextBlockFormat()).toBlockFormat();
+    if (firstBlock)
+    {
+        cursor.setBlockFormat(blockFormat);
+        cursor.setBlockCharFormat(blockCharFormat);
+        firstBlock = false;
+    }
+    else cursor.insertBlock(blockFormat, blockCharFormat);
+
+    const QJsonArray list = line.value("l").toArray();
+    if (list.size() == 2)
+    {
+        QPointer<QTextList>& textList = lists[list.at(0).toInt()];
+        if (textList) textList->add(cursor.block());
+        else textList = cursor.createList(formats.value(list.at(1).toInt(), QTextListFormat()).toListFormat());
+    }
+
+    const QString text = line.value("t").toString();
+    const QJsonArray runs = line.value("r").toArray();
+    int at = 0;
+    for (int i = 0; i + 1 < runs.size() && at < text.size(); i += 2)
+    {
+        const int length = qMin(runs.at(i).toInt(), text.size() - at);
+        cursor.insertText(text.mid(at, length), formats.value(runs.at(i + 1).toInt(), QTextCharFormat()).toCharFormat());
+        at += length;
+    }
+    if (at < text.size()) cursor.insertText(text.mid(at), blockCharFormat);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <qtextdocument.h>
+#include <qtextcursor.h>
+#include <qtextlist.h>
+#include <qiodevice.h>
+#include <qjsonobject.h>
+#include <qpointer.h>
+#include <qhash.h>
+#include <memory>
+#include "MappedArchive.h"
+
+// The text in .nb files with its formatting, one JSON object per line so it goes out and comes back a block at a time:
+//
+//   {"f":3,"k":1,"p":[[id,"i",12],...]}            A format, before the first block that uses it. k is QTextFormat::type(),
+//                                                   p its properties as [QTextFormat property id, kind, value]
+//   {"t":"Text","b":2,"c":3,"r":[4,5,1,7],"l":[9,4]} A block: text, block format, block char format, runs of
+//                                                   (length, char format) and the list it's in with that list's format
+//
+// Lists come back as lists, tables and frames don't, their cells load as plain blocks one after another.
+// Images keep their name but not the resource.
+struct RichText
+{
+    // Both go block by block, nothing the size of the whole text gets made
+    static bool write(const QTextDocument& document, QIODevice& out);
+    static bool writePlain(const QTextDocument& document, QIODevice& out); // UTF-8, a line per block
+};
+
+// Builds a document up from what RichText::write made, a few blocks per call,
+// so the first screen can show before the rest of the text is parsed
+class RichTextReader
+{
+public:
+    RichTextReader(const std::shared_ptr<MappedArchive>& archive, const QString& entry);
+
+    bool inline atEnd() const { return pos >= bytes.size(); }
+
+    // Appends up to maxBlocks blocks to the end of document, stopping early once budgetMs is up (-1 for no limit).
+    // The first call fills in the document's first block instead of adding one, so it should start out empty.
+    void readInto(QTextDocument* document, int maxBlocks, int budgetMs = -1);
+
+private:
+    QByteArray bytes;
+    int  pos = 0;
+    bool firstBlock = true;
+
+    QHash<int, QTextFormat>         formats; // By the index they were written with
+    QHash<int, QPointer<QTextList>> lists;   // Same, for the lists blocks were in
+
+    void readBlock(QTextCursor& cursor, const QJsonObject& line);
+};
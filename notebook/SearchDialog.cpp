@@ -0,0 +1,76 @@
+#include "SearchDialog.h"
+
+#include <qdir.h>
+#include <qfileinfo.h>
+#include <qfiledialog.h>
+#include <qelapsedtimer.h>
+
+SearchDialog::SearchDialog(QWidget* parent) : QDialog(parent)
+{
+    setWindowTitle("Search Notebooks");
+    resize(560, 480);
+
+    setLayout(mainLayout);
+    mainLayout->addLayout(folderLayout);
+    mainLayout->addWidget(queryEdit);
+    mainLayout->addWidget(results);
+    mainLayout->addWidget(statusLabel);
+
+    folderLayout->addWidget(folderButton);
+    folderLayout->addWidget(folderLabel, 1);
+    queryEdit->setPlaceholderText("Search");
+    queryEdit->setClearButtonEnabled(true);
+    results->setWordWrap(true);
+    results->setAlternatingRowColors(true);
+
+    connect(folderButton, &QPushButton::clicked, this, &SearchDialog::chooseFolder);
+    connect(queryEdit, &QLineEdit::textChanged, this, &SearchDialog::runQuery);
+    connect(results, &QListWidget::itemActivated, this, [this](QListWidgetItem* item)
+        {
+            emit openHit(item->data(Qt::UserRole).toString(), item->data(Qt::UserRole + 1).toUInt());
+        });
+
+    // Both come from the indexing thread
+    connect(&index, &SearchIndex::progress, this, [this](int done, int total)
+        {
+            statusLabel->setText(QString("Indexing %1 of %2 files...").arg(done).arg(total));
+        }, Qt::QueuedConnection);
+    connect(&index, &SearchIndex::indexed, this, &SearchDialog::runQuery, Qt::QueuedConnection);
+
+    index.setDirectory(QDir::currentPath());
+    folderLabel->setText(QDir::toNativeSeparators(index.directory()));
+}
+
+void SearchDialog::runQuery()
+{
+    QElapsedTimer timer;
+    timer.start();
+    const std::vector<SearchHit> hits = index.search(queryEdit->text());
+    const qint64 elapsed = timer.elapsed();
+
+    results->clear();
+    for (const SearchHit& hit : hits)
+    {
+        const QString title = hit.pageTitle.isEmpty() ? QString("Page") : hit.pageTitle;
+        QListWidgetItem* item = new QListWidgetItem(QFileInfo(hit.path).completeBaseName() + " - " + title + "\n" + hit.snippet);
+        item->setToolTip(QDir::toNativeSeparators(hit.path));
+        item->setData(Qt::UserRole, hit.path);
+        item->setData(Qt::UserRole + 1, hit.pageId);
+        results->addItem(item);
+    }
+
+    if (queryEdit->text().trimmed().isEmpty())
+        statusLabel->setText(QString("%1 pages in %2 notebooks").arg(index.documentCount()).arg(index.fileCount()));
+    else
+        statusLabel->setText(QString("%1 hits in %2 ms").arg(hits.size()).arg(elapsed));
+    if (index.isIndexing()) statusLabel->setText(statusLabel->text() + ", indexing...");
+}
+
+void SearchDialog::chooseFolder()
+{
+    const QString dir = QFileDialog::getExistingDirectory(this, "Search Notebooks In", index.directory());
+    if (dir.isEmpty()) return;
+    index.setDirectory(dir);
+    folderLabel->setText(QDir::toNativeSeparators(index.directory()));
+    runQuery();
+}
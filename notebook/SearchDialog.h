@@ -0,0 +1,36 @@
+#pragma once
+
+#include <qdialog.h>
+#include <qlineedit.h>
+#include <qlistwidget.h>
+#include <qpushbutton.h>
+#include <qlabel.h>
+#include <qlayout.h>
+#include "SearchIndex.h"
+
+// Searches the text of every notebook under a folder, results update as you type.
+// Activating a result asks for that page to be opened.
+class SearchDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    SearchIndex index;
+
+    QVBoxLayout* mainLayout   = new QVBoxLayout();
+    QHBoxLayout* folderLayout = new QHBoxLayout();
+    QPushButton* folderButton = new QPushButton("Folder...");
+    QLabel*      folderLabel  = new QLabel();
+    QLineEdit*   queryEdit    = new QLineEdit();
+    QListWidget* results      = new QListWidget();
+    QLabel*      statusLabel  = new QLabel();
+
+    SearchDialog(QWidget* parent);
+
+signals:
+    void openHit(const QString& path, quint32 pageId);
+
+private:
+    void runQuery();
+    void chooseFolder();
+};
@@ -0,0 +1,513 @@
+#include "SearchIndex.h"
+
+#include "MappedArchive.h"
+#include "NotebookFile.h"
+#include "Trace.h"
+#include <qdir.h>
+#include <qdiriterator.h>
+#include <qdatetime.h>
+#include <qfile.h>
+#include <qsavefile.h>
+#include <qdatastream.h>
+#include <qstandardpaths.h>
+#include <qcryptographichash.h>
+#include <algorithm>
+#include <cmath>
+
+static const quint32 indexMagic    = 0x5853424e; // "NBSX"
+static const quint16 indexVersion  = 1;
+static const int     maxWordLength = 64; // Longer runs are base64 and such, nobody searches for those
+
+// Calls func with every word in text, case folded
+template<typename Func>
+static void forEachWord(const QString& text, Func&& func)
+{
+    int start = -1;
+    for (int i = 0; i <= text.size(); i++)
+    {
+        if (i < text.size() && text.at(i).isLetterOrNumber())
+        {
+            if (start < 0) start = i;
+            continue;
+        }
+        if (start >= 0 && i - start <= maxWordLength) func(text.mid(start, i - start).toCaseFolded());
+        start = -1;
+    }
+}
+
+QStringList SearchIndex::words(const QString& text)
+{
+    QStringList out;
+    forEachWord(text, [&](const QString& word) { out << word; });
+    return out;
+}
+
+// Some text around the first place one of the terms starts a word, on one line
+static QString snippetOf(const QString& text, const QStringList& terms)
+{
+    const int width = 120;
+    int at = -1;
+    for (const QString& term : terms)
+    {
+        for (int from = 0;;)
+        {
+            const int found = text.indexOf(term, from, Qt::CaseInsensitive);
+            if (found < 0 || (at >= 0 && found >= at)) break;
+            if (found == 0 || !text.at(found - 1).isLetterOrNumber()) { at = found; break; }
+            from = found + 1;
+        }
+    }
+
+    const int start = qMax(0, at - width / 4);
+    QString out = text.mid(start, width).simplified();
+    if (start > 0) out.prepend("...");
+    if (start + width < text.size()) out.append("...");
+    return out;
+}
+
+SearchIndex::SearchIndex(QObject* parent) : QObject(parent)
+{
+    worker.setMaxThreadCount(1);
+    connect(&watcher, &QFileSystemWatcher::directoryChanged, this, [this]() { refresh(); });
+}
+
+SearchIndex::~SearchIndex()
+{
+    stopping = true;
+    worker.waitForDone();
+}
+
+void SearchIndex::setDirectory(const QString& dir)
+{
+    const QString absolute = QDir(dir).absolutePath();
+    if (absolute == root) { refresh(); return; }
+
+    // The worker reads root and indexPath without the lock, it has to be idle before they change
+    stopping = true;
+    worker.waitForDone();
+    stopping = false;
+
+    if (!root.isEmpty()) watcher.removePath(root);
+    {
+        QWriteLocker locker(&lock);
+        docs.clear();
+        filePaths.clear();
+        fileIds.clear();
+        files.clear();
+        postings.clear();
+        totalLength = 0;
+        liveDocs = 0;
+        deadDocs = 0;
+    }
+
+    root = absolute;
+    const QByteArray key = QCryptographicHash::hash(root.toUtf8(), QCryptographicHash::Sha1).toHex().left(16);
+    indexPath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/search-" + QString::fromLatin1(key) + ".idx";
+
+    // Only the top directory is watched, changes further down get picked up by the next refresh
+    watcher.addPath(root);
+    needsLoad = true;
+    refresh();
+}
+
+void SearchIndex::refresh()
+{
+    rescan = true;
+    if (root.isEmpty() || running.exchange(true)) return;
+    worker.start(QRunnable::create([this]() { work(); }));
+}
+
+int SearchIndex::documentCount() const
+{
+    QReadLocker locker(&lock);
+    return liveDocs;
+}
+
+int SearchIndex::fileCount() const
+{
+    QReadLocker locker(&lock);
+    return files.size();
+}
+
+void SearchIndex::work()
+{
+    for (;;)
+    {
+        if (needsLoad.exchange(false)) load();
+
+        bool changed = false;
+        while (!stopping && rescan.exchange(false)) changed = scanOnce() || changed;
+        if (stopping) { running = false; return; }
+        if (changed) save();
+        emit indexed();
+
+        // A refresh that came in after the loop last looked would otherwise be lost
+        running = false;
+        if (!rescan || running.exchange(true)) return;
+    }
+}
+
+bool SearchIndex::scanOnce()
+{
+    TRACE_SCOPE("SearchIndex::scan");
+
+    QHash<QString, QPair<qint64, qint64>> found; // Modified and size, by path
+    QDirIterator it(root, QStringList() << "*.nb", QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext() && !stopping)
+    {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        found.insert(info.absoluteFilePath(), qMakePair(info.lastModified().toMSecsSinceEpoch(), info.size()));
+    }
+    if (stopping) return false;
+
+    QStringList changed, gone;
+    {
+        QReadLocker locker(&lock);
+        for (auto f = found.constBegin(); f != found.constEnd(); ++f)
+        {
+            auto record = files.constFind(f.key());
+            if (record == files.constEnd() || record->modified != f.value().first || record->size != f.value().second) changed << f.key();
+        }
+        for (auto f = files.constBegin(); f != files.constEnd(); ++f)
+        {
+            if (!found.contains(f.key())) gone << f.key();
+        }
+    }
+    if (!gone.isEmpty())
+    {
+        QWriteLocker locker(&lock);
+        for (const QString& path : gone) removeFile(path);
+    }
+
+    struct PageWords
+    {
+        quint32 pageId;
+        QString manifest;
+        QString title;
+        quint32 length = 0;
+        QHash<QString, quint32> counts;
+    };
+
+    for (int i = 0; i < changed.size() && !stopping; i++)
+    {
+        const QString& path = changed[i];
+
+        // Read and counted without the lock, queries only wait for the merge. A file that can't be read
+        // still gets a record with nothing in it, so it isn't tried again until it changes.
+        std::vector<PageWords> pages;
+        if (std::shared_ptr<MappedArchive> archive = MappedArchive::open(path))
+        {
+            LoadedNotebook index;
+            if (NotebookFile::readIndex(*archive, index))
+            {
+                for (const PageEntry& entry : index.pages)
+                {
+                    PageWords page;
+                    page.pageId   = entry.id;
+                    page.manifest = entry.manifest;
+                    page.title    = entry.title;
+                    forEachWord(NotebookFile::readPageText(*archive, entry.manifest), [&](const QString& word)
+                        {
+                            page.counts[word]++;
+                            page.length++;
+                        });
+                    pages.push_back(std::move(page));
+                }
+            }
+        }
+
+        QWriteLocker locker(&lock);
+        removeFile(path);
+        int fileId = fileIds.value(path, -1);
+        if (fileId < 0)
+        {
+            fileId = filePaths.size();
+            filePaths << path;
+            fileIds.insert(path, fileId);
+        }
+
+        FileRecord& record = files[path];
+        record.modified = found.value(path).first;
+        record.size     = found.value(path).second;
+        for (const PageWords& page : pages)
+        {
+            const int doc = int(docs.size());
+            Document entry;
+            entry.file     = fileId;
+            entry.pageId   = page.pageId;
+            entry.manifest = page.manifest;
+            entry.title    = page.title;
+            entry.length   = page.length;
+            docs.push_back(entry);
+            record.docs.push_back(doc);
+
+            for (auto word = page.counts.constBegin(); word != page.counts.constEnd(); ++word) postings[word.key()].push_back({ doc, word.value() });
+            totalLength += page.length;
+            liveDocs++;
+        }
+        locker.unlock();
+
+        if (i % 64 == 63 || i + 1 == changed.size()) emit progress(i + 1, changed.size());
+    }
+
+    QWriteLocker locker(&lock);
+    if (deadDocs > 1024 && deadDocs > liveDocs / 4) compact();
+    return !changed.isEmpty() || !gone.isEmpty();
+}
+
+void SearchIndex::removeFile(const QString& path)
+{
+    auto it = files.find(path);
+    if (it == files.end()) return;
+    for (int doc : it->docs)
+    {
+        docs[doc].live = false;
+        totalLength -= docs[doc].length;
+        liveDocs--;
+        deadDocs++;
+    }
+    files.erase(it);
+}
+
+void SearchIndex::compact()
+{
+    TRACE_SCOPE("SearchIndex::compact");
+
+    std::vector<int> remap(docs.size(), -1);
+    std::vector<Document> kept;
+    QStringList keptPaths;
+    QHash<QString, int> keptIds;
+    for (int i = 0; i < int(docs.size()); i++)
+    {
+        if (!docs[i].live) continue;
+        remap[i] = int(kept.size());
+
+        Document doc = docs[i];
+        const QString& path = filePaths[doc.file];
+        auto id = keptIds.constFind(path);
+        if (id == keptIds.constEnd())
+        {
+            id = keptIds.insert(path, keptPaths.size());
+            keptPaths << path;
+        }
+        doc.file = id.value();
+        kept.push_back(doc);
+    }
+
+    for (auto it = postings.begin(); it != postings.end();)
+    {
+        std::vector<Posting>& list = it.value();
+        size_t out = 0;
+        for (const Posting& posting : list)
+        {
+            if (remap[posting.doc] >= 0) list[out++] = { remap[posting.doc], posting.count };
+        }
+        list.resize(out);
+        if (list.empty()) it = postings.erase(it);
+        else ++it;
+    }
+    for (FileRecord& record : files)
+    {
+        for (int& doc : record.docs) doc = remap[doc];
+    }
+
+    docs.swap(kept);
+    filePaths = keptPaths;
+    fileIds   = keptIds;
+    deadDocs  = 0;
+}
+
+std::vector<SearchHit> SearchIndex::search(const QString& query, int limit) const
+{
+    TRACE_SCOPE("SearchIndex::search");
+    std::vector<SearchHit> hits;
+    const QStringList terms = words(query);
+    if (terms.isEmpty()) return hits;
+    const bool prefixLast = query.at(query.size() - 1).isLetterOrNumber();
+
+    std::vector<QString> manifests;
+    {
+        QReadLocker locker(&lock);
+        if (liveDocs == 0) return hits;
+
+        // BM25
+        const double k1 = 1.2, b = 0.75;
+        const double averageLength = qMax(1.0, double(totalLength) / liveDocs);
+        QHash<int, double> scores;
+        auto score = [&](const std::vector<Posting>& list, double weight)
+            {
+                // Tombstones count towards how common a word is until the next compaction, close enough
+                const double df  = double(list.size());
+                const double idf = qMax(0.01, std::log(1 + (liveDocs - df + 0.5) / (df + 0.5)));
+                for (const Posting& posting : list)
+                {
+                    const Document& doc = docs[posting.doc];
+                    if (!doc.live) continue;
+                    const double tf = posting.count;
+                    scores[posting.doc] += weight * idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * doc.length / averageLength));
+                }
+            };
+
+        for (int t = 0; t < terms.size(); t++)
+        {
+            const QString& term = terms[t];
+            if (t + 1 < terms.size() || !prefixLast)
+            {
+                auto it = postings.constFind(term);
+                if (it != postings.constEnd()) score(it.value(), 1);
+                continue;
+            }
+
+            // Still being typed, every word it starts counts a bit less than the word itself.
+            // Capped so a single letter stays quick.
+            int expanded = 0;
+            for (auto it = postings.lowerBound(term); it != postings.constEnd() && it.key().startsWith(term) && expanded < 64; ++it, ++expanded)
+                score(it.value(), it.key() == term ? 1 : 0.7);
+        }
+
+        std::vector<std::pair<double, int>> ranked;
+        ranked.reserve(scores.size());
+        for (auto it = scores.constBegin(); it != scores.constEnd(); ++it) ranked.emplace_back(it.value(), it.key());
+        const size_t count = qMin(size_t(qMax(0, limit)), ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+            [](const std::pair<double, int>& a, const std::pair<double, int>& b) { return a.first > b.first; });
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const Document& doc = docs[ranked[i].second];
+            SearchHit hit;
+            hit.path      = filePaths[doc.file];
+            hit.pageId    = doc.pageId;
+            hit.pageTitle = doc.title;
+            hit.score     = ranked[i].first;
+            hits.push_back(hit);
+            manifests.push_back(doc.manifest);
+        }
+    }
+
+    // Snippets come out of the files themselves, only for the hits that get shown.
+    // Hits are mostly a few pages of the same file, it's only opened once for those in a row.
+    std::shared_ptr<MappedArchive> archive;
+    for (size_t i = 0; i < hits.size(); i++)
+    {
+        if (!archive || archive->filePath() != QFileInfo(hits[i].path).absoluteFilePath()) archive = MappedArchive::open(hits[i].path);
+        if (archive) hits[i].snippet = snippetOf(NotebookFile::readPageText(*archive, manifests[i]), terms);
+    }
+    return hits;
+}
+
+bool SearchIndex::load()
+{
+    TRACE_SCOPE("SearchIndex::load");
+    QFile file(indexPath);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream in(&file);
+    quint32 magic = 0;
+    quint16 version = 0;
+    QString indexedRoot;
+    in >> magic >> version >> indexedRoot;
+    if (magic != indexMagic || version != indexVersion || indexedRoot != root) return false;
+
+    QHash<QString, FileRecord> newFiles;
+    quint32 fileCount = 0;
+    in >> fileCount;
+    for (quint32 i = 0; i < fileCount && in.status() == QDataStream::Ok; i++)
+    {
+        QString path;
+        FileRecord record;
+        in >> path >> record.modified >> record.size;
+        newFiles.insert(path, record);
+    }
+
+    QStringList newPaths;
+    in >> newPaths;
+
+    std::vector<Document> newDocs;
+    quint64 newLength = 0;
+    int live = 0, dead = 0;
+    quint32 docCount = 0;
+    in >> docCount;
+    for (quint32 i = 0; i < docCount && in.status() == QDataStream::Ok; i++)
+    {
+        Document doc;
+        in >> doc.file >> doc.pageId >> doc.manifest >> doc.title >> doc.length >> doc.live;
+        if (doc.file < 0 || doc.file >= newPaths.size()) return false;
+
+        auto record = newFiles.find(newPaths[doc.file]);
+        if (doc.live && record != newFiles.end())
+        {
+            record->docs.push_back(int(newDocs.size()));
+            newLength += doc.length;
+            live++;
+        }
+        else
+        {
+            doc.live = false;
+            dead++;
+        }
+        newDocs.push_back(doc);
+    }
+
+    QMap<QString, std::vector<Posting>> newPostings;
+    quint32 termCount = 0;
+    in >> termCount;
+    for (quint32 i = 0; i < termCount && in.status() == QDataStream::Ok; i++)
+    {
+        QString term;
+        quint32 count = 0;
+        in >> term >> count;
+        std::vector<Posting>& list = newPostings[term];
+        list.reserve(qMin(count, docCount));
+        for (quint32 j = 0; j < count && in.status() == QDataStream::Ok; j++)
+        {
+            Posting posting;
+            in >> posting.doc >> posting.count;
+            if (posting.doc < 0 || posting.doc >= int(newDocs.size())) return false;
+            list.push_back(posting);
+        }
+    }
+    if (in.status() != QDataStream::Ok) return false;
+
+    QWriteLocker locker(&lock);
+    files.swap(newFiles);
+    filePaths.swap(newPaths);
+    fileIds.clear();
+    for (int i = 0; i < filePaths.size(); i++) fileIds.insert(filePaths[i], i);
+    docs.swap(newDocs);
+    postings.swap(newPostings);
+    totalLength = newLength;
+    liveDocs = live;
+    deadDocs = dead;
+    return true;
+}
+
+bool SearchIndex::save() const
+{
+    TRACE_SCOPE("SearchIndex::save");
+    QDir().mkpath(QFileInfo(indexPath).absolutePath());
+    QSaveFile file(indexPath);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+
+    QDataStream out(&file);
+    QReadLocker locker(&lock);
+    out << indexMagic << indexVersion << root;
+
+    out << quint32(files.size());
+    for (auto it = files.constBegin(); it != files.constEnd(); ++it) out << it.key() << it->modified << it->size;
+    out << filePaths;
+
+    out << quint32(docs.size());
+    for (const Document& doc : docs) out << doc.file << doc.pageId << doc.manifest << doc.title << doc.length << doc.live;
+
+    out << quint32(postings.size());
+    for (auto it = postings.constBegin(); it != postings.constEnd(); ++it)
+    {
+        out << it.key() << quint32(it->size());
+        for (const Posting& posting : *it) out << posting.doc << posting.count;
+    }
+    locker.unlock();
+
+    return out.status() == QDataStream::Ok && file.commit();
+}
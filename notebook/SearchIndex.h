@@ -0,0 +1,106 @@
+#pragma once
+
+#include <qobject.h>
+#include <qstring.h>
+#include <qstringlist.h>
+#include <qhash.h>
+#include <qmap.h>
+#include <qreadwritelock.h>
+#include <qthreadpool.h>
+#include <qfilesystemwatcher.h>
+#include <atomic>
+#include <vector>
+
+struct SearchHit
+{
+    QString path;
+    quint32 pageId = 0;
+    QString pageTitle;
+    QString snippet;
+    double  score = 0;
+};
+
+// Full text search over every page of every .nb under a directory.
+// An inverted index of case folded words, one document per page, ranked with BM25. It's kept on disk in the
+// cache dir between runs, so only files whose mtime or size changed since get read again, on a background thread.
+// Documents of files that changed stay behind as tombstones until there are enough of them to be worth compacting.
+class SearchIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    SearchIndex(QObject* parent = nullptr);
+    ~SearchIndex();
+
+    // Loads what was indexed for dir last time and starts bringing it up to date
+    void setDirectory(const QString& dir);
+    QString inline directory() const { return root; }
+
+    // Looks for changed files again. Coalesces with a scan that's already going.
+    void refresh();
+
+    // Safe while indexing runs, hits come from whatever is indexed so far.
+    // The last word matches as a prefix unless the query ends with a space.
+    std::vector<SearchHit> search(const QString& query, int limit = 30) const;
+
+    int documentCount() const;
+    int fileCount() const;
+    bool isIndexing() const { return running; }
+
+    static QStringList words(const QString& text);
+
+signals:
+    void progress(int done, int total); // Files read in the current scan, from the indexing thread
+    void indexed();                     // A scan finished, whether it found anything or not
+
+private:
+    struct Document
+    {
+        int     file = -1; // Into filePaths
+        quint32 pageId = 0;
+        QString manifest;  // See PageEntry
+        QString title;
+        quint32 length = 0; // In words
+        bool    live = true;
+    };
+
+    struct FileRecord
+    {
+        qint64 modified = 0; // ms since epoch
+        qint64 size = 0;
+        std::vector<int> docs;
+    };
+
+    struct Posting
+    {
+        qint32  doc;
+        quint32 count;
+    };
+
+    // Everything below is guarded by lock, the indexing thread only holds it while merging in one file
+    mutable QReadWriteLock lock;
+    std::vector<Document> docs;
+    QStringList filePaths;
+    QHash<QString, int> fileIds;
+    QHash<QString, FileRecord> files;
+    QMap<QString, std::vector<Posting>> postings; // Sorted, so prefixes are a range
+    quint64 totalLength = 0; // Of live documents
+    int liveDocs = 0;
+    int deadDocs = 0;
+
+    QString root;
+    QString indexPath;
+    QFileSystemWatcher watcher;
+    QThreadPool worker; // One thread, scans never overlap
+    std::atomic<bool> running  { false };
+    std::atomic<bool> rescan   { false };
+    std::atomic<bool> stopping { false };
+    std::atomic<bool> needsLoad { false };
+
+    void work();     // On the worker, loads if needed and scans until nothing asked for another
+    bool scanOnce(); // Returns whether anything changed
+    void removeFile(const QString& path); // With lock held for writing
+    void compact();                       // Same
+    bool load();
+    bool save() const;
+};
@@ -0,0 +1,95 @@
+#include "ThumbnailCache.h"
+
+#include "Trace.h"
+#include <qdir.h>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qsavefile.h>
+#include <qdatastream.h>
+#include <qstandardpaths.h>
+
+static const quint32 cacheMagic   = 0x4342544e; // "NTBC"
+static const quint16 cacheVersion = 1;
+
+ThumbnailCache::ThumbnailCache()
+{
+    cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/thumbnails.bin";
+    load();
+}
+
+QByteArray ThumbnailCache::find(const QString& path, qint64 modified, qint64 size) const
+{
+    QMutexLocker locker(&mutex);
+    auto it = entries.constFind(path);
+    if (it == entries.constEnd() || it->modified != modified || it->size != size) return QByteArray();
+    return it->png;
+}
+
+void ThumbnailCache::insert(const QString& path, qint64 modified, qint64 size, const QByteArray& png)
+{
+    QMutexLocker locker(&mutex);
+    Entry& entry = entries[path];
+    entry.modified = modified;
+    entry.size     = size;
+    entry.png      = png;
+    dirty = true;
+}
+
+void ThumbnailCache::load()
+{
+    TRACE_SCOPE("ThumbnailCache::load");
+    QFile file(cachePath);
+    if (!file.open(QIODevice::ReadOnly)) return;
+
+    QDataStream in(&file);
+    quint32 magic = 0;
+    quint16 version = 0;
+    quint32 count = 0;
+    in >> magic >> version >> count;
+    if (magic != cacheMagic || version != cacheVersion) return;
+
+    QHash<QString, Entry> loaded;
+    loaded.reserve(int(qMin(count, 1u << 16)));
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        QString path;
+        Entry entry;
+        in >> path >> entry.modified >> entry.size >> entry.png;
+        loaded.insert(path, entry);
+    }
+    if (in.status() != QDataStream::Ok) return;
+
+    QMutexLocker locker(&mutex);
+    entries.swap(loaded);
+}
+
+bool ThumbnailCache::save()
+{
+    TRACE_SCOPE("ThumbnailCache::save");
+    QHash<QString, Entry> current;
+    {
+        QMutexLocker locker(&mutex);
+        if (!dirty) return true;
+        dirty = false;
+        current = entries; // Implicitly shared, the PNGs don't get copied
+    }
+
+    QDir().mkpath(QFileInfo(cachePath).absolutePath());
+    QSaveFile file(cachePath);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+
+    QList<QString> kept;
+    for (auto it = current.constBegin(); it != current.constEnd(); ++it)
+    {
+        if (QFileInfo::exists(it.key())) kept.append(it.key());
+    }
+
+    QDataStream out(&file);
+    out << cacheMagic << cacheVersion << quint32(kept.size());
+    for (const QString& path : kept)
+    {
+        const Entry entry = current.value(path);
+        out << path << entry.modified << entry.size << entry.png;
+    }
+    return out.status() == QDataStream::Ok && file.commit();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <qstring.h>
+#include <qhash.h>
+#include <qbytearray.h>
+#include <qmutex.h>
+
+// Gallery sized thumbnails of notebooks, kept as PNG in one file in the cache dir between runs.
+// An entry is good as long as the notebook's mtime and size haven't changed.
+// Safe to use from several threads.
+class ThumbnailCache
+{
+public:
+    ThumbnailCache();
+
+    QByteArray find(const QString& path, qint64 modified, qint64 size) const; // Null if there's nothing current
+    void insert(const QString& path, qint64 modified, qint64 size, const QByteArray& png);
+
+    // Writes it out if anything was added. Entries for notebooks that are gone get dropped on the way.
+    bool save();
+
+private:
+    struct Entry
+    {
+        qint64     modified = 0;
+        qint64     size = 0;
+        QByteArray png;
+    };
+
+    mutable QMutex mutex;
+    QHash<QString, Entry> entries;
+    QString cachePath;
+    bool    dirty = false;
+
+    void load();
+};
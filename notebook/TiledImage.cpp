@@ -0,0 +1,188 @@
+#include "TiledImage.h"
+#include <atomic>
+
+static std::atomic<quint64> nextTileVersion { 1 };
+
+static inline int floorDiv(int a, int b) { return (a >= 0) ? a / b : -((-a + b - 1) / b); }
+
+static bool isTransparent(const QImage& img)
+{
+    for (int y = 0; y < img.height(); y++)
+    {
+        const QRgb* line = reinterpret_cast<const QRgb*>(img.constScanLine(y));
+        for (int x = 0; x < img.width(); x++)
+        { if (qAlpha(line[x]) != 0) return false; }
+    }
+    return true;
+}
+
+QRect TiledImage::tileRange(const QRect& rect)
+{
+    return QRect(QPoint(floorDiv(rect.left(), tileSize),  floorDiv(rect.top(), tileSize)),
+                 QPoint(floorDiv(rect.right(), tileSize), floorDiv(rect.bottom(), tileSize)));
+}
+
+qint64 TiledImage::memoryUsage() const
+{
+    qint64 total = 0;
+    for (const QImage& t : tiles) total += t.sizeInBytes();
+    return total;
+}
+
+QRect TiledImage::boundingRect() const
+{
+    QRect bounds;
+    for (auto it = versions.constBegin(); it != versions.constEnd(); ++it)
+    {
+        const QPoint coords = keyToCoords(it.key());
+        bounds |= tileRect(coords.x(), coords.y());
+    }
+    return bounds;
+}
+
+QImage* TiledImage::tile(int tx, int ty)
+{
+    auto it = tiles.find(key(tx, ty));
+    return (it != tiles.end()) ? &it.value() : nullptr;
+}
+
+const QImage* TiledImage::tile(int tx, int ty) const
+{
+    auto it = tiles.constFind(key(tx, ty));
+    return (it != tiles.constEnd()) ? &it.value() : nullptr;
+}
+
+QImage& TiledImage::tileOrCreate(int tx, int ty)
+{
+    QImage& t = tiles[key(tx, ty)];
+    if (t.isNull())
+    {
+        t = QImage(tileSize, tileSize, format);
+        t.fill(Qt::transparent);
+    }
+    return t;
+}
+
+void TiledImage::touch(quint64 key)
+{
+    versions[key] = nextTileVersion++;
+}
+
+void TiledImage::insertTile(int tx, int ty, const QImage& img)
+{
+    tiles.insert(key(tx, ty), img.convertToFormat(format));
+    touch(key(tx, ty));
+}
+
+void TiledImage::removeTile(int tx, int ty)
+{
+    tiles.remove(key(tx, ty));
+    versions.remove(key(tx, ty));
+    pending.remove(key(tx, ty));
+}
+
+void TiledImage::dropTransparent(const QRect& bounds)
+{
+    const QRect clipped = bounds.intersected(QRect(QPoint(0, 0), extent));
+    if (clipped.isEmpty()) return;
+
+    const QRect range = tileRange(clipped);
+    for (int ty = range.top(); ty <= range.bottom(); ty++)
+    {
+        for (int tx = range.left(); tx <= range.right(); tx++)
+        {
+            const QImage* t = tile(tx, ty);
+            if (t != nullptr && isTransparent(*t)) removeTile(tx, ty);
+        }
+    }
+}
+
+void TiledImage::writePixels(const QRect& rect, const QImage& pixels)
+{
+    const QPoint coords(floorDiv(rect.left(), tileSize), floorDiv(rect.top(), tileSize));
+    loadPending(coords.x(), coords.y());
+
+    QPainter painter(&tileOrCreate(coords.x(), coords.y()));
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.drawImage(rect.topLeft() - tileRect(coords.x(), coords.y()).topLeft(), pixels);
+    painter.end();
+    touch(key(coords.x(), coords.y()));
+}
+
+void TiledImage::insertPending(int tx, int ty)
+{
+    tiles.remove(key(tx, ty));
+    pending.insert(key(tx, ty));
+    touch(key(tx, ty));
+}
+
+void TiledImage::resolvePending(int tx, int ty, const QImage& img)
+{
+    if (!pending.remove(key(tx, ty))) return;
+    if (!img.isNull()) tiles.insert(key(tx, ty), img.convertToFormat(format));
+}
+
+bool TiledImage::loadPending(int tx, int ty)
+{
+    if (!pending.contains(key(tx, ty))) return false;
+    resolvePending(tx, ty, loader ? loader(tx, ty) : QImage());
+    return true;
+}
+
+void TiledImage::setImage(const QImage& img)
+{
+    clear();
+    extent = img.size();
+    if (img.isNull()) return;
+
+    const QImage source = img.convertToFormat(format);
+    const QRect range = tileRange(source.rect());
+    for (int ty = range.top(); ty <= range.bottom(); ty++)
+    {
+        for (int tx = range.left(); tx <= range.right(); tx++)
+        {
+            // copy() zero fills whatever falls outside the source, which is exactly transparent
+            QImage t = source.copy(tileRect(tx, ty));
+            if (!isTransparent(t)) insertTile(tx, ty, t);
+        }
+    }
+}
+
+QImage TiledImage::toImage(const QRect& rect, QImage::Format outFormat) const
+{
+    // Source mode blit into the output format, this is the one and only conversion on the way out
+    QImage result(rect.size(), outFormat);
+    result.fill(Qt::transparent);
+    if (rect.isEmpty()) return result;
+
+    QPainter painter(&result);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.translate(-rect.topLeft());
+    draw(painter, rect, true);
+    return result;
+}
+
+void TiledImage::draw(QPainter& painter, const QRect& rect, bool decodePending) const
+{
+    if (isEmpty() || rect.isEmpty()) return;
+
+    const QRect range = tileRange(rect);
+    for (int ty = range.top(); ty <= range.bottom(); ty++)
+    {
+        for (int tx = range.left(); tx <= range.right(); tx++)
+        {
+            const QImage* t = tile(tx, ty);
+            QImage decoded;
+            if (t == nullptr && decodePending && loader && pending.contains(key(tx, ty)))
+            {
+                decoded = loader(tx, ty);
+                t = &decoded;
+            }
+            if (t == nullptr || t->isNull()) continue;
+
+            const QRect tr = tileRect(tx, ty);
+            const QRect target = tr.intersected(rect);
+            painter.drawImage(target.topLeft(), *t, target.translated(-tr.topLeft()));
+        }
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <qimage.h>
+#include <qpainter.h>
+#include <qhash.h>
+#include <qrect.h>
+#include <qset.h>
+#include <functional>
+#include <vector>
+#include "Helpers.h"
+
+// Sparse grid of fixed size tiles.
+// Tiles are only allocated once ink touches them, so memory follows the inked area
+// and growing the canvas is just moving the logical extent.
+// Tiles are premultiplied so blits and QPainter strokes stay on Qt's fast paths,
+// pixels only get converted when they come in (setImage) or go out (toImage).
+// Tiles can also be pending: known to exist in a file but not decoded yet, see setLoader.
+class TiledImage
+{
+public:
+    // Decodes a pending tile. Gets copied along with the image, so it has to be safe to call from any thread.
+    using TileLoader = std::function<QImage(int tx, int ty)>;
+
+    static constexpr int tileSize = 256;
+    static constexpr QImage::Format format = QImage::Format_ARGB32_Premultiplied;
+
+    TiledImage() = default;
+
+    QSize  inline size()      const { return extent; }
+    int    inline width()     const { return extent.width(); }
+    int    inline height()    const { return extent.height(); }
+    int    inline tileCount() const { return tiles.size(); }
+    bool   inline isEmpty()   const { return tiles.isEmpty() && pending.isEmpty(); }
+    qint64 memoryUsage() const;
+    QRect  boundingRect() const;
+
+    void resize(const QSize& newSize) { extent = newSize; }
+    void clear() { tiles.clear(); versions.clear(); pending.clear(); }
+    void setImage(const QImage& img);
+    QImage toImage(const QRect& rect, QImage::Format outFormat = format) const;
+    QImage toImage() const { return toImage(QRect(QPoint(0, 0), extent)); }
+
+    // Blits every allocated tile intersecting rect. rect is in image coords.
+    // Pending tiles are skipped unless decodePending is set, then they get decoded just for this.
+    void draw(QPainter& painter, const QRect& rect, bool decodePending = false) const;
+
+    // Calls func for every tile touched by bounds, with the tile and where it sits in image coords.
+    // Tiles that don't exist yet are only created if allocate is set (erasing doesn't need them).
+    // Canvas::drawOnImage wraps this with a painter.
+    template<typename Func>
+    void editTiles(const QRect& bounds, Func&& func, bool allocate = true)
+    {
+        const QRect clipped = bounds.intersected(QRect(QPoint(0, 0), extent));
+        if (clipped.isEmpty()) return;
+
+        const QRect range = tileRange(clipped);
+        for (int ty = range.top(); ty <= range.bottom(); ty++)
+        {
+            for (int tx = range.left(); tx <= range.right(); tx++)
+            {
+                if (pending.contains(key(tx, ty))) loadPending(tx, ty);
+                QImage* t = allocate ? &tileOrCreate(tx, ty) : tile(tx, ty);
+                if (t == nullptr) continue;
+                touch(key(tx, ty));
+                func(*t, tileRect(tx, ty));
+            }
+        }
+    }
+
+    // Same as editTiles for a list of tiles (tile coords), with func running for several at once on the thread pool.
+    // Tiles are created and decoded here first, func must only touch the one it's handed.
+    template<typename Func>
+    void editTilesParallel(const QVector<QPoint>& coords, Func&& func)
+    {
+        for (const QPoint& c : coords)
+        {
+            if (pending.contains(key(c.x(), c.y()))) loadPending(c.x(), c.y());
+            tileOrCreate(c.x(), c.y());
+            touch(key(c.x(), c.y()));
+        }
+
+        // Pointers only once nothing more gets inserted, the hash could move them
+        std::vector<QImage*> targets;
+        targets.reserve(coords.size());
+        for (const QPoint& c : coords) targets.push_back(tile(c.x(), c.y()));
+        Helpers::parallelFor(int(targets.size()), [&](int i) { func(*targets[i], tileRect(coords[i].x(), coords[i].y())); });
+    }
+
+    QImage* tile(int tx, int ty);
+    const QImage* tile(int tx, int ty) const;
+    QImage& tileOrCreate(int tx, int ty);
+    void insertTile(int tx, int ty, const QImage& img);
+    void removeTile(int tx, int ty);
+    void dropTransparent(const QRect& bounds); // Removes the tiles in bounds with nothing left on them
+    void writePixels(const QRect& rect, const QImage& pixels); // rect has to be inside a single tile
+    const QHash<quint64, QImage>& allTiles() const { return tiles; }
+
+    // Every tile gets a new version whenever it's drawn on. Versions are unique for the whole process,
+    // so comparing against the versions that went into a file tells exactly which tiles changed since.
+    quint64 inline tileVersion(quint64 key) const { return versions.value(key); }
+    const QHash<quint64, quint64>& tileVersions() const { return versions; }
+
+    void setLoader(const TileLoader& newLoader) { loader = newLoader; }
+    const TileLoader& tileLoader() const { return loader; }
+    void insertPending(int tx, int ty);
+    void resolvePending(int tx, int ty, const QImage& img); // Keeps the version, it's the same tile that's in the file
+    bool loadPending(int tx, int ty);                       // Decodes right now on this thread
+    bool inline isPending(quint64 key) const { return pending.contains(key); }
+    const QSet<quint64>& pendingTiles() const { return pending; }
+
+    static inline quint64 key(int tx, int ty) { return (quint64(quint32(tx)) << 32) | quint32(ty); }
+    static inline QPoint  keyToCoords(quint64 key) { return QPoint(int(quint32(key >> 32)), int(quint32(key))); }
+    static inline QRect   tileRect(int tx, int ty) { return QRect(tx * tileSize, ty * tileSize, tileSize, tileSize); }
+    static QRect tileRange(const QRect& rect); // Inclusive range of tile coords covering rect
+
+private:
+    QHash<quint64, QImage>  tiles;
+    QHash<quint64, quint64> versions;
+    QSet<quint64> pending;
+    TileLoader    loader;
+    QSize extent;
+
+    void touch(quint64 key);
+};
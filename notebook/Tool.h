@@ -3,6 +3,7 @@
 #include <qobject.h>
 #include <qevent.h>
 #include <qaction.h>
+#include <qregion.h>
 #include <vector>
 
 class Canvas;
@@ -25,4 +26,11 @@ public:
     virtual void keyPressEvent(QKeyEvent* event)       { }
     virtual void paintEvent(QPaintEvent* event)        { }
 
+    // The band margin wide around the edge of rect, inside and out. What a rect outline drawn with a pen that wide can touch.
+    static QRegion outline(const QRect& rect, int margin)
+    {
+        const QRect outer = rect.normalized().adjusted(-margin, -margin, margin, margin);
+        const QRect inner = rect.normalized().adjusted(margin, margin, -margin, -margin);
+        return inner.isValid() ? QRegion(outer).subtracted(inner) : QRegion(outer);
+    }
 };
@@ -76,11 +76,23 @@ void ToolSelector::clearTools()
     Helpers::clearLayout(toolActionListLayout);
 }
 
+void ToolSelector::selectTool(int index)
+{
+    if (index < 0 || index >= int(tools.size())) return;
+    onToolButtonClicked(*tools[index].first, *tools[index].second);
+}
+
 void ToolSelector::onToolButtonClicked(Tool& tool, QPushButton& button)
 {
     for (auto& buttonToolPair : tools) { buttonToolPair.second->setChecked(false); }
     button.setChecked(true);
     if (&tool == canvas->currentTool) return;
+
+    if (canvas->recorder)
+    {
+        for (size_t i = 0; i < tools.size(); i++)
+        { if (tools[i].first == &tool) canvas->recorder->recordTool(int(i)); }
+    }
     
     if (canvas->currentTool != nullptr) canvas->currentTool->onExit(toolActionListLayout);
     canvas->currentTool = &tool;
@@ -30,6 +30,7 @@ public:
     void addTool(Tool* tool); // Takes ownership
     void removeTool(Tool& tool);
     void clearTools();
+    void selectTool(int index); // Same as clicking its button
 
 protected:
     void onToolButtonClicked(Tool& tool, QPushButton& button);
@@ -9,9 +9,14 @@
 #include <qaction.h>
 #include <qtoolbutton.h>
 #include <qspinbox.h>
+#include <qtextlayout.h>
+#include <memory>
 #include "Tool.h"
 #include "Canvas.h"
 #include "Helpers.h"
+#include "BrushRasterizer.h"
+#include "FloodFill.h"
+#include "Trace.h"
 
 // All the simple tools
 
@@ -53,7 +58,14 @@ protected:
     bool erasing = false;
     int penWidth = 1;
     QColor penColor = Qt::black;
-    QPoint lastPoint;
+    QPointF lastPoint;
+
+    // Moves pile up here and get drawn as one polyline per frame
+    QVector<QPointF> pendingPoints;
+    qint64 oldestPending = -1;
+    quint32 strokeItem = 0; // The stroke being drawn in retained mode
+    QMetaObject::Connection frameConnection;
+    QMetaObject::Connection viewConnection;
 
     QAction* setColorAction;
     QAction* setSizeAction;
@@ -103,20 +115,51 @@ public:
         eraseButton->setChecked(erasing);
     }
 
-    void drawLineTo(const QPoint& endPoint)
+    // receivedAt is from RepaintScheduler::inputTime, -1 for now
+    void drawLineTo(const QPointF& endPoint, qint64 receivedAt = -1)
     {
-        QPainter painter(&canvas->image);
-        painter.setCompositionMode(QPainter::CompositionMode_Source);
-        if (erasing) painter.setPen(QPen(Qt::transparent, penWidth, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
-        else         painter.setPen(QPen(penColor, penWidth, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
+        TRACE_SCOPE("DrawTool::drawLineTo");
+        queuePoint(endPoint, receivedAt);
+        flushStroke();
+    }
+
+    void queuePoint(const QPointF& point, qint64 receivedAt = -1)
+    {
+        if (pendingPoints.isEmpty()) oldestPending = receivedAt >= 0 ? receivedAt : canvas->repaintScheduler->now();
+        pendingPoints.append(point);
+    }
+
+    // Draws everything that came in since the last frame in one go
+    void flushStroke()
+    {
+        if (pendingPoints.isEmpty()) return;
+        TRACE_SCOPE("DrawTool::flushStroke");
 
-        painter.drawLine(lastPoint, endPoint);
-        canvas->modified = true;
+        QPolygonF polyline;
+        polyline.reserve(pendingPoints.size() + 1);
+        polyline << lastPoint << pendingPoints;
+
+        if (strokeItem != 0) canvas->extendVector(strokeItem, pendingPoints);
+        else drawBrush(polyline, penWidth, penColor, erasing);
+
+        lastPoint = pendingPoints.last();
+        pendingPoints.clear();
+        canvas->repaintScheduler->noteInputDrawn(oldestPending);
+        oldestPending = -1;
+    }
+
+    void drawBrush(const QPolygonF& polyline, int width, const QColor& color, bool erase)
+    {
+        canvas->journal.brush(polyline, width, color, erase);
+
+        // Erasing is Source mode with transparent, it never needs a tile that isn't there yet
+        const BrushRasterizer brush(polyline, width, color, erase);
+        canvas->drawOnTiles(brush.bounds(), [&](QImage& tile, const QRect& tileRect)
+            {
+                brush.render(tile, tileRect.topLeft());
+            }, !erase);
 
-        int rad = (penWidth / 2) + 2;
-        const QRect updateRegion = QRect(lastPoint, endPoint).normalized().adjusted(-rad, -rad, +rad, +rad);
-        canvas->update(updateRegion);
-        lastPoint = endPoint;
+        if (erase) canvas->eraseVectors(polyline, width / 2.0);
     }
 
     void inline onBrushSizeWidgetValueChanged(int value) { setPenWidth(value); }
@@ -141,37 +184,69 @@ public:
 
         canvas->setFocusPolicy(Qt::NoFocus);
         updateCursor();
+
+        frameConnection = connect(canvas->repaintScheduler, &RepaintScheduler::frame, this, &DrawTool::flushStroke);
+        viewConnection  = connect(canvas, &Canvas::viewChanged, this, &DrawTool::updateCursor);
     }
 
     void onExit(QLayout* subtoolLayout) final override
     {
+        flushStroke();
+        disconnect(frameConnection);
+        disconnect(viewConnection);
+        if (drawing) { endStroke(); drawing = false; strokeItem = 0; }
         Helpers::clearLayout(subtoolLayout);
     }
 
     void mousePressEvent(QMouseEvent* event) final override
     {
-        if (event->button() == Qt::LeftButton)
-        { lastPoint = event->pos(); drawing = true; }
+        if (event->button() == Qt::LeftButton && !drawing)
+        {
+            lastPoint = canvas->mapToImage(event->localPos());
+            drawing = true;
+            canvas->journal.record(Journal::Op::beginEdit);
+            canvas->beginEdit();
+            if (canvas->retainVectors && !erasing) strokeItem = canvas->addVector(strokeStart());
+        }
+    }
+
+    VectorItem strokeStart() const
+    {
+        VectorItem item;
+        item.kind   = VectorItem::Kind::stroke;
+        item.color  = penColor.rgba();
+        item.width  = penWidth;
+        item.points << lastPoint;
+        return item;
     }
 
     void mouseMoveEvent(QMouseEvent* event) final override
     {
         if ((event->buttons() & Qt::LeftButton) && drawing)
         {
-            drawLineTo(event->pos());
-            canvas->update();
+            // Nothing gets drawn here, the points wait for the next frame
+            queuePoint(canvas->mapToImage(event->localPos()), canvas->repaintScheduler->inputTime(event));
+            canvas->repaintScheduler->requestFrame();
         }
     }
 
     void mouseReleaseEvent(QMouseEvent* event) final override
     {
         if (event->button() == Qt::LeftButton && drawing)
-        { drawLineTo(event->pos()); }
+        { drawLineTo(canvas->mapToImage(event->localPos()), canvas->repaintScheduler->inputTime(event)); drawing = false; strokeItem = 0; endStroke(); } // The whole stroke is one undo step
+    }
+
+    // The stroke's edit goes in the journal too, or replay would make an undo step per frame of it
+    void endStroke()
+    {
+        canvas->journal.record(Journal::Op::endEdit);
+        canvas->endEdit();
     }
 
     void updateCursor()
     {
-        int cursorWidth = penWidth;
+        // The brush gets drawn at the view's zoom, so the cursor should be too
+        int cursorWidth = qRound(penWidth * canvas->zoom());
         if (cursorWidth < minimumCursorSize) cursorWidth = minimumCursorSize;
 
         QPixmap pixmap(QSize(cursorWidth, cursorWidth));
@@ -233,11 +308,8 @@ public:
         selectLine->connect(selectLine, &QAction::triggered, [this]() { selectedShape = Shape::line; });
     }
 
-    // Only use preview in paintEvent
-    void drawCurrentShape(const QPoint& p1, const QPoint& p2, bool preview = false)
+    void drawShape(QPainter& painter, const QPoint& p1, const QPoint& p2)
     {
-        if (preview) painter.begin(canvas->viewport());
-        else         painter.begin(&canvas->image);
         painter.setCompositionMode(QPainter::CompositionMode_Source);
         painter.setPen(pen);
 
@@ -248,7 +320,49 @@ public:
         case ShapeTool::Shape::line:    painter.drawLine(QLine(p1, p2));    break;
         default: break;
         }
-        painter.end();
+    }
+
+    // What the preview of the shape so far can touch, image coords
+    QRegion previewRegion() const
+    {
+        const int rad = pen.width() + 1;
+        if (selectedShape == Shape::rect) return outline(QRect(p1, p2), rad);
+        return QRect(p1, p2).normalized().adjusted(-rad, -rad, rad, rad);
+    }
+
+    // Only use preview in paintEvent
+    void drawCurrentShape(const QPoint& p1, const QPoint& p2, bool preview = false)
+    {
+        if (preview)
+        {
+            painter.begin(canvas->viewport());
+            painter.setTransform(canvas->viewTransform());
+            drawShape(painter, p1, p2);
+            painter.end();
+            return;
+        }
+
+        if (canvas->retainVectors)
+        {
+            VectorItem item;
+            item.kind  = selectedShape == Shape::rect ? VectorItem::Kind::rect
+                       : selectedShape == Shape::ellipse ? VectorItem::Kind::ellipse : VectorItem::Kind::line;
+            item.color = pen.color().rgba();
+            item.width = pen.width();
+            item.points << p1 << p2;
+            canvas->addVector(item);
+            return;
+        }
+
+        rasterizeShape(p1, p2);
+    }
+
+    void rasterizeShape(const QPoint& p1, const QPoint& p2)
+    {
+        canvas->journal.shape(int(selectedShape), p1, p2, pen.width(), pen.color());
+        int rad = pen.width() + 1;
+        const QRect bounds = QRect(p1, p2).normalized().adjusted(-rad, -rad, +rad, +rad);
+        canvas->drawOnImage(bounds, [&](QPainter& imagePainter) { drawShape(imagePainter, p1, p2); });
     }
 
     virtual void onEnter(QLayout* subtoolLayout) final override
@@ -275,6 +389,7 @@ public:
 
     virtual void onExit(QLayout* subtoolLayout) final override
     {
+        if (drawing) { drawing = false; canvas->clearOverlay(); }
         canvas->setContextMenuPolicy(Qt::DefaultContextMenu);
         Helpers::clearLayout(subtoolLayout);
     }
@@ -283,19 +398,19 @@ public:
     {
         if (!canvas->isActiveWindow()) return;
         if (event->buttons() & Qt::RightButton)
-        { drawing = false; }
+        { drawing = false; canvas->clearOverlay(); }
         else if (event->buttons() & Qt::LeftButton)
         {
             if (!drawing)
-            { p1 = event->pos(); p2 = event->pos(); drawing = true; }
+            { p1 = canvas->mapToImage(event->pos()); p2 = p1; drawing = true; canvas->setOverlay(previewRegion()); }
             else
-            { drawCurrentShape(p1, event->pos()); drawing = false; }
+            { drawCurrentShape(p1, canvas->mapToImage(event->pos())); drawing = false; canvas->clearOverlay(); }
         }
     }
 
     virtual void mouseMoveEvent(QMouseEvent* event) final override
     {
-        if (drawing) p2 = event->pos();
+        if (drawing) { p2 = canvas->mapToImage(event->pos()); canvas->setOverlay(previewRegion()); }
     }
 
     virtual void mouseReleaseEvent(QMouseEvent* event) final override { }
@@ -325,6 +440,15 @@ public:
 
     QAction* setColor;
 
+    // The text laid out one paragraph per layout, so typing only lays out the paragraph being typed in.
+    // Everything gets laid out again if the font size or box width changes, color and position don't need it.
+    std::vector<std::unique_ptr<QTextLayout>> paragraphs;
+    QString     laidOutSource;
+    QStringList laidOutText;
+    int   laidOutFontSize = -1;
+    int   laidOutWidth    = -1;
+    qreal laidOutHeight   = 0;
+
     TextTool(QObject* parent = nullptr) : Tool(parent)
     {
         name = "Text";
@@ -340,29 +464,112 @@ public:
         tempText.reserve(512);
     }
 
-    // Only use preview in paintEvent
-    void drawText(const QPoint& p1, const QPoint& p2, bool preview = false)
+    void updateLayout()
     {
-        if (preview) painter.begin(canvas->viewport());
-        else         painter.begin(&canvas->image);
-        painter.setPen(pen);
-        
-        QFont font = painter.font();
-        font.setPointSize(fontSize);
-        painter.setFont(font);
+        const int width = qMax(1, QRect(p1, p2).normalized().width());
+        const bool relayoutAll = fontSize != laidOutFontSize || width != laidOutWidth;
+        if (!relayoutAll && tempText == laidOutSource) return;
+        TRACE_SCOPE("TextTool::updateLayout");
 
-        QTextOption qto;
+        QFont font = canvas->font();
+        font.setPointSize(fontSize);
+        QTextOption option;
         // TODO: add alignment and wrap buttons one day zzzzzzz
-        qto.setWrapMode(QTextOption::WordWrap);
-        qto.setAlignment(Qt::AlignCenter);
-        painter.drawText(QRect(p1, p2), tempText, qto);
+        option.setWrapMode(QTextOption::WordWrap);
+        option.setAlignment(Qt::AlignHCenter);
 
-        painter.end();
+        const QStringList text = tempText.split('\n');
+        paragraphs.resize(size_t(text.size()));
+        for (int i = 0; i < text.size(); i++)
+        {
+            if (!relayoutAll && i < laidOutText.size() && laidOutText[i] == text[i]) continue;
+
+            std::unique_ptr<QTextLayout>& layout = paragraphs[size_t(i)];
+            if (!layout) layout.reset(new QTextLayout());
+            layout->clearLayout();
+            layout->setText(text[i]);
+            layout->setFont(font);
+            layout->setTextOption(option);
+            layout->beginLayout();
+            qreal y = 0;
+            for (QTextLine line = layout->createLine(); line.isValid(); line = layout->createLine())
+            {
+                line.setLineWidth(width);
+                line.setPosition(QPointF(0, y));
+                y += line.height();
+            }
+            layout->endLayout();
+        }
+
+        laidOutSource   = tempText;
+        laidOutText     = text;
+        laidOutFontSize = fontSize;
+        laidOutWidth    = width;
+        laidOutHeight   = 0;
+        for (const auto& layout : paragraphs) laidOutHeight += layout->boundingRect().height();
+    }
+
+    // Where the first paragraph goes, the text is centered in the box both ways like drawText with AlignCenter
+    QPointF textOrigin() const
+    {
+        const QRect rect = QRect(p1, p2).normalized();
+        return QPointF(rect.left(), rect.top() + (rect.height() - laidOutHeight) / 2);
+    }
+
+    void drawText(QPainter& painter)
+    {
+        updateLayout();
+        painter.setPen(pen);
+        QPointF origin = textOrigin();
+        for (const auto& layout : paragraphs)
+        {
+            layout->draw(&painter, origin);
+            origin.ry() += layout->boundingRect().height();
+        }
+    }
+
+    // Only use preview in paintEvent
+    void drawText(bool preview = false)
+    {
+        if (preview)
+        {
+            painter.begin(canvas->viewport());
+            painter.setTransform(canvas->viewTransform());
+            drawText(painter);
+            painter.end();
+            return;
+        }
+
+        canvas->journal.stamp(p1, p2, tempText, fontSize, pen.color());
+        canvas->drawOnImage(textBounds(), [&](QPainter& imagePainter) { drawText(imagePainter); });
+    }
+
+    // Centered text can spill out of the box, so this is the box grown to fit it
+    QRect textBounds()
+    {
+        updateLayout();
+        QRectF bounds = QRect(p1, p2).normalized();
+        QPointF origin = textOrigin();
+        for (const auto& layout : paragraphs)
+        {
+            bounds |= layout->boundingRect().translated(origin);
+            origin.ry() += layout->boundingRect().height();
+        }
+        return bounds.toAlignedRect().adjusted(-2, -2, 2, 2);
+    }
+
+    // What the preview can touch, image coords
+    QRegion previewRegion()
+    {
+        if (!drawingRect && !typing) return QRegion();
+        const QRegion box = outline(QRect(p1, p2), 2);
+        return typing && !tempText.isEmpty() ? box + textBounds() : box;
     }
     
     void drawPreviewRect()
     {
         painter.begin(canvas->viewport());
+        painter.setTransform(canvas->viewTransform());
         painter.setPen(pen);
         painter.drawRect(QRect(p1, p2));
         painter.end();
@@ -371,18 +578,20 @@ public:
     void finalizeText()
     {
         if (!typing) return;
-        drawText(p1, p2);
+        drawText();
         typing = false;
         tempText.clear();
+        canvas->clearOverlay();
     }
 
     void cancelText()
     {
         tempText.clear();
         typing = false;
+        canvas->clearOverlay();
     }
 
-    void inline onTextSizeWidgetValueChanged(int value) noexcept { fontSize = value; }
+    void inline onTextSizeWidgetValueChanged(int value) { fontSize = value; if (typing) canvas->setOverlay(previewRegion()); }
 
     virtual void onEnter(QLayout* subtoolLayout) override
     {
@@ -398,27 +607,31 @@ public:
         spinBox->connect(spinBox, qOverload<int>(&QSpinBox::valueChanged), this, &TextTool::onTextSizeWidgetValueChanged);
         spinBox->setValue(12);
         subtoolLayout->addWidget(spinBox);
+
+        // A box or text left half done shows up again
+        canvas->setOverlay(previewRegion());
     }
 
-    virtual void onExit(QLayout* subtoolLayout) override  { Helpers::clearLayout(subtoolLayout); }
+    virtual void onExit(QLayout* subtoolLayout) override  { canvas->clearOverlay(); Helpers::clearLayout(subtoolLayout); }
 
     virtual void mousePressEvent(QMouseEvent* event) override
     {
         if (typing) { finalizeText(); drawingRect = false; return; }
 
-        if (event->buttons() == Qt::RightButton) { drawingRect = false; typing = false; }
+        if (event->buttons() == Qt::RightButton) { drawingRect = false; typing = false; canvas->clearOverlay(); }
         else if (event->buttons() == Qt::LeftButton)
         {
             if (!drawingRect)
-            { p1 = event->pos(); p2 = event->pos(); drawingRect = true; typing = false; }
+            { p1 = canvas->mapToImage(event->pos()); p2 = p1; drawingRect = true; typing = false; }
             else
             { drawingRect = false; typing = true; }
+            canvas->setOverlay(previewRegion());
         }
     }
 
     virtual void mouseMoveEvent(QMouseEvent* event) override
     {
-        if (drawingRect) p2 = event->pos();
+        if (drawingRect) { p2 = canvas->mapToImage(event->pos()); canvas->setOverlay(previewRegion()); }
     }
 
     virtual void mouseReleaseEvent(QMouseEvent* event) override { }
@@ -434,6 +647,7 @@ public:
             else if (event->key() == Qt::Key::Key_Return || event->key() == Qt::Key::Key_Enter)
             { tempText.append("\n"); }
             else { tempText.append(event->text()); } 
+            canvas->setOverlay(previewRegion());
         }
         else
         { canvas->baseKeyPressEvent(event); }
@@ -442,6 +656,74 @@ public:
     virtual void paintEvent(QPaintEvent* event) override
     {
         if (drawingRect || typing) drawPreviewRect();
-        if (typing) drawText(p1, p2, true);
+        if (typing) drawText(true);
     }
-};
\ No newline at end of file
+};
+
+class BucketTool : public Tool
+{
+public:
+    QColor color = Qt::black;
+    int tolerance = 32; // Per channel, 0-255
+
+    QAction* setColor;
+
+    BucketTool(QObject* parent = nullptr) : Tool(parent)
+    {
+        icon = QIcon("res/bucket.png");
+        name = "Fill";
+
+        setColor = new QAction(QIcon("res/color.png"), "Color", this);
+        connect(setColor, &QAction::triggered, [this]()
+            {
+                QColor newColor = QColorDialog::getColor(color);
+                if (newColor.isValid()) color = newColor;
+            });
+    }
+
+    // Boundaries are whatever shows, all visible layers flattened. The fill goes on the active layer.
+    void fillAt(const QPoint& imagePos)
+    {
+        TRACE_SCOPE("BucketTool::fillAt");
+        const QRect limit(QPoint(0, 0), canvas->layers.size());
+        if (!limit.contains(imagePos)) return;
+
+        // Only the tiles the fill gets into and the rest of their mask batch are composited, and decoded if they're pending
+        LayerStack& layers = canvas->layers;
+        FloodFill fill([&layers](int tx, int ty) { return layers.compositeTile(tx, ty); }, limit, imagePos, tolerance);
+        const quint32 premultiplied = qPremultiply(color.rgba());
+        if (!fill.fill() || !fill.changes(premultiplied)) return; // Not even an undo step for filling with the same color
+        canvas->journal.fill(imagePos, tolerance, color);
+
+        canvas->drawOnTilesParallel(fill.filledTiles(), fill.bounds(), [&](QImage& tile, const QRect& tileRect)
+            {
+                fill.render(tile, tileRect.topLeft(), premultiplied);
+            });
+    }
+
+    void inline onToleranceWidgetValueChanged(int value) { tolerance = value; }
+
+    virtual void onEnter(QLayout* subtoolLayout) override
+    {
+        canvas->setFocusPolicy(Qt::NoFocus);
+        canvas->viewport()->setCursor(QCursor(Qt::CursorShape::PointingHandCursor));
+        auto parent = subtoolLayout->parentWidget();
+
+        subtoolLayout->addWidget(new DefaultSubButton(setColor, parent));
+
+        auto spinBox = new QSpinBox(parent);
+        spinBox->setMinimum(0);
+        spinBox->setMaximum(255);
+        spinBox->setToolTip("Tolerance");
+        spinBox->connect(spinBox, qOverload<int>(&QSpinBox::valueChanged), this, &BucketTool::onToleranceWidgetValueChanged);
+        spinBox->setValue(tolerance);
+        subtoolLayout->addWidget(spinBox);
+    }
+
+    virtual void onExit(QLayout* subtoolLayout) override { Helpers::clearLayout(subtoolLayout); }
+
+    virtual void mousePressEvent(QMouseEvent* event) override
+    {
+        if (event->button() == Qt::LeftButton) fillAt(canvas->mapToImage(event->pos()));
+    }
+};
@@ -0,0 +1,146 @@
+#include "Trace.h"
+#include <qcoreapplication.h>
+#include <qfile.h>
+#include <qjsonarray.h>
+#include <qjsondocument.h>
+#include <qjsonobject.h>
+#include <qthread.h>
+#include <chrono>
+#include <vector>
+
+std::atomic<bool> Trace::on { false };
+
+namespace
+{
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    const quint64 ringSize = 1 << 16; // Entries per thread, about 1.5 MB
+
+    struct TraceEntry
+    {
+        const char* name;
+        qint64 start;
+        qint64 duration;
+    };
+
+    // Only the thread holding a ring writes to it. Rings are never freed, a thread that exits
+    // hands its ring back and the next new thread takes it over, so pool threads coming and going don't add up.
+    struct TraceRing
+    {
+        TraceEntry entries[ringSize];
+        std::atomic<quint64> head    { 0 };  // Entries written so far, published with release
+        std::atomic<quint64> cleared { 0 };  // Everything before this was cleared
+        std::atomic<bool>    taken   { true };
+        std::atomic<bool>    mainThread { false };
+        int        lane = 0;                 // Row in the trace viewer
+        TraceRing* next = nullptr;
+    };
+
+    std::atomic<TraceRing*> rings { nullptr };
+    std::atomic<int>        ringCount { 0 };
+
+    TraceRing* takeRing()
+    {
+        for (TraceRing* ring = rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+        {
+            bool expected = false;
+            if (ring->taken.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) return ring;
+        }
+
+        TraceRing* ring = new TraceRing();
+        ring->lane = ringCount.fetch_add(1, std::memory_order_relaxed) + 1;
+        ring->next = rings.load(std::memory_order_relaxed);
+        while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed)) { }
+        return ring;
+    }
+
+    struct ThreadRing
+    {
+        TraceRing* ring = nullptr;
+        ~ThreadRing() { if (ring) ring->taken.store(false, std::memory_order_release); }
+
+        TraceRing* get()
+        {
+            if (ring) return ring;
+            ring = takeRing();
+            QCoreApplication* app = QCoreApplication::instance();
+            ring->mainThread.store(app && QThread::currentThread() == app->thread(), std::memory_order_relaxed);
+            return ring;
+        }
+    };
+
+    thread_local ThreadRing threadRing;
+}
+
+qint64 Trace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Trace::record(const char* name, qint64 start, qint64 end)
+{
+    TraceRing* ring = threadRing.get();
+    const quint64 index = ring->head.load(std::memory_order_relaxed);
+    ring->entries[index % ringSize] = { name, start, end - start };
+    ring->head.store(index + 1, std::memory_order_release);
+}
+
+void Trace::clear()
+{
+    for (TraceRing* ring = rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+        ring->cleared.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+QByteArray Trace::toChromeJson()
+{
+    const qint64 pid = QCoreApplication::applicationPid();
+    QJsonArray events;
+
+    for (TraceRing* ring = rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+    {
+        // Copy first, then throw out whatever the owner may have overwritten while we were copying
+        const quint64 head = ring->head.load(std::memory_order_acquire);
+        const quint64 from = qMax(ring->cleared.load(std::memory_order_relaxed), head > ringSize ? head - ringSize : 0);
+        std::vector<TraceEntry> copied;
+        copied.reserve(size_t(head - from));
+        for (quint64 i = from; i < head; i++) copied.push_back(ring->entries[i % ringSize]);
+
+        const quint64 headAfter = ring->head.load(std::memory_order_acquire);
+        const quint64 valid = headAfter > ringSize ? headAfter - ringSize : 0;
+        const size_t skip = valid > from ? size_t(qMin(valid - from, quint64(copied.size()))) : 0;
+
+        QJsonObject nameArgs;
+        nameArgs["name"] = ring->mainThread.load(std::memory_order_relaxed) ? QString("main") : QString("worker %1").arg(ring->lane);
+        QJsonObject threadName;
+        threadName["ph"]   = "M";
+        threadName["name"] = "thread_name";
+        threadName["pid"]  = pid;
+        threadName["tid"]  = ring->lane;
+        threadName["args"] = nameArgs;
+        events.append(threadName);
+
+        for (size_t i = skip; i < copied.size(); i++)
+        {
+            QJsonObject event;
+            event["ph"]   = "X";
+            event["name"] = QString::fromLatin1(copied[i].name);
+            event["pid"]  = pid;
+            event["tid"]  = ring->lane;
+            event["ts"]   = copied[i].start / 1e3;    // Microseconds
+            event["dur"]  = copied[i].duration / 1e3;
+            events.append(event);
+        }
+    }
+
+    QJsonObject root;
+    root["traceEvents"]     = events;
+    root["displayTimeUnit"] = "ms";
+    return QJsonDocument(root).toJson(QJsonDocument::Compact);
+}
+
+bool Trace::save(const QString& filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    const QByteArray json = toChromeJson();
+    return file.write(json) == json.size();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <qbytearray.h>
+#include <qstring.h>
+#include <atomic>
+
+// Scoped timings around the hot paths, exported as Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+// Every thread writes into a ring of its own so recording never locks, the oldest entries get overwritten.
+// While tracing is off a scope costs one relaxed load.
+class Trace
+{
+public:
+    static void setEnabled(bool enable) { on.store(enable, std::memory_order_relaxed); }
+    static bool inline enabled() { return on.load(std::memory_order_relaxed); }
+
+    static qint64 now(); // Nanoseconds, steady clock
+    static void record(const char* name, qint64 start, qint64 end); // name has to outlive the trace, a literal
+    static void clear();
+
+    static QByteArray toChromeJson();
+    static bool save(const QString& filePath);
+
+private:
+    static std::atomic<bool> on;
+};
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name) : name(name), start(Trace::enabled() ? Trace::now() : -1) { }
+    ~TraceScope() { if (start >= 0) Trace::record(name, start, Trace::now()); }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    qint64 start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
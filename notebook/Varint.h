@@ -0,0 +1,41 @@
+#pragma once
+
+#include <qbytearray.h>
+
+// LEB128 style varints, for the compact binary logs (input traces, the journal)
+struct Varint
+{
+    static void write(QByteArray& out, quint64 value)
+    {
+        while (value >= 0x80) { out.append(char(value | 0x80)); value >>= 7; }
+        out.append(char(value));
+    }
+
+    // Zigzag encoded, so small negative numbers stay small too
+    static void writeSigned(QByteArray& out, qint64 value) { write(out, (quint64(value) << 1) ^ quint64(value >> 63)); }
+};
+
+// Reads off the front of a byte range, ok goes false and stays false once it runs out
+struct VarintReader
+{
+    const char* at;
+    const char* end;
+    bool ok = true;
+
+    quint64 varint()
+    {
+        quint64 value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (at >= end) { ok = false; return 0; }
+            const quint8 byte = quint8(*at++);
+            value |= quint64(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    qint64 signedVarint() { const quint64 v = varint(); return qint64(v >> 1) ^ -qint64(v & 1); }
+    quint8 byte()         { if (at >= end) { ok = false; return 0; } return quint8(*at++); }
+};
@@ -0,0 +1,267 @@
+#include "VectorScene.h"
+#include <qdatastream.h>
+#include <qiodevice.h>
+#include <algorithm>
+#include <cmath>
+
+static const quint32 sceneMagic   = 0x4e425653; // "NBVS"
+static const quint16 sceneVersion = 2; // 2 added ids
+
+static qreal distanceToSegment(const QPointF& p, const QPointF& a, const QPointF& b)
+{
+    const QPointF d = b - a;
+    const qreal length2 = QPointF::dotProduct(d, d);
+    const qreal t = length2 > 0 ? qBound<qreal>(0, QPointF::dotProduct(p - a, d) / length2, 1) : 0;
+    const QPointF q = a + t * d - p;
+    return std::sqrt(QPointF::dotProduct(q, q));
+}
+
+void VectorItem::updateBounds()
+{
+    const qreal pad = width / 2 + 1;
+    bounds = points.boundingRect().adjusted(-pad, -pad, pad, pad);
+}
+
+void VectorItem::paint(QPainter& painter) const
+{
+    painter.setPen(QPen(QColor::fromRgba(color), width, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
+    painter.setBrush(Qt::NoBrush);
+
+    if (kind == Kind::stroke) { painter.drawPolyline(points); return; }
+    if (points.size() < 2) return;
+
+    switch (kind)
+    {
+    case Kind::rect:    painter.drawRect(QRectF(points[0], points[1]));    break;
+    case Kind::ellipse: painter.drawEllipse(QRectF(points[0], points[1])); break;
+    case Kind::line:    painter.drawLine(points[0], points[1]);            break;
+    default: break;
+    }
+}
+
+qreal VectorItem::distanceTo(const QPointF& p) const
+{
+    if (points.isEmpty()) return qInf();
+
+    if (kind == Kind::stroke)
+    {
+        qreal best = distanceToSegment(p, points[0], points[0]);
+        for (int i = 1; i < points.size(); i++) best = qMin(best, distanceToSegment(p, points[i - 1], points[i]));
+        return best;
+    }
+    if (points.size() < 2) return qInf();
+
+    const QRectF r = QRectF(points[0], points[1]).normalized();
+    switch (kind)
+    {
+    case Kind::line:
+        return distanceToSegment(p, points[0], points[1]);
+
+    case Kind::rect:
+        return qMin(qMin(distanceToSegment(p, r.topLeft(), r.topRight()),    distanceToSegment(p, r.topRight(), r.bottomRight())),
+                    qMin(distanceToSegment(p, r.bottomRight(), r.bottomLeft()), distanceToSegment(p, r.bottomLeft(), r.topLeft())));
+
+    case Kind::ellipse:
+    {
+        // Scales the point onto the ellipse along the line from the center, close enough for picking
+        const qreal a = qMax<qreal>(r.width() / 2, 0.5), b = qMax<qreal>(r.height() / 2, 0.5);
+        const QPointF d = p - r.center();
+        const qreal k = std::sqrt((d.x() * d.x()) / (a * a) + (d.y() * d.y()) / (b * b));
+        if (k == 0) return qMin(a, b);
+        return std::abs(1 - 1 / k) * std::sqrt(QPointF::dotProduct(d, d));
+    }
+    default:
+        return qInf();
+    }
+}
+
+QRect VectorScene::cellRange(const QRectF& rect)
+{
+    return QRect(QPoint(int(std::floor(rect.left() / cellSize)),  int(std::floor(rect.top() / cellSize))),
+                 QPoint(int(std::floor(rect.right() / cellSize)), int(std::floor(rect.bottom() / cellSize))));
+}
+
+void VectorScene::index(quint32 id, const QRectF& bounds)
+{
+    const QRect range = cellRange(bounds);
+    for (int cy = range.top(); cy <= range.bottom(); cy++)
+    {
+        for (int cx = range.left(); cx <= range.right(); cx++)
+        {
+            std::vector<quint32>& cell = cells[cellKey(cx, cy)];
+            if (std::find(cell.rbegin(), cell.rend(), id) == cell.rend()) cell.push_back(id);
+        }
+    }
+}
+
+void VectorScene::unindex(quint32 id, const QRectF& bounds)
+{
+    const QRect range = cellRange(bounds);
+    for (int cy = range.top(); cy <= range.bottom(); cy++)
+    {
+        for (int cx = range.left(); cx <= range.right(); cx++)
+        {
+            auto it = cells.find(cellKey(cx, cy));
+            if (it == cells.end()) continue;
+            it->erase(std::remove(it->begin(), it->end(), id), it->end());
+            if (it->empty()) cells.erase(it);
+        }
+    }
+}
+
+quint32 VectorScene::add(VectorItem item)
+{
+    if (item.id == 0) item.id = nextId++;
+    else nextId = qMax(nextId, item.id + 1);
+
+    item.updateBounds();
+    index(item.id, item.bounds);
+    const quint32 id = item.id;
+    items.insert(id, std::move(item));
+    return id;
+}
+
+QRectF VectorScene::extend(quint32 id, const QPolygonF& morePoints)
+{
+    auto it = items.find(id);
+    if (it == items.end() || morePoints.isEmpty()) return QRectF();
+
+    // Only the cells under the new segments need the id, the rest already have it
+    QPolygonF added = morePoints;
+    if (!it->points.isEmpty()) added.prepend(it->points.last());
+    const qreal pad = it->width / 2 + 1;
+    const QRectF addedBounds = added.boundingRect().adjusted(-pad, -pad, pad, pad);
+
+    it->points << morePoints;
+    it->bounds |= addedBounds;
+    index(id, addedBounds);
+    return addedBounds;
+}
+
+bool VectorScene::remove(quint32 id, VectorItem* removed)
+{
+    auto it = items.find(id);
+    if (it == items.end()) return false;
+
+    unindex(id, it->bounds);
+    if (removed != nullptr) *removed = *it;
+    items.erase(it);
+    return true;
+}
+
+const VectorItem* VectorScene::item(quint32 id) const
+{
+    auto it = items.constFind(id);
+    return it == items.constEnd() ? nullptr : &it.value();
+}
+
+std::vector<quint32> VectorScene::ids() const
+{
+    std::vector<quint32> all;
+    all.reserve(items.size());
+    for (auto it = items.constBegin(); it != items.constEnd(); ++it) all.push_back(it.key());
+    std::sort(all.begin(), all.end());
+    return all;
+}
+
+void VectorScene::clear()
+{
+    items.clear();
+    cells.clear();
+}
+
+std::vector<quint32> VectorScene::query(const QRectF& rect) const
+{
+    std::vector<quint32> found;
+    const QRect range = cellRange(rect);
+    for (int cy = range.top(); cy <= range.bottom(); cy++)
+    {
+        for (int cx = range.left(); cx <= range.right(); cx++)
+        {
+            auto it = cells.constFind(cellKey(cx, cy));
+            if (it != cells.constEnd()) found.insert(found.end(), it->begin(), it->end());
+        }
+    }
+
+    // Items spanning several cells show up once per cell
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    found.erase(std::remove_if(found.begin(), found.end(), [&](quint32 id) { return !item(id)->bounds.intersects(rect); }), found.end());
+    return found;
+}
+
+std::vector<quint32> VectorScene::hitTest(const QPointF& p, qreal tolerance) const
+{
+    std::vector<quint32> hits = query(QRectF(p.x() - tolerance, p.y() - tolerance, 2 * tolerance, 2 * tolerance));
+    hits.erase(std::remove_if(hits.begin(), hits.end(), [&](quint32 id)
+        {
+            const VectorItem* candidate = item(id);
+            return candidate->distanceTo(p) > tolerance + candidate->width / 2;
+        }), hits.end());
+    return hits;
+}
+
+void VectorScene::paint(QPainter& painter, const QRectF& rect) const
+{
+    const std::vector<quint32> visible = query(rect);
+    if (visible.empty()) return;
+
+    painter.save();
+    painter.setRenderHint(QPainter::Antialiasing);
+    for (quint32 id : visible) item(id)->paint(painter);
+    painter.restore();
+}
+
+QByteArray VectorScene::serialize() const
+{
+    const std::vector<quint32> order = ids();
+
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    out << sceneMagic << sceneVersion << quint32(order.size());
+
+    // Ids go in too, the journal and undo refer to items by them across a save
+    for (quint32 id : order)
+    {
+        const VectorItem* entry = item(id);
+        out << id << quint8(entry->kind) << quint32(entry->color) << entry->width << quint32(entry->points.size());
+        for (const QPointF& p : entry->points) out << float(p.x()) << float(p.y());
+    }
+    return bytes;
+}
+
+bool VectorScene::deserialize(const QByteArray& bytes)
+{
+    clear();
+
+    QDataStream in(bytes);
+    in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint32 magic = 0, count = 0;
+    quint16 version = 0;
+    in >> magic >> version >> count;
+    if (magic != sceneMagic || version > sceneVersion) return false;
+
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        quint8  kind = 0;
+        quint32 color = 0, pointCount = 0;
+        VectorItem item;
+        if (version >= 2) in >> item.id; // Older files get numbered in order
+        in >> kind >> color >> item.width >> pointCount;
+        if (kind > quint8(VectorItem::Kind::line) || pointCount > quint32(bytes.size() / 8)) return false;
+        if (item.id != 0 && items.contains(item.id)) return false;
+
+        item.kind  = VectorItem::Kind(kind);
+        item.color = color;
+        item.points.reserve(int(pointCount));
+        for (quint32 p = 0; p < pointCount; p++)
+        {
+            float x = 0, y = 0;
+            in >> x >> y;
+            item.points << QPointF(x, y);
+        }
+        add(std::move(item));
+    }
+    return in.status() == QDataStream::Ok;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <qbytearray.h>
+#include <qcolor.h>
+#include <qhash.h>
+#include <qpainter.h>
+#include <qpolygon.h>
+#include <qrect.h>
+#include <vector>
+
+// One stroke or shape, kept as geometry
+struct VectorItem
+{
+    enum class Kind : quint8
+    {
+        stroke,
+        rect,
+        ellipse,
+        line
+    };
+
+    quint32   id    = 0; // Also the paint order, later ids go on top
+    Kind      kind  = Kind::stroke;
+    QRgb      color = 0xff000000;
+    float     width = 1;
+    QPolygonF points;    // The stroke's polyline, or the two corners of a shape
+    QRectF    bounds;    // Everything the pen covers
+
+    void updateBounds();
+    void paint(QPainter& painter) const;
+    qreal distanceTo(const QPointF& p) const; // From the outline, the pen width isn't counted
+};
+
+// Ink that's kept as strokes and shapes instead of pixels, for retained mode.
+// Items sit in a uniform grid, so painting a dirty rect or hit testing only looks at what's nearby
+// and stays cheap with tens of thousands of strokes.
+// Geometry is in image coords and gets rasterized when painted, so it's exact at any scale.
+class VectorScene
+{
+public:
+    static constexpr int cellSize = 256;
+
+    bool inline isEmpty() const { return items.isEmpty(); }
+    int  inline count()   const { return items.size(); }
+
+    quint32 add(VectorItem item);                             // Keeps the item's id if it has one, so undo can put it back
+    QRectF  extend(quint32 id, const QPolygonF& morePoints);  // Appends to a stroke being drawn, returns what the new part covers
+    bool    remove(quint32 id, VectorItem* removed = nullptr);
+    const VectorItem* item(quint32 id) const;
+    std::vector<quint32> ids() const; // In paint order
+    void clear();
+
+    std::vector<quint32> query(const QRectF& rect) const;                  // Items whose bounds touch rect, in paint order
+    std::vector<quint32> hitTest(const QPointF& p, qreal tolerance) const; // Items whose pen comes within tolerance of p
+    void paint(QPainter& painter, const QRectF& rect) const;               // Painter in image coords, any transform on top is fine
+
+    QByteArray serialize() const;
+    bool deserialize(const QByteArray& bytes);
+
+private:
+    QHash<quint32, VectorItem> items;
+    QHash<quint64, std::vector<quint32>> cells;
+    quint32 nextId = 1;
+
+    void index(quint32 id, const QRectF& bounds);
+    void unindex(quint32 id, const QRectF& bounds);
+    static QRect cellRange(const QRectF& rect);
+    static quint64 inline cellKey(int cx, int cy) { return (quint64(quint32(cx)) << 32) | quint32(cy); }
+};
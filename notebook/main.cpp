@@ -1,10 +1,61 @@
 #include "Notebook.h"
+#include "InputTrace.h"
 #include <QtWidgets/QApplication>
+#include <qcommandlineparser.h>
+#include <qfile.h>
+#include <qjsondocument.h>
+#include <cstdio>
+#include <cstring>
 
 int main(int argc, char *argv[])
 {
+    // Replays don't need a display, the platform has to be picked before QApplication exists
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--replay") == 0 && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    // Strokes need every move the tablet/mouse reports, the draw tool batches them per frame itself
+    QCoreApplication::setAttribute(Qt::AA_CompressHighFrequencyEvents, false);
     QApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption recordOption("record", "Record canvas input to <trace> until the window closes.", "trace");
+    QCommandLineOption replayOption("replay", "Replay <trace> without a display and print a timing report.", "trace");
+    QCommandLineOption realTimeOption("realtime", "Replay at the recorded speed instead of as fast as possible.");
+    QCommandLineOption reportOption("report", "Write the replay report to <file> instead of stdout.", "file");
+    parser.addOptions({ recordOption, replayOption, realTimeOption, reportOption });
+    parser.process(a);
+
     Notebook w;
+
+    if (parser.isSet(replayOption))
+    {
+        InputTrace trace;
+        if (!trace.load(parser.value(replayOption)))
+        {
+            std::fprintf(stderr, "Can't read trace %s\n", qPrintable(parser.value(replayOption)));
+            return 1;
+        }
+
+        InputReplayer replayer(w.canvas, w.toolSelector);
+        replayer.run(trace, parser.isSet(realTimeOption));
+        const QByteArray json = QJsonDocument(replayer.report()).toJson();
+
+        if (!parser.isSet(reportOption)) { std::fwrite(json.constData(), 1, size_t(json.size()), stdout); return 0; }
+        QFile out(parser.value(reportOption));
+        return out.open(QIODevice::WriteOnly) && out.write(json) == json.size() ? 0 : 1;
+    }
+
+    // Not for replays, they'd write over the journal of a real session
     w.show();
-    return a.exec();
+    w.startAutosave();
+    if (!parser.isSet(recordOption)) return a.exec();
+
+    w.canvas->startRecording();
+    const int result = a.exec();
+    if (!w.canvas->stopRecording(parser.value(recordOption)))
+        std::fprintf(stderr, "Can't write trace %s\n", qPrintable(parser.value(recordOption)));
+    return result;
 }